@@ -7,52 +7,150 @@
 #include <esp_system.h>
 #include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <nvs_flash.h>
 #include <sys/param.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
 #include <cstring>
+#include <optional>
 
 #include "camera_config.hpp"
+#include "frame_clock.hpp"
+#include "frame_copy.hpp"
+#include "metrics.hpp"
+#include "sensor_profile.hpp"
+#include "tracing.hpp"
 
 namespace camera {
 
 static const char* TAG = "camera";
 
-static SemaphoreHandle_t s_fb_mutex;
-
-// normal image buffer
-static uint8_t* s_jpeg_buffer = nullptr;
-// copy of image buffer for another thread
-static uint8_t* s_jpeg_buffer_copy = nullptr;
 // arbitrary buffer size that works for camera settings
 // done this way to only heap allocate once at setup
 static constexpr size_t s_jpeg_buffer_len = 128 * 1024;
-static size_t jpeg_len = 0;
-static uint64_t s_jpeg_timestamp = 0;
+
+// Stored frames. The capture task writes into a slot that is neither the latest nor leased, so with one consumer
+// leasing at a time it never waits and never overwrites a frame that is being sent.
+constexpr size_t frame_slot_count = 3;
+struct FrameSlot {
+  // jpeg_headroom bytes, then up to s_jpeg_buffer_len of JPEG
+  uint8_t* data = nullptr;
+  JpegBuffer frame{};
+  uint8_t leases = 0;
+};
+static std::array<FrameSlot, frame_slot_count> s_slots{};
+static int s_latest_slot = -1;
+// guards the slot bookkeeping, never held during a copy
+static portMUX_TYPE s_slot_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t s_jpeg_sequence = 0;
+// the capture task's copy into a slot, on the GDMA engine when the frame's buffer allows it
+static CopyTicket s_copy_ticket{};
+static std::atomic<FrameTagSource> s_tag_source{nullptr};
+
+// exposure and gain are read over SCCB, which takes a few hundred us, so only every few frames
+static constexpr uint32_t exposure_sample_interval = 8;
+static uint16_t s_exposure = 0;
+static uint16_t s_gain = 0;
+
+struct Exposure {
+  uint16_t exposure;
+  uint16_t gain;
+};
+
+static metrics::Counter s_frames_captured{"roomba_camera_frames_captured_total", "Frames copied out of the sensor"};
+static metrics::Counter s_slots_busy{
+  "roomba_camera_slots_busy_total", "Frames dropped because every stored frame slot was leased"};
+static metrics::Counter s_frames_dropped{
+  "roomba_camera_frames_dropped_total", "Frames discarded by the capture task (missing, invalid or too large)"};
+static metrics::Gauge s_frame_bytes{"roomba_camera_frame_bytes", "Size of the latest captured JPEG"};
+static metrics::Gauge s_state_gauge{"roomba_camera_state", "0 off, 1 standby, 2 capturing"};
+static metrics::Counter s_wakeups{"roomba_camera_wakeups_total", "Times the camera left its idle state"};
+static metrics::Gauge s_first_frame_latency{
+  "roomba_camera_first_frame_latency_us", "Time from the last acquire() to the first frame being available"};
+static metrics::Gauge s_roi_gauge{"roomba_camera_roi", "1 while the sensor crops to a region of interest"};
+static metrics::Gauge s_snapshot_gap{
+  "roomba_camera_snapshot_gap_us", "Time the stream went without a frame around the latest snapshot"};
+static metrics::Counter s_snapshots{"roomba_camera_snapshots_total", "Full resolution stills taken"};
+static metrics::Counter s_idle_ms{"roomba_camera_idle_ms_total", "Time spent idle (off or standby)"};
+static metrics::Histogram s_frame_age{
+  "roomba_camera_frame_age_us",
+  "Time from a frame's VSYNC to it being stored, DMA plus the time it sat in the driver's queue",
+  {20000, 40000, 60000, 80000, 100000, 150000, 200000, 300000, 500000}};
+
+// frames to throw away after a cold start while auto exposure settles
+static constexpr int cold_start_settle_frames = 2;
+
+static TaskHandle_t s_capture_task = nullptr;
+static std::atomic<int> s_demand{0};
+static std::atomic<IdleMode> s_idle_mode{IdleMode::Standby};
+static std::atomic<State> s_state{State::Capturing};
+static std::atomic<int64_t> s_demand_since{0};
+// Sensor registers are reached from the capture task and from set_roi() on the httpd task. The OV2640's are banked, so
+// interleaved SCCB transactions would land in the wrong bank. Held for every register access and around driver
+// (de)init, and guards s_roi. Created on first use, set_roi() can come in before setup() is done.
+static auto sensor_mutex() -> SemaphoreHandle_t {
+  static StaticSemaphore_t s_buffer;
+  static SemaphoreHandle_t s_mutex = xSemaphoreCreateMutexStatic(&s_buffer);
+  return s_mutex;
+}
+// reapplied whenever the driver is initialized
+static std::optional<Roi> s_roi;
+// set by request_snapshot(), cleared by the capture task once it has delivered
+static std::atomic<SnapshotDone> s_snapshot_done{nullptr};
+// written by the request that won s_snapshot_done, -1 until then so the capture task never starts with a stale one
+static std::atomic<int> s_snapshot_quality{-1};
+// capture task only: the still waiting for the stream to come back, and when the stream last stored a frame
+static std::optional<Snapshot> s_pending_snapshot;
+static int64_t s_last_published_us = 0;
+// frames it may take the sensor to settle after each switch
+constexpr int snapshot_switch_frames = 8;
+// entries below the count are written once and never change
+static std::array<FrameListener, max_frame_listeners> s_frame_listeners{};
+static std::atomic<size_t> s_frame_listener_count{0};
+
+class SensorLock {
+ public:
+  SensorLock() {
+    xSemaphoreTake(sensor_mutex(), portMAX_DELAY);
+  }
+  ~SensorLock() {
+    xSemaphoreGive(sensor_mutex());
+  }
+  SensorLock(const SensorLock&) = delete;
+  auto operator=(const SensorLock&) -> SensorLock& = delete;
+  SensorLock(SensorLock&&) = delete;
+  auto operator=(SensorLock&&) -> SensorLock& = delete;
+};
 
 static camera_config_t camera_config = {
-  .pin_pwdn = CAM_PIN_PWDN,
-  .pin_reset = CAM_PIN_RESET,
-  .pin_xclk = CAM_PIN_XCLK,
-  .pin_sccb_sda = CAM_PIN_SIOD,
-  .pin_sccb_scl = CAM_PIN_SIOC,
-
-  .pin_d7 = CAM_PIN_D7,
-  .pin_d6 = CAM_PIN_D6,
-  .pin_d5 = CAM_PIN_D5,
-  .pin_d4 = CAM_PIN_D4,
-  .pin_d3 = CAM_PIN_D3,
-  .pin_d2 = CAM_PIN_D2,
-  .pin_d1 = CAM_PIN_D1,
-  .pin_d0 = CAM_PIN_D0,
-  .pin_vsync = CAM_PIN_VSYNC,
-  .pin_href = CAM_PIN_HREF,
-  .pin_pclk = CAM_PIN_PCLK,
-
-  .xclk_freq_hz = 20000000,  // 20000000,        // The clock frequency of the image sensor
-  .ledc_timer = LEDC_TIMER_0,
-  .ledc_channel = LEDC_CHANNEL_0,
+  .pin_pwdn = board_pins.pwdn,
+  .pin_reset = board_pins.reset,
+  .pin_xclk = board_pins.xclk,
+  .pin_sccb_sda = board_pins.sccb_sda,
+  .pin_sccb_scl = board_pins.sccb_scl,
+
+  .pin_d7 = board_pins.d7,
+  .pin_d6 = board_pins.d6,
+  .pin_d5 = board_pins.d5,
+  .pin_d4 = board_pins.d4,
+  .pin_d3 = board_pins.d3,
+  .pin_d2 = board_pins.d2,
+  .pin_d1 = board_pins.d1,
+  .pin_d0 = board_pins.d0,
+  .pin_vsync = board_pins.vsync,
+  .pin_href = board_pins.href,
+  .pin_pclk = board_pins.pclk,
+
+  // xclk, quality and fb_count are replaced by the detected sensor's profile
+  .xclk_freq_hz = default_sensor_profile.xclk_freq_hz,
+  // the motors use timer 1 and channels 0 to 2, the driver takes these back on every init after an idle power off
+  .ledc_timer = LEDC_TIMER_3,
+  .ledc_channel = LEDC_CHANNEL_7,
   .pixel_format = PIXFORMAT_JPEG,  // The pixel format of the image: PIXFORMAT_ + YUV422|GRAYSCALE|RGB565|JPEG
   .frame_size = FRAMESIZE_VGA,  // FRAMESIZE_SVGA, // 800x600       // FRAMESIZE_SVGA,       // FRAMESIZE_HD (works but
                                 // it's intensive over wifi), //
@@ -63,8 +161,8 @@ static camera_config_t camera_config = {
                                 //       //FRAMESIZE_UXGA, // The
                                 //        resolution
                                 //         size of the image: FRAMESIZE_ + QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA
-  .jpeg_quality = 8,                  // The quality of the JPEG image, ranging from 0 to 63.
-  .fb_count = 8,                      // The number of frame buffers to use.
+  .jpeg_quality = default_sensor_profile.jpeg_quality,  // The quality of the JPEG image, ranging from 0 to 63.
+  .fb_count = default_sensor_profile.fb_count,          // The number of frame buffers to use.
   .fb_location = CAMERA_FB_IN_PSRAM,  // Set the frame buffer storage location
   .grab_mode = CAMERA_GRAB_LATEST,    //  The image capture mode.
                                       // .sccb_i2c_port = 0,                 // Explicitly set I2C port
@@ -72,54 +170,655 @@ static camera_config_t camera_config = {
 
 };
 
+// nullptr until the first init has read the sensor's PID
+static std::atomic<const SensorProfile*> s_sensor_profile{nullptr};
+
+auto active_sensor_profile() -> const SensorProfile& {
+  const SensorProfile* profile = s_sensor_profile.load();
+  return profile != nullptr ? *profile : default_sensor_profile;
+}
+
+static auto init_driver() -> esp_err_t {
+  // initialized at the snapshot size so the frame buffers can hold a still, set down to the stream's size after
+  camera_config_t config = camera_config;
+  config.frame_size = snapshot_frame_size;
+  return esp_camera_init(&config);
+}
+
+// Picks the profile on the first init. The driver only knows the PID once it's running, so it is brought up again
+// if the profile needs a different clock or buffer count.
+static auto detect_sensor() -> esp_err_t {
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  const SensorProfile& profile = sensor_profile_for(sensor->id.PID);
+  s_sensor_profile = &profile;
+  if (profile.pid != sensor->id.PID) {
+    ESP_LOGW(TAG, "No profile for sensor PID 0x%04x, using the %s one", sensor->id.PID, profile.name);
+  } else {
+    ESP_LOGI(TAG, "Detected %s", profile.name);
+  }
+  camera_config.jpeg_quality = profile.jpeg_quality;
+  sensor->set_quality(sensor, profile.jpeg_quality);
+  if (profile.xclk_freq_hz == camera_config.xclk_freq_hz && profile.fb_count == camera_config.fb_count) {
+    return ESP_OK;
+  }
+  camera_config.xclk_freq_hz = profile.xclk_freq_hz;
+  camera_config.fb_count = profile.fb_count;
+  esp_camera_deinit();
+  return init_driver();
+}
+
+static auto apply_roi(const std::optional<Roi>& roi) -> esp_err_t;
+static auto set_state(State state) -> void;
+
+// Called with the sensor lock held.
 static auto init_camera() -> esp_err_t {
-  esp_err_t err = esp_camera_init(&camera_config);
+  esp_err_t err = init_driver();
+  if (err == ESP_OK && s_sensor_profile.load() == nullptr) {
+    err = detect_sensor();
+  }
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Camera Init Failed");
     return err;
   }
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor != nullptr && sensor->set_framesize(sensor, camera_config.frame_size) < 0) {
+    ESP_LOGE(TAG, "Failed to set the stream frame size");
+    return ESP_FAIL;
+  }
+  if (init_frame_clock(board_pins.vsync) != ESP_OK) {
+    ESP_LOGW(TAG, "Frames are stamped with the driver's time");
+  }
+  if (s_roi && apply_roi(s_roi) != ESP_OK) {
+    ESP_LOGW(TAG, "Failed to restore the region of interest, sending the full view");
+  }
 
   return ESP_OK;
 }
 
-void setup() {
-  // s_jpeg_buffer = (uint8_t*)heap_caps_malloc(s_jpeg_buffer_len, MALLOC_CAP_SPIRAM);
-  // s_jpeg_buffer_copy = (uint8_t*)heap_caps_malloc(s_jpeg_buffer_len, MALLOC_CAP_SPIRAM);
-  s_jpeg_buffer = (uint8_t*)malloc(s_jpeg_buffer_len);
-  s_jpeg_buffer_copy = (uint8_t*)malloc(s_jpeg_buffer_len);
-  
-if ((s_jpeg_buffer == nullptr) || (s_jpeg_buffer_copy == nullptr)) {
-    ESP_LOGE(TAG, "Failed to allocate PSRAM buffers");
+// A slot the capture task may write, -1 if consumers hold all the others.
+static auto claim_free_slot() -> int {
+  int slot = -1;
+  portENTER_CRITICAL(&s_slot_lock);
+  for (size_t i = 0; i < s_slots.size(); i++) {
+    if (static_cast<int>(i) != s_latest_slot && s_slots[i].leases == 0) {
+      slot = static_cast<int>(i);
+      break;
+    }
+  }
+  portEXIT_CRITICAL(&s_slot_lock);
+  return slot;
+}
+
+static auto publish_slot(int slot) -> void {
+  portENTER_CRITICAL(&s_slot_lock);
+  s_latest_slot = slot;
+  portEXIT_CRITICAL(&s_slot_lock);
 }
-  if (ESP_OK != init_camera()) {
+
+// Starts copying the frame into a free slot, finish_store() waits for it. nullptr if no slot was free.
+static auto begin_store(const camera_fb_t& fb) -> FrameSlot* {
+  int slot = claim_free_slot();
+  if (slot < 0) {
+    s_slots_busy.increment();
+    return nullptr;
+  }
+  FrameSlot& target = s_slots[static_cast<size_t>(slot)];
+  // The engine moves whole blocks. The driver's JPEG buffers are far larger than any frame, so reading up to the next
+  // block boundary stays inside them, and the bytes past fb.len are never looked at.
+  size_t copy_len = std::min((fb.len + copy_alignment - 1) / copy_alignment * copy_alignment, s_jpeg_buffer_len);
+  start_copy(s_copy_ticket, target.data + jpeg_headroom, fb.buf, copy_len);
+  return &target;
+}
+
+// Fills in everything but the exposure and tag once the copy has landed.
+static auto finish_store(FrameSlot& target, const camera_fb_t& fb, int64_t capture_us) -> void {
+  wait_copy(s_copy_ticket);
+  target.frame.buffer = target.data + jpeg_headroom;
+  target.frame.len = fb.len;
+  target.frame.timestamp = static_cast<uint64_t>(capture_us);
+  target.frame.sequence = ++s_jpeg_sequence;
+}
+
+// Stores one frame so lease_latest_frame() has something to hand out before the capture task runs.
+static auto prime_jpeg_buffer() -> esp_err_t {
+  camera_fb_t* fb = esp_camera_fb_get();
+  if (fb == nullptr) {
+    return ESP_FAIL;
+  }
+  esp_err_t err = ESP_ERR_INVALID_SIZE;
+  if (fb->len >= JPEG_HEADER_SIZE && fb->len <= s_jpeg_buffer_len && fb->buf[0] == JPEG_SOI_MARKER_FIRST &&
+      fb->buf[1] == JPEG_SOI_MARKER_SECOND) {
+    FrameSlot* stored = begin_store(*fb);
+    if (stored != nullptr) {
+      finish_store(*stored, *fb, frame_capture_time_us(fb->timestamp));
+      publish_slot(static_cast<int>(stored - s_slots.data()));
+      err = ESP_OK;
+    }
+  }
+  esp_camera_fb_return(fb);
+  return err;
+}
+
+auto setup() -> esp_err_t {
+  // aligned so the JPEG after the headroom starts on a block the copy engine can write
+  for (FrameSlot& slot : s_slots) {
+    slot.data = static_cast<uint8_t*>(
+      heap_caps_aligned_alloc(copy_alignment, jpeg_headroom + s_jpeg_buffer_len, MALLOC_CAP_SPIRAM));
+    if (slot.data == nullptr) {
+      ESP_LOGE(TAG, "Failed to allocate PSRAM buffers");
+      return ESP_ERR_NO_MEM;
+    }
+  }
+
+  init_copy_ticket(s_copy_ticket);
+  // falls back to memcpy without the engine
+  init_frame_copy();
+
+  esp_err_t err = ESP_OK;
+  {
+    SensorLock lock;
+    err = init_camera();
+  }
+  if (err != ESP_OK) {
     ESP_LOGE(TAG, "Camera Init Failed");
+    // the capture task retries the init while someone wants frames
+    set_state(State::Off);
+    return err;
+  }
+
+  err = prime_jpeg_buffer();
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "No usable frame from the sensor after init");
+  }
+  return err;
+}
+
+auto acquire() -> void {
+  if (s_demand.fetch_add(1) == 0) {
+    s_demand_since = esp_timer_get_time();
+    if (s_capture_task != nullptr) {
+      xTaskNotifyGive(s_capture_task);
+    }
+  }
+}
+
+auto release() -> void {
+  int previous = s_demand.fetch_sub(1);
+  if (previous <= 0) {
+    // unbalanced release, don't go negative
+    s_demand.fetch_add(1);
+  }
+}
+
+auto set_idle_mode(IdleMode mode) -> void {
+  s_idle_mode = mode;
+}
+
+auto add_frame_listener(FrameListener listener) -> void {
+  size_t count = s_frame_listener_count.load();
+  if (count >= s_frame_listeners.size()) {
+    ESP_LOGE(TAG, "Too many frame listeners");
     return;
   }
+  s_frame_listeners[count] = listener;
+  s_frame_listener_count.store(count + 1);
+}
+
+auto get_state() -> State {
+  return s_state;
+}
+
+auto set_jpeg_quality(int quality) -> esp_err_t {
+  if (quality < 0 || quality > 63) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  // the governor calls this from the main task while the capture task samples exposure
+  SensorLock lock;
+  camera_config.jpeg_quality = quality;
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr || s_state == State::Off) {
+    // picked up by the next init
+    return ESP_OK;
+  }
+  return sensor->set_quality(sensor, quality) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+auto get_jpeg_quality() -> int {
+  return camera_config.jpeg_quality;
+}
+
+auto full_view() -> Roi {
+  const resolution_info_t& size = resolution[camera_config.frame_size];
+  return Roi{0, 0, size.width, size.height};
+}
 
-  s_fb_mutex = xSemaphoreCreateMutex();
+static auto round_down(int value, int step) -> int {
+  return value / step * step;
 }
-auto copy_jpeg_buffer() -> JpegBuffer {
-  static constexpr TickType_t xTicksToWait = pdMS_TO_TICKS(3000);  // portMAX_DELAY
-  if (xSemaphoreTake(s_fb_mutex, xTicksToWait) != pdTRUE) {
-    return JpegBuffer{nullptr, 0, 0};
+
+// OV2640: the DSP scales a window of one of the sensor's three readout modes to the output size. The driver picks the
+// mode from the frame size, so the window is in that mode's pixels.
+static auto set_ov2640_window(sensor_t* sensor, const Roi& roi, const Roi& full) -> int {
+  // mode 0 is UXGA, 1 SVGA, 2 CIF, as in the driver's set_framesize()
+  int mode = 0;
+  int max_x = 1600;
+  int max_y = 1200;
+  if (camera_config.frame_size <= FRAMESIZE_CIF) {
+    mode = 2;
+    max_x = 400;
+    max_y = 296;
+  } else if (camera_config.frame_size <= FRAMESIZE_SVGA) {
+    mode = 1;
+    max_x = 800;
+    max_y = 600;
   }
+  int offset_x = round_down(roi.x * max_x / full.width, 8);
+  int offset_y = round_down(roi.y * max_y / full.height, 8);
+  int window_x = std::max(round_down(roi.width * max_x / full.width, 8), 8);
+  int window_y = std::max(round_down(roi.height * max_y / full.height, 8), 8);
+  return sensor->set_res_raw(
+    sensor, mode, 0, 0, 0, offset_x, offset_y, window_x, window_y, roi.width, roi.height, false, false);
+}
 
-  memcpy(s_jpeg_buffer_copy, s_jpeg_buffer, jpeg_len);
-  xSemaphoreGive(s_fb_mutex);
-  return JpegBuffer{s_jpeg_buffer_copy, jpeg_len, s_jpeg_timestamp};
+// OV5640: the window is a part of the pixel array, with the same margins and line timing as the driver's 4:3 full view
+// so the frame rate doesn't change.
+static auto set_ov5640_window(sensor_t* sensor, const Roi& roi, const Roi& full) -> int {
+  // the driver's 4:3 entry: array window 0,0 to 2655,1951, ISP offset 32,16, output up to 2560x1920
+  constexpr int max_x = 2560;
+  constexpr int max_y = 1920;
+  constexpr int margin_x = 2656 - max_x;
+  constexpr int margin_y = 1952 - max_y;
+  constexpr int offset_x = 32;
+  constexpr int offset_y = 16;
+  constexpr int total_x = 2844;
+  constexpr int total_y = 1968;
+  int window_x = std::max(round_down(roi.width * max_x / full.width, 16), 16);
+  int window_y = std::max(round_down(roi.height * max_y / full.height, 8), 8);
+  int start_x = std::min(round_down(roi.x * max_x / full.width, 16), max_x - window_x);
+  int start_y = std::min(round_down(roi.y * max_y / full.height, 8), max_y - window_y);
+  // the driver bins 2x2 up to SVGA
+  bool binning = camera_config.frame_size <= FRAMESIZE_SVGA;
+  return sensor->set_res_raw(
+    sensor,
+    start_x,
+    start_y,
+    start_x + window_x + margin_x - 1,
+    start_y + window_y + margin_y - 1,
+    offset_x,
+    offset_y,
+    total_x,
+    total_y,
+    roi.width,
+    roi.height,
+    true,
+    binning);
+}
+
+// Called with the sensor lock held.
+static auto apply_roi(const std::optional<Roi>& roi) -> esp_err_t {
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  int ret = 0;
+  if (!roi) {
+    ret = sensor->set_framesize(sensor, camera_config.frame_size);
+  } else {
+    if (sensor->set_res_raw == nullptr || resolution[camera_config.frame_size].aspect_ratio != ASPECT_RATIO_4X3) {
+      return ESP_ERR_NOT_SUPPORTED;
+    }
+    Roi full = full_view();
+    switch (sensor->id.PID) {
+      case OV2640_PID:
+        ret = set_ov2640_window(sensor, *roi, full);
+        break;
+      case OV5640_PID:
+        ret = set_ov5640_window(sensor, *roi, full);
+        break;
+      default:
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+  }
+  return ret < 0 ? ESP_FAIL : ESP_OK;
+}
+
+auto set_roi(std::optional<Roi> roi) -> esp_err_t {
+  if (roi) {
+    Roi full = full_view();
+    // JPEG encodes 16x8 blocks
+    roi->x = static_cast<uint16_t>(round_down(roi->x, 16));
+    roi->y = static_cast<uint16_t>(round_down(roi->y, 8));
+    roi->width = static_cast<uint16_t>(round_down(roi->width, 16));
+    roi->height = static_cast<uint16_t>(round_down(roi->height, 8));
+    if (roi->width == 0 || roi->height == 0 || roi->x + roi->width > full.width || roi->y + roi->height > full.height) {
+      return ESP_ERR_INVALID_ARG;
+    }
+  }
+  SensorLock lock;
+  if (esp_camera_sensor_get() != nullptr && s_state != State::Off) {
+    esp_err_t err = apply_roi(roi);
+    if (err != ESP_OK) {
+      return err;
+    }
+  }
+  // otherwise picked up by the next init
+  s_roi = roi;
+  s_roi_gauge.set(roi ? 1 : 0);
+  return ESP_OK;
+}
+
+auto get_roi() -> std::optional<Roi> {
+  SensorLock lock;
+  return s_roi;
+}
+
+auto request_snapshot(int quality, SnapshotDone done) -> esp_err_t {
+  if (quality < 0 || quality > 63 || done == nullptr) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  SnapshotDone idle = nullptr;
+  if (!s_snapshot_done.compare_exchange_strong(idle, done)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  s_snapshot_quality = quality;
+  // wakes the camera if nobody is streaming
+  acquire();
+  return ESP_OK;
+}
+
+// Width and height from the SOF0 marker. The driver labels frames with the size it is set to, not the size they were
+// captured at, and the first frames after a switch are still at the old one.
+static auto jpeg_dimensions(const camera_fb_t& fb) -> std::pair<uint16_t, uint16_t> {
+  size_t offset = 2;
+  while (offset + 9 <= fb.len && fb.buf[offset] == 0xFF) {
+    uint8_t marker = fb.buf[offset + 1];
+    if (marker == 0xC0) {
+      return {
+        static_cast<uint16_t>((fb.buf[offset + 7] << 8) | fb.buf[offset + 8]),
+        static_cast<uint16_t>((fb.buf[offset + 5] << 8) | fb.buf[offset + 6])};
+    }
+    if (marker == 0xDA) {
+      break;
+    }
+    offset += 2 + ((static_cast<size_t>(fb.buf[offset + 2]) << 8) | fb.buf[offset + 3]);
+  }
+  return {0, 0};
+}
+
+// Switches the sensor to the snapshot size for one frame and back. Returns the first frame at the stream's size after
+// that for the capture loop to carry on with, nullptr if none came in time.
+static auto take_snapshot(Snapshot& snapshot) -> camera_fb_t* {
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr) {
+    return nullptr;
+  }
+  const resolution_info_t& still = resolution[snapshot_frame_size];
+  int64_t switch_start = esp_timer_get_time();
+  {
+    SensorLock lock;
+    sensor->set_framesize(sensor, snapshot_frame_size);
+    sensor->set_quality(sensor, s_snapshot_quality.load());
+  }
+  for (int i = 0; i < snapshot_switch_frames && snapshot.buffer == nullptr; i++) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (fb == nullptr) {
+      continue;
+    }
+    if (jpeg_dimensions(*fb) == std::pair<uint16_t, uint16_t>{still.width, still.height}) {
+      snapshot.buffer = static_cast<uint8_t*>(heap_caps_malloc(fb->len, MALLOC_CAP_SPIRAM));
+      if (snapshot.buffer == nullptr) {
+        ESP_LOGE(TAG, "No PSRAM for a %u byte snapshot", static_cast<unsigned>(fb->len));
+        esp_camera_fb_return(fb);
+        break;
+      }
+      memcpy(snapshot.buffer, fb->buf, fb->len);
+      snapshot.len = fb->len;
+      snapshot.width = still.width;
+      snapshot.height = still.height;
+      snapshot.timestamp = frame_capture_time_us(fb->timestamp);
+    }
+    esp_camera_fb_return(fb);
+  }
+
+  Roi stream{};
+  {
+    SensorLock lock;
+    sensor->set_framesize(sensor, camera_config.frame_size);
+    sensor->set_quality(sensor, camera_config.jpeg_quality);
+    if (s_roi) {
+      apply_roi(s_roi);
+    }
+    stream = s_roi.value_or(full_view());
+  }
+  camera_fb_t* resumed = nullptr;
+  for (int i = 0; i < snapshot_switch_frames && resumed == nullptr; i++) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (fb == nullptr) {
+      continue;
+    }
+    if (jpeg_dimensions(*fb) == std::pair<uint16_t, uint16_t>{stream.width, stream.height}) {
+      resumed = fb;
+    } else {
+      esp_camera_fb_return(fb);
+    }
+  }
+  ESP_LOGI(
+    TAG,
+    "Snapshot %ux%u, %u bytes, sensor back after %" PRId64 " us",
+    snapshot.width,
+    snapshot.height,
+    static_cast<unsigned>(snapshot.len),
+    esp_timer_get_time() - switch_start);
+  return resumed;
+}
+
+// Once the stream has stored its first frame after the switch.
+static auto finish_snapshot(int64_t published_us) -> void {
+  Snapshot& snapshot = *s_pending_snapshot;
+  if (s_last_published_us > 0) {
+    snapshot.stream_gap_us = static_cast<uint32_t>(published_us - s_last_published_us);
+    s_snapshot_gap.set(static_cast<int32_t>(snapshot.stream_gap_us));
+  }
+  if (snapshot.buffer != nullptr) {
+    s_snapshots.increment();
+  }
+  SnapshotDone done = s_snapshot_done.load();
+  done(snapshot);
+  s_pending_snapshot.reset();
+  s_snapshot_quality = -1;
+  s_snapshot_done = nullptr;
+  release();
+}
+
+static auto set_state(State state) -> void {
+  s_state = state;
+  s_state_gauge.set(static_cast<int32_t>(state));
+}
+
+// Soft standby keeps the registers, the sensor just stops driving the bus. Called with the sensor lock held.
+static auto set_sensor_standby(bool standby) -> esp_err_t {
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  int ret = 0;
+  switch (sensor->id.PID) {
+    case OV2640_PID:
+      // COM2 (bank 1, 0x09) bit 4: standby
+      ret = sensor->set_reg(sensor, 0x109, 0x10, standby ? 0x10 : 0x00);
+      break;
+    case OV5640_PID:
+      // SYSTEM CTROL0 (0x3008) bit 6: software power down
+      ret = sensor->set_reg(sensor, 0x3008, 0x40, standby ? 0x40 : 0x00);
+      break;
+    default:
+      return ESP_ERR_NOT_SUPPORTED;
+  }
+  return ret < 0 ? ESP_FAIL : ESP_OK;
+}
+
+struct Wake {
+  int64_t time;     // frames exposed before this are stale
+  bool cold_start;  // the driver was reinitialized, auto exposure needs a few frames
+};
+
+// Puts the camera in its idle mode, blocks until someone acquires it and wakes it back up.
+static auto idle_until_demand() -> Wake {
+  IdleMode mode = s_idle_mode;
+  {
+    SensorLock lock;
+    if (mode == IdleMode::Standby && set_sensor_standby(true) != ESP_OK) {
+      ESP_LOGW(TAG, "Sensor standby not supported, turning the camera off instead");
+      mode = IdleMode::Off;
+    }
+    if (mode == IdleMode::Off) {
+      esp_camera_deinit();
+    }
+    set_state(mode == IdleMode::Off ? State::Off : State::Standby);
+  }
+  ESP_LOGI(TAG, "No consumers, camera %s", mode == IdleMode::Off ? "off" : "in standby");
+
+  int64_t idle_start = esp_timer_get_time();
+  while (s_demand == 0) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+  int64_t wake_start = esp_timer_get_time();
+  s_idle_ms.increment(static_cast<uint32_t>((wake_start - idle_start) / 1000));
+  s_wakeups.increment();
+
+  SensorLock lock;
+  if (mode == IdleMode::Off) {
+    if (init_camera() != ESP_OK) {
+      // leave the state as off, the capture loop retries through fb_get failures
+      return Wake{wake_start, true};
+    }
+  } else {
+    set_sensor_standby(false);
+  }
+  set_state(State::Capturing);
+  return Wake{wake_start, mode == IdleMode::Off};
+}
+
+auto lease_latest_frame() -> FrameLease {
+  FrameLease lease{};
+  portENTER_CRITICAL(&s_slot_lock);
+  if (s_latest_slot >= 0) {
+    FrameSlot& slot = s_slots[static_cast<size_t>(s_latest_slot)];
+    slot.leases++;
+    lease.frame = slot.frame;
+    lease.slot = s_latest_slot;
+  }
+  portEXIT_CRITICAL(&s_slot_lock);
+  return lease;
+}
+
+auto release_frame(FrameLease& lease) -> void {
+  if (lease.slot < 0) {
+    return;
+  }
+  portENTER_CRITICAL(&s_slot_lock);
+  s_slots[static_cast<size_t>(lease.slot)].leases--;
+  portEXIT_CRITICAL(&s_slot_lock);
+  lease = FrameLease{};
+}
+
+auto set_frame_tag_source(FrameTagSource source) -> void {
+  s_tag_source = source;
+}
+
+// Raw register values, their units depend on the sensor. Unknown sensors report nothing.
+static auto sample_exposure() -> std::optional<Exposure> {
+  SensorLock lock;
+  sensor_t* sensor = esp_camera_sensor_get();
+  if (sensor == nullptr || sensor->get_reg == nullptr) {
+    return std::nullopt;
+  }
+  int exposure = 0;
+  int gain = 0;
+  switch (sensor->id.PID) {
+    case OV2640_PID: {
+      // sensor bank (0x100), AEC is split over REG45[5:0], AEC[7:0] and REG04[1:0] in lines
+      int high = sensor->get_reg(sensor, 0x145, 0x3F);
+      int mid = sensor->get_reg(sensor, 0x110, 0xFF);
+      int low = sensor->get_reg(sensor, 0x104, 0x03);
+      exposure = high < 0 || mid < 0 || low < 0 ? 0 : (high << 10) | (mid << 2) | low;
+      gain = sensor->get_reg(sensor, 0x100, 0xFF);
+      break;
+    }
+    case OV5640_PID:
+    case OV3660_PID: {
+      // 0x3500..0x3502 in 1/16 lines, 0x350A..0x350B in 1/16 gain steps
+      int value = sensor->get_reg(sensor, 0x3500, 0xFFFFF);
+      exposure = value < 0 ? 0 : value >> 4;
+      gain = sensor->get_reg(sensor, 0x350A, 0x3FF);
+      break;
+    }
+    default:
+      return std::nullopt;
+  }
+  return Exposure{
+    static_cast<uint16_t>(std::clamp(exposure, 0, UINT16_MAX)), static_cast<uint16_t>(std::max(gain, 0))};
 }
 
 void camera_capture_task(void* arg) {
+  s_capture_task = xTaskGetCurrentTaskHandle();
+  // frames captured before this are left over from before the last idle period
+  int64_t wake_time = 0;
+  int settle_frames = 0;
+  bool waiting_for_first_frame = false;
+
   while (true) {
-    camera_fb_t* fb = esp_camera_fb_get();
+    if (s_demand == 0) {
+      Wake wake = idle_until_demand();
+      wake_time = wake.time;
+      settle_frames = wake.cold_start ? cold_start_settle_frames : 0;
+      waiting_for_first_frame = true;
+      s_last_published_us = 0;
+      continue;
+    }
+
+    if (s_state == State::Off) {
+      // reinit after waking from off failed, keep trying while someone wants frames
+      esp_err_t err = ESP_OK;
+      {
+        SensorLock lock;
+        err = init_camera();
+        if (err == ESP_OK) {
+          set_state(State::Capturing);
+        }
+      }
+      if (err != ESP_OK) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        continue;
+      }
+    }
+
+    camera_fb_t* fb = nullptr;
+    // after the first frame, so a snapshot that woke the camera gets settled exposure
+    if (
+      s_snapshot_done.load() != nullptr && s_snapshot_quality.load() >= 0 && !s_pending_snapshot &&
+      !waiting_for_first_frame) {
+      s_pending_snapshot = Snapshot{};
+      fb = take_snapshot(*s_pending_snapshot);
+    }
+    if (fb == nullptr) {
+      int64_t wait_start = esp_timer_get_time();
+      fb = esp_camera_fb_get();
+      tracing::record(tracing::Span::SensorWait, wait_start, esp_timer_get_time());
+    }
     if (fb == nullptr) {  // Add explicit check for null
       ESP_LOGE(TAG, "Failed to get camera frame");
+      s_frames_dropped.increment();
       vTaskDelay(pdMS_TO_TICKS(100));
       continue;
     }
 
     if (fb->len <= 0 || fb->buf == nullptr) {
       ESP_LOGE(TAG, "Invalid frame buffer: len=%d, buf=%p", fb->len, fb->buf);
+      s_frames_dropped.increment();
       esp_camera_fb_return(fb);
       vTaskDelay(pdMS_TO_TICKS(100));
       continue;
@@ -128,47 +827,80 @@ void camera_capture_task(void* arg) {
     // Check for valid JPEG
     if (fb->len < JPEG_HEADER_SIZE || fb->buf[0] != JPEG_SOI_MARKER_FIRST || fb->buf[1] != JPEG_SOI_MARKER_SECOND) {
       ESP_LOGE(TAG, "Invalid JPEG data: first bytes: %02x %02x", fb->buf[0], fb->buf[1]);
+      s_frames_dropped.increment();
       esp_camera_fb_return(fb);
       vTaskDelay(pdMS_TO_TICKS(100));
       continue;
     }
 
-    // Add size check against buffer
-    if (fb->len > s_jpeg_buffer_len) {
-      ESP_LOGE(TAG, "Frame too large: %d > %d", fb->len, s_jpeg_buffer_len);
+    // from here on fb->timestamp is the VSYNC time in the esp_timer clock, so listeners get it too
+    int64_t frame_start = frame_capture_time_us(fb->timestamp);
+    fb->timestamp.tv_sec = static_cast<time_t>(frame_start / 1000000);
+    fb->timestamp.tv_usec = static_cast<suseconds_t>(frame_start % 1000000);
+    if (frame_start < wake_time || settle_frames > 0) {
+      settle_frames = settle_frames > 0 ? settle_frames - 1 : 0;
       esp_camera_fb_return(fb);
-      vTaskDelay(pdMS_TO_TICKS(100));
       continue;
     }
 
-    if (xSemaphoreTake(s_fb_mutex, portMAX_DELAY) != pdTRUE) {
-      ESP_LOGE(TAG, "Failed to take mutex");
+    // Add size check against buffer
+    if (fb->len > s_jpeg_buffer_len) {
+      ESP_LOGE(TAG, "Frame too large: %d > %d", fb->len, s_jpeg_buffer_len);
+      s_frames_dropped.increment();
       esp_camera_fb_return(fb);
       vTaskDelay(pdMS_TO_TICKS(100));
       continue;
     }
 
-    // Add null check for buffer before copy
-    if (s_jpeg_buffer == nullptr) {
-      ESP_LOGE(TAG, "JPEG buffer is null");
-      xSemaphoreGive(s_fb_mutex);
-      esp_camera_fb_return(fb);
-      vTaskDelay(pdMS_TO_TICKS(100));
-      continue;
+    int64_t copy_start = esp_timer_get_time();
+    FrameSlot* stored_slot = begin_store(*fb);
+
+    // the SCCB reads overlap the copy
+    std::optional<Exposure> exposure;
+    if (s_jpeg_sequence % exposure_sample_interval == 0) {
+      exposure = sample_exposure();
     }
 
-    memcpy(s_jpeg_buffer, fb->buf, fb->len);
-    jpeg_len = fb->len;
-    s_jpeg_timestamp = esp_timer_get_time();
+    if (stored_slot != nullptr) {
+      // blocks instead of spinning in memcpy, the stream and motor tasks get the core meanwhile
+      finish_store(*stored_slot, *fb, frame_start);
+      JpegBuffer& frame = stored_slot->frame;
+      if (exposure) {
+        s_exposure = exposure->exposure;
+        s_gain = exposure->gain;
+      }
+      frame.exposure = s_exposure;
+      frame.gain = s_gain;
+      FrameTagSource tag_source = s_tag_source.load();
+      frame.tag = tag_source != nullptr ? tag_source() : 0;
+      publish_slot(static_cast<int>(stored_slot - s_slots.data()));
+      int64_t published_us = esp_timer_get_time();
+      if (s_pending_snapshot) {
+        finish_snapshot(published_us);
+      }
+      s_last_published_us = published_us;
+    }
 
-    xSemaphoreGive(s_fb_mutex);
+    int64_t stored = esp_timer_get_time();
+    tracing::record(tracing::Span::CaptureCopy, copy_start, stored, fb->len);
+    tracing::record(tracing::Span::FrameAge, frame_start, stored);
+    s_frame_age.observe(static_cast<uint32_t>(std::max<int64_t>(stored - frame_start, 0)));
+    size_t listener_count = s_frame_listener_count.load();
+    for (size_t i = 0; i < listener_count; i++) {
+      s_frame_listeners[i](*fb);
+    }
+    s_frame_bytes.set(static_cast<int32_t>(fb->len));
     esp_camera_fb_return(fb);
+    s_frames_captured.increment();
+    if (waiting_for_first_frame) {
+      waiting_for_first_frame = false;
+      int64_t latency = esp_timer_get_time() - s_demand_since;
+      s_first_frame_latency.set(static_cast<int32_t>(latency));
+      ESP_LOGI(TAG, "First frame %" PRId64 " us after acquire", latency);
+    }
 
-    // needs to be tweaked, not entirely sure why or when
-    // depends on a lot of factors
-    // make sure you update the ws delay too
-    // vTaskDelay(pdMS_TO_TICKS(30)); // 5640
-    vTaskDelay(pdMS_TO_TICKS(10));  // 2640
+    // measured per sensor, goes with the stream's frame interval
+    vTaskDelay(pdMS_TO_TICKS(active_sensor_profile().capture_delay_ms));
   }
 }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <optional>
 #include <tuple>
 
 #include "esp_camera.h"
@@ -13,13 +14,99 @@ constexpr uint8_t JPEG_SOI_MARKER_SECOND = 0xD8;
 struct JpegBuffer {
   uint8_t* buffer;
   size_t len;
+  // VSYNC of the frame in esp_timer_get_time() us, see frame_clock.hpp
   uint64_t timestamp;
+  // counts the frames the capture task kept, gaps on the client are frames that were never sent
+  uint32_t sequence = 0;
+  // raw sensor values sampled around the capture, 0 when the sensor isn't supported
+  uint16_t exposure = 0;
+  uint16_t gain = 0;
+  // what the tag source returned when the frame was stored
+  uint64_t tag = 0;
 };
 
-auto setup() -> void;
+// A leased frame has this many bytes in front of its buffer the lease holder may write, so a header can be put in
+// front of the JPEG without copying it. A whole copy block, so the JPEG stays aligned for the copy engine.
+constexpr size_t jpeg_headroom = 64;
+
+// A stored frame the capture task won't overwrite until release_frame(). slot is -1 for an empty lease.
+struct FrameLease {
+  JpegBuffer frame{nullptr, 0, 0};
+  int slot = -1;
+};
+
+// What the sensor does while nobody is consuming frames.
+//   Standby: driver stays loaded and the sensor is put in soft standby, quick to wake.
+//   Off: driver is deinitialized (no XCLK, no DMA, frame buffers freed), slow to wake.
+enum class IdleMode : uint8_t { Standby, Off };
+
+enum class State : uint8_t { Off = 0, Standby = 1, Capturing = 2 };
+
+// Initializes the driver and captures a first frame into the stream buffer.
+auto setup() -> esp_err_t;
 auto camera_capture_task(void* arg) -> void;
 
-// safe to call from another thread
-auto copy_jpeg_buffer() -> JpegBuffer;
+// Frames are only captured while at least one consumer holds the camera.
+auto acquire() -> void;
+auto release() -> void;
+auto set_idle_mode(IdleMode mode) -> void;
+[[nodiscard]] auto get_state() -> State;
+
+// 0 (best) to 63, kept across an idle power off
+auto set_jpeg_quality(int quality) -> esp_err_t;
+[[nodiscard]] auto get_jpeg_quality() -> int;
+
+// A window of the full view in output pixels of the configured frame size, e.g. {0, 240, 640, 240} for the lower half
+// of VGA. The sensor crops it before JPEG encoding, so frames shrink but keep the full view's pixel scale.
+// x and width are rounded to 16, y and height to 8.
+struct Roi {
+  uint16_t x;
+  uint16_t y;
+  uint16_t width;
+  uint16_t height;
+};
+// The configured frame size as a Roi, for building a window.
+[[nodiscard]] auto full_view() -> Roi;
+// nullopt goes back to the full view. Takes effect within a frame or two, kept across an idle power off. Safe from any
+// task, it waits for register access the capture task has in progress.
+// ESP_ERR_NOT_SUPPORTED for sensors other than the OV2640 and OV5640 and for frame sizes that aren't 4:3.
+auto set_roi(std::optional<Roi> roi) -> esp_err_t;
+[[nodiscard]] auto get_roi() -> std::optional<Roi>;
+
+// The driver's frame buffers are sized for this from init, so the sensor can switch to it for a single frame.
+constexpr framesize_t snapshot_frame_size = FRAMESIZE_UXGA;
+
+// A still at snapshot_frame_size. buffer is PSRAM from heap_caps_malloc() that the receiver owns and frees.
+struct Snapshot {
+  uint8_t* buffer = nullptr;
+  size_t len = 0;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  // VSYNC of the still in esp_timer_get_time() us
+  int64_t timestamp = 0;
+  // from the last frame stored before the switch to the first one stored after it
+  uint32_t stream_gap_us = 0;
+};
+// Called from the capture task once the stream is back, with a nullptr buffer if no still came. Must not block.
+using SnapshotDone = void (*)(const Snapshot& snapshot);
+// The capture task switches the sensor to snapshot_frame_size and quality for one frame, then back. Holds the camera
+// until done is called. ESP_ERR_INVALID_STATE while another snapshot is pending.
+auto request_snapshot(int quality, SnapshotDone done) -> esp_err_t;
+
+// The newest stored frame, without copying it. Safe from any task, but only one consumer should hold a lease at a
+// time: with more, the capture task can run out of slots and drops frames until one is released.
+[[nodiscard]] auto lease_latest_frame() -> FrameLease;
+auto release_frame(FrameLease& lease) -> void;
+
+// Called from the capture task, under the buffer lock, as each frame is stored. Keep it to reading an atomic.
+using FrameTagSource = uint64_t (*)();
+auto set_frame_tag_source(FrameTagSource source) -> void;
+
+// Called from the capture task with every frame it keeps, before the driver buffer is returned.
+// It holds up the next capture, so it must copy the frame out and return, never block.
+// fb.timestamp is the frame's VSYNC in esp_timer_get_time() time.
+using FrameListener = void (*)(const camera_fb_t& fb);
+constexpr size_t max_frame_listeners = 4;
+auto add_frame_listener(FrameListener listener) -> void;
 
 }  // namespace camera
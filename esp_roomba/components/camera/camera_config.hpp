@@ -28,131 +28,112 @@
 #endif
 
 namespace camera {
-#define BOARD_SEEED_XIAO_ESP32S3_SENSE 1
-// #define BOARD_SEEED_XIAO_ESP32S3_SENSE_MOCK 1
 
-// WROVER-KIT PIN Map
-#ifdef BOARD_WROVER_KIT
-
-#define CAM_PIN_PWDN -1   // power down is not used
-#define CAM_PIN_RESET -1  // software reset will be performed
-#define CAM_PIN_XCLK 21
-#define CAM_PIN_SIOD 26
-#define CAM_PIN_SIOC 27
-
-#define CAM_PIN_D7 35
-#define CAM_PIN_D6 34
-#define CAM_PIN_D5 39
-#define CAM_PIN_D4 36
-#define CAM_PIN_D3 19
-#define CAM_PIN_D2 18
-#define CAM_PIN_D1 5
-#define CAM_PIN_D0 4
-#define CAM_PIN_VSYNC 25
-#define CAM_PIN_HREF 23
-#define CAM_PIN_PCLK 22
-
-#endif
-
-// ESP32Cam (AiThinker) PIN Map
-#ifdef BOARD_ESP32CAM_AITHINKER
-
-#define CAM_PIN_PWDN 32
-#define CAM_PIN_RESET -1  // software reset will be performed
-#define CAM_PIN_XCLK 0
-#define CAM_PIN_SIOD 26
-#define CAM_PIN_SIOC 27
-
-#define CAM_PIN_D7 35
-#define CAM_PIN_D6 34
-#define CAM_PIN_D5 39
-#define CAM_PIN_D4 36
-#define CAM_PIN_D3 21
-#define CAM_PIN_D2 19
-#define CAM_PIN_D1 18
-#define CAM_PIN_D0 5
-#define CAM_PIN_VSYNC 25
-#define CAM_PIN_HREF 23
-#define CAM_PIN_PCLK 22
-
-#endif
-// ESP32S3 (WROOM) PIN Map
-#ifdef BOARD_ESP32S3_WROOM
-#define CAM_PIN_PWDN 38
-#define CAM_PIN_RESET -1  // software reset will be performed
-#define CAM_PIN_VSYNC 6
-#define CAM_PIN_HREF 7
-#define CAM_PIN_PCLK 13
-#define CAM_PIN_XCLK 15
-#define CAM_PIN_SIOD 4
-#define CAM_PIN_SIOC 5
-#define CAM_PIN_D0 11
-#define CAM_PIN_D1 9
-#define CAM_PIN_D2 8
-#define CAM_PIN_D3 10
-#define CAM_PIN_D4 12
-#define CAM_PIN_D5 18
-#define CAM_PIN_D6 17
-#define CAM_PIN_D7 16
-#endif
-
-#ifdef BOARD_SEEED_XIAO_ESP32S3_SENSE
-
-// Power pins (if not used, set to -1):
-#define CAM_PIN_PWDN -1
-#define CAM_PIN_RESET -1
-
-// Clock signals
-#define CAM_PIN_XCLK 10  // XMCLK
-
-// I2C lines
-#define CAM_PIN_SIOC 39  // CAM_SCL
-#define CAM_PIN_SIOD 40  // CAM_SDA
-
-// Parallel DVP data lines (least significant bit first)
-#define CAM_PIN_D0 15  // DVP_Y2
-#define CAM_PIN_D1 17  // DVP_Y3
-#define CAM_PIN_D2 18  // DVP_Y4
-#define CAM_PIN_D3 16  // DVP_Y5
-#define CAM_PIN_D4 14  // DVP_Y6
-#define CAM_PIN_D5 12  // DVP_Y7
-#define CAM_PIN_D6 11  // DVP_Y8
-#define CAM_PIN_D7 48  // DVP_Y9
-
-// Synchronization signals
-#define CAM_PIN_VSYNC 38  // DVP_VSYNC
-#define CAM_PIN_HREF 47   // DVP_HREF
-#define CAM_PIN_PCLK 13   // DVP_PCLK
-
-#endif
-
-#ifdef BOARD_SEEED_XIAO_ESP32S3_SENSE_MOCK
-
-// Power pins (if not used, set to -1):
-#define CAM_PIN_PWDN (-1)
-#define CAM_PIN_RESET (-1)
-
-// Clock signals
-#define CAM_PIN_XCLK 10  // XMCLK
-
-// I2C lines
-#define CAM_PIN_SIOC 39  // CAM_SCL
-#define CAM_PIN_SIOD 40  // CAM_SDA
-
-// Parallel DVP data lines (least significant bit first)
-#define CAM_PIN_D0 15  // DVP_Y2
-#define CAM_PIN_D1 17  // DVP_Y3
-#define CAM_PIN_D2 18  // DVP_Y4
-#define CAM_PIN_D3 16  // DVP_Y5
-#define CAM_PIN_D4 14  // DVP_Y6
-#define CAM_PIN_D5 12  // DVP_Y7
-#define CAM_PIN_D6 11  // DVP_Y8
-#define CAM_PIN_D7 21  // DVP_Y9
-
-// Synchronization signals
-#define CAM_PIN_VSYNC 38  // DVP_VSYNC
-#define CAM_PIN_HREF 47   // DVP_HREF
-#define CAM_PIN_PCLK 13   // DVP_PCLK
-
-#endif
-}  // namespace camera
\ No newline at end of file
+// Camera pins of a board, -1 for a pin that isn't connected.
+struct BoardPins {
+  int pwdn;
+  int reset;  // -1: software reset
+  int xclk;
+  int sccb_sda;
+  int sccb_scl;
+  // parallel DVP data lines, least significant bit first
+  int d0;
+  int d1;
+  int d2;
+  int d3;
+  int d4;
+  int d5;
+  int d6;
+  int d7;
+  int vsync;
+  int href;
+  int pclk;
+};
+
+constexpr BoardPins wrover_kit_pins{
+  .pwdn = -1,
+  .reset = -1,
+  .xclk = 21,
+  .sccb_sda = 26,
+  .sccb_scl = 27,
+  .d0 = 4,
+  .d1 = 5,
+  .d2 = 18,
+  .d3 = 19,
+  .d4 = 36,
+  .d5 = 39,
+  .d6 = 34,
+  .d7 = 35,
+  .vsync = 25,
+  .href = 23,
+  .pclk = 22,
+};
+
+constexpr BoardPins esp32cam_aithinker_pins{
+  .pwdn = 32,
+  .reset = -1,
+  .xclk = 0,
+  .sccb_sda = 26,
+  .sccb_scl = 27,
+  .d0 = 5,
+  .d1 = 18,
+  .d2 = 19,
+  .d3 = 21,
+  .d4 = 36,
+  .d5 = 39,
+  .d6 = 34,
+  .d7 = 35,
+  .vsync = 25,
+  .href = 23,
+  .pclk = 22,
+};
+
+constexpr BoardPins esp32s3_wroom_pins{
+  .pwdn = 38,
+  .reset = -1,
+  .xclk = 15,
+  .sccb_sda = 4,
+  .sccb_scl = 5,
+  .d0 = 11,
+  .d1 = 9,
+  .d2 = 8,
+  .d3 = 10,
+  .d4 = 12,
+  .d5 = 18,
+  .d6 = 17,
+  .d7 = 16,
+  .vsync = 6,
+  .href = 7,
+  .pclk = 13,
+};
+
+constexpr BoardPins xiao_esp32s3_sense_pins{
+  .pwdn = -1,
+  .reset = -1,
+  .xclk = 10,      // XMCLK
+  .sccb_sda = 40,  // CAM_SDA
+  .sccb_scl = 39,  // CAM_SCL
+  .d0 = 15,        // DVP_Y2
+  .d1 = 17,        // DVP_Y3
+  .d2 = 18,        // DVP_Y4
+  .d3 = 16,        // DVP_Y5
+  .d4 = 14,        // DVP_Y6
+  .d5 = 12,        // DVP_Y7
+  .d6 = 11,        // DVP_Y8
+  .d7 = 48,        // DVP_Y9
+  .vsync = 38,     // DVP_VSYNC
+  .href = 47,      // DVP_HREF
+  .pclk = 13,      // DVP_PCLK
+};
+
+// the XIAO with D7 moved off GPIO 48
+constexpr BoardPins xiao_esp32s3_sense_mock_pins = [] {
+  BoardPins pins = xiao_esp32s3_sense_pins;
+  pins.d7 = 21;
+  return pins;
+}();
+
+// the board this firmware is built for
+constexpr const BoardPins& board_pins = xiao_esp32s3_sense_pins;
+
+}  // namespace camera
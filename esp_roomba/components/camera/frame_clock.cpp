@@ -0,0 +1,89 @@
+#include "frame_clock.hpp"
+
+#include <driver/gpio.h>
+#include <esp_attr.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <array>
+#include <atomic>
+
+#include "metrics.hpp"
+
+namespace camera {
+
+static const char* TAG = "frame_clock";
+
+// OV2640 and OV5640 pulse VSYNC high during vertical blanking, the first row comes out as it falls
+constexpr gpio_int_type_t vsync_edge = GPIO_INTR_NEGEDGE;
+// more edges than the driver has frame buffers, so the edge of the oldest queued frame is still there
+constexpr size_t vsync_history = 16;
+// The driver may react to the rising edge and stamp the frame before the pulse ends. The pulse is a few rows long
+// and frames are tens of ms apart, so an edge this close after the stamp still belongs to the same frame.
+constexpr int64_t match_slack_us = 2000;
+// a frame never takes longer than this from VSYNC to the driver's stamp, older edges belong to another frame
+constexpr int64_t max_vsync_delay_us = 100000;
+
+static std::array<int64_t, vsync_history> s_vsync_us{};
+// count of edges seen, the newest is at (count - 1) % vsync_history
+static std::atomic<uint32_t> s_vsync_count{0};
+static bool s_isr_added = false;
+
+static metrics::Counter s_unmatched{
+  "roomba_camera_vsync_unmatched_total", "Frames stamped with the driver's time because no VSYNC edge matched"};
+
+static void IRAM_ATTR on_vsync(void* /*arg*/) {
+  uint32_t count = s_vsync_count.load(std::memory_order_relaxed);
+  s_vsync_us[count % vsync_history] = esp_timer_get_time();
+  s_vsync_count.store(count + 1, std::memory_order_release);
+}
+
+auto init_frame_clock(int vsync_pin) -> esp_err_t {
+  if (vsync_pin < 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  auto pin = static_cast<gpio_num_t>(vsync_pin);
+  // the camera driver may have installed the service already
+  esp_err_t err = gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+    ESP_LOGE(TAG, "Failed to install the GPIO ISR service: %s", esp_err_to_name(err));
+    return err;
+  }
+  // no gpio_config(), the pin stays routed to the camera peripheral
+  err = gpio_set_intr_type(pin, vsync_edge);
+  if (err == ESP_OK && !s_isr_added) {
+    err = gpio_isr_handler_add(pin, on_vsync, nullptr);
+    s_isr_added = err == ESP_OK;
+  }
+  if (err == ESP_OK) {
+    err = gpio_intr_enable(pin);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to attach the VSYNC interrupt on GPIO %d: %s", vsync_pin, esp_err_to_name(err));
+  }
+  return err;
+}
+
+auto frame_capture_time_us(const timeval& driver_timestamp) -> int64_t {
+  // gettimeofday() and esp_timer_get_time() run off the same counter, their difference only moves on a clock set
+  timeval now{};
+  gettimeofday(&now, nullptr);
+  int64_t offset_us = static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_usec - esp_timer_get_time();
+  int64_t driver_us = static_cast<int64_t>(driver_timestamp.tv_sec) * 1000000 + driver_timestamp.tv_usec - offset_us;
+
+  uint32_t count = s_vsync_count.load(std::memory_order_acquire);
+  size_t available = count < vsync_history ? count : vsync_history;
+  for (size_t age = 0; age < available; age++) {
+    int64_t edge = s_vsync_us[(count - 1 - age) % vsync_history];
+    if (edge <= driver_us + match_slack_us) {
+      if (driver_us - edge <= max_vsync_delay_us) {
+        return edge;
+      }
+      break;
+    }
+  }
+  s_unmatched.increment();
+  return driver_us;
+}
+
+}  // namespace camera
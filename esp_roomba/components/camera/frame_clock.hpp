@@ -0,0 +1,21 @@
+#pragma once
+
+#include <esp_err.h>
+#include <sys/time.h>
+
+#include <cstdint>
+
+namespace camera {
+
+// Timestamps the sensor's VSYNC edges from a GPIO interrupt.
+//
+// The driver stamps a frame with gettimeofday() once its task gets around to the VSYNC event, which is late by the
+// queueing in between and, after an SNTP sync, not in the esp_timer_get_time() clock the rest of the firmware uses.
+// Safe to call again after every esp_camera_init(), which reconfigures the pin.
+auto init_frame_clock(int vsync_pin) -> esp_err_t;
+
+// Maps the driver's frame timestamp to the VSYNC edge that started the frame, in esp_timer_get_time() us.
+// Falls back to the driver's timestamp moved into the esp_timer clock when no edge matches.
+[[nodiscard]] auto frame_capture_time_us(const timeval& driver_timestamp) -> int64_t;
+
+}  // namespace camera
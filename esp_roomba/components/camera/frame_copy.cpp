@@ -0,0 +1,225 @@
+#include "frame_copy.hpp"
+
+#include <esp_async_memcpy.h>
+#include <esp_attr.h>
+#include <esp_cache.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+#include <esp_timer.h>
+
+#include <array>
+#include <cinttypes>
+#include <cstring>
+
+#include "metrics.hpp"
+
+namespace camera {
+
+static const char* TAG = "frame_copy";
+
+// copies queued on the engine at once, the capture task has one in flight and the benchmark one more
+constexpr uint32_t copy_backlog = 4;
+// a 128 KB PSRAM to PSRAM copy takes a few ms, anything near this means the interrupt was lost
+constexpr TickType_t copy_timeout = pdMS_TO_TICKS(100);
+
+static async_memcpy_handle_t s_engine = nullptr;
+
+static metrics::Counter s_dma_copies{"roomba_camera_dma_copies_total", "Frame copies done by the GDMA engine"};
+static metrics::Counter s_cpu_copies{
+  "roomba_camera_cpu_copies_total", "Frame copies that fell back to memcpy (unaligned, engine busy or missing)"};
+static metrics::Counter s_copy_timeouts{
+  "roomba_camera_dma_copy_timeouts_total", "GDMA copies that never completed, redone with memcpy after a reinstall"};
+
+auto init_frame_copy() -> esp_err_t {
+  if (s_engine != nullptr) {
+    return ESP_OK;
+  }
+  async_memcpy_config_t config = ASYNC_MEMCPY_DEFAULT_CONFIG();
+  config.backlog = copy_backlog;
+  esp_err_t err = esp_async_memcpy_install(&config, &s_engine);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "No GDMA copy engine, frames are copied with memcpy: %s", esp_err_to_name(err));
+    s_engine = nullptr;
+  }
+  return err;
+}
+
+static bool IRAM_ATTR on_copy_done(async_memcpy_handle_t /*engine*/, async_memcpy_event_t* /*event*/, void* arg) {
+  auto* ticket = static_cast<CopyTicket*>(arg);
+  BaseType_t woken = pdFALSE;
+  xSemaphoreGiveFromISR(ticket->done, &woken);
+  return woken == pdTRUE;
+}
+
+static auto aligned(const void* pointer) -> bool {
+  return reinterpret_cast<uintptr_t>(pointer) % copy_alignment == 0;
+}
+
+auto init_copy_ticket(CopyTicket& ticket) -> void {
+  ticket.done = xSemaphoreCreateBinaryStatic(&ticket.semaphore_buffer);
+}
+
+// The engine reads and writes PSRAM behind the cache. Whatever the CPU wrote to src has to reach PSRAM first, and dirty
+// lines of dst must not be written back over the copy later.
+static auto flush_for_engine(void* dst, const void* src, size_t len) -> bool {
+  if (esp_ptr_external_ram(src) &&
+      esp_cache_msync(const_cast<void*>(src), len, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_TYPE_DATA) !=
+        ESP_OK) {
+    return false;
+  }
+  return !esp_ptr_external_ram(dst) ||
+         esp_cache_msync(
+           dst, len, ESP_CACHE_MSYNC_FLAG_DIR_C2M | ESP_CACHE_MSYNC_FLAG_INVALIDATE | ESP_CACHE_MSYNC_FLAG_TYPE_DATA) ==
+           ESP_OK;
+}
+
+auto start_copy(CopyTicket& ticket, void* dst, const void* src, size_t len) -> void {
+  ticket.dst = dst;
+  ticket.src = src;
+  ticket.len = len;
+  ticket.dma = s_engine != nullptr && aligned(dst) && aligned(src) && len % copy_alignment == 0 &&
+               flush_for_engine(dst, src, len) &&
+               esp_async_memcpy(s_engine, dst, const_cast<void*>(src), len, on_copy_done, &ticket) == ESP_OK;
+  if (!ticket.dma) {
+    memcpy(dst, src, len);
+    s_cpu_copies.increment();
+  }
+}
+
+auto wait_copy(CopyTicket& ticket) -> bool {
+  if (!ticket.dma) {
+    return false;
+  }
+  if (xSemaphoreTake(ticket.done, copy_timeout) != pdTRUE) {
+    // The interrupt was lost or the channel hung. Uninstalling stops the channel so it can't write dst any more, then
+    // the frame is copied on the CPU and the next copy gets a fresh engine.
+    ESP_LOGE(TAG, "GDMA copy of %u bytes timed out, reinstalling the engine", static_cast<unsigned>(ticket.len));
+    s_copy_timeouts.increment();
+    bool uninstalled = esp_async_memcpy_uninstall(s_engine) == ESP_OK;
+    s_engine = nullptr;
+    if (!uninstalled) {
+      ESP_LOGW(TAG, "GDMA engine uninstall failed, frames are copied with memcpy from now on");
+    } else {
+      init_frame_copy();
+    }
+    memcpy(ticket.dst, ticket.src, ticket.len);
+    // a completion that comes in after all would release the next wait early
+    xSemaphoreTake(ticket.done, 0);
+    ticket.dma = false;
+    s_cpu_copies.increment();
+    return false;
+  }
+  // drops lines the CPU may have prefetched while the copy ran
+  if (esp_ptr_external_ram(ticket.dst)) {
+    esp_cache_msync(ticket.dst, ticket.len, ESP_CACHE_MSYNC_FLAG_DIR_M2C | ESP_CACHE_MSYNC_FLAG_TYPE_DATA);
+  }
+  s_dma_copies.increment();
+  return true;
+}
+
+struct CopyTimes {
+  // CPU time spent starting and waiting for the copy, excluding the time it was free for other work
+  uint32_t cpu_us;
+  // from start until dst is usable
+  uint32_t latency_us;
+  bool dma;
+};
+
+static auto time_memcpy(void* dst, const void* src, size_t len) -> CopyTimes {
+  int64_t start = esp_timer_get_time();
+  memcpy(dst, src, len);
+  auto elapsed = static_cast<uint32_t>(esp_timer_get_time() - start);
+  return CopyTimes{elapsed, elapsed, false};
+}
+
+static auto time_engine(CopyTicket& ticket, void* dst, const void* src, size_t len) -> CopyTimes {
+  int64_t start = esp_timer_get_time();
+  start_copy(ticket, dst, src, len);
+  int64_t started = esp_timer_get_time();
+  // stands in for the work the capture task overlaps with the copy, spinning instead of blocking so the wake up is
+  // part of the latency and not of the CPU time
+  while (ticket.dma && uxSemaphoreGetCount(ticket.done) == 0 && esp_timer_get_time() - started < 100000) {
+  }
+  int64_t landed = esp_timer_get_time();
+  wait_copy(ticket);
+  int64_t end = esp_timer_get_time();
+  return CopyTimes{
+    static_cast<uint32_t>((started - start) + (end - landed)), static_cast<uint32_t>(end - start), ticket.dma};
+}
+
+auto run_frame_copy_benchmark() -> void {
+  static constexpr std::array<size_t, 4> sizes{16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024};
+  static constexpr uint32_t iterations = 16;
+  constexpr size_t max_size = sizes.back();
+
+  auto* src = static_cast<uint8_t*>(heap_caps_aligned_alloc(copy_alignment, max_size, MALLOC_CAP_SPIRAM));
+  auto* psram_dst = static_cast<uint8_t*>(heap_caps_aligned_alloc(copy_alignment, max_size, MALLOC_CAP_SPIRAM));
+  // internal RAM rarely has 128 KB to spare, the internal rows stop at whatever fits
+  size_t internal_size = max_size;
+  uint8_t* internal_dst = nullptr;
+  while (internal_dst == nullptr && internal_size >= sizes.front()) {
+    internal_dst = static_cast<uint8_t*>(
+      heap_caps_aligned_alloc(copy_alignment, internal_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA));
+    if (internal_dst == nullptr) {
+      internal_size /= 2;
+    }
+  }
+  if (src == nullptr || psram_dst == nullptr) {
+    ESP_LOGE(TAG, "Not enough PSRAM for the copy benchmark");
+    heap_caps_free(src);
+    heap_caps_free(psram_dst);
+    heap_caps_free(internal_dst);
+    return;
+  }
+  for (size_t i = 0; i < max_size; i++) {
+    src[i] = static_cast<uint8_t>(i * 31);
+  }
+
+  CopyTicket ticket{};
+  init_copy_ticket(ticket);
+
+  ESP_LOGI(TAG, "=== Frame Copy Benchmark (%" PRIu32 " iterations, core %d) ===", iterations, xPortGetCoreID());
+  ESP_LOGI(TAG, "%-16s %7s %10s %10s %10s %6s", "route", "bytes", "memcpy_us", "dma_cpu_us", "dma_lat_us", "dma");
+  for (bool internal : {false, true}) {
+    uint8_t* dst = internal ? internal_dst : psram_dst;
+    size_t dst_size = internal ? internal_size : max_size;
+    for (size_t size : sizes) {
+      if (dst == nullptr || size > dst_size) {
+        continue;
+      }
+      uint64_t memcpy_us = 0;
+      uint64_t dma_cpu_us = 0;
+      uint64_t dma_latency_us = 0;
+      uint32_t dma_count = 0;
+      for (uint32_t i = 0; i < iterations; i++) {
+        memcpy_us += time_memcpy(dst, src, size).latency_us;
+        memset(dst, 0, size);
+        CopyTimes engine = time_engine(ticket, dst, src, size);
+        dma_cpu_us += engine.cpu_us;
+        dma_latency_us += engine.latency_us;
+        dma_count += engine.dma ? 1 : 0;
+        if (memcmp(dst, src, size) != 0) {
+          ESP_LOGE(TAG, "Engine copy of %u bytes came out wrong", static_cast<unsigned>(size));
+        }
+      }
+      ESP_LOGI(
+        TAG,
+        "%-16s %7u %10" PRIu32 " %10" PRIu32 " %10" PRIu32 " %3" PRIu32 "/%" PRIu32,
+        internal ? "psram->sram" : "psram->psram",
+        static_cast<unsigned>(size),
+        static_cast<uint32_t>(memcpy_us / iterations),
+        static_cast<uint32_t>(dma_cpu_us / iterations),
+        static_cast<uint32_t>(dma_latency_us / iterations),
+        dma_count,
+        iterations);
+    }
+  }
+
+  vSemaphoreDelete(ticket.done);
+  heap_caps_free(src);
+  heap_caps_free(psram_dst);
+  heap_caps_free(internal_dst);
+}
+
+}  // namespace camera
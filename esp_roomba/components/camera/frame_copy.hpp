@@ -0,0 +1,40 @@
+#pragma once
+
+#include <esp_err.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <cstddef>
+
+namespace camera {
+
+// Frame sized copies on the GDMA engine (esp_async_memcpy). The CPU does other work while a frame moves through PSRAM
+// instead of spending the whole copy in memcpy.
+//
+// Buffers and length have to be multiples of copy_alignment for the engine, anything else is copied with memcpy, as
+// is everything while the engine isn't installed or its queue is full.
+constexpr size_t copy_alignment = 64;
+
+auto init_frame_copy() -> esp_err_t;
+
+// A copy one task starts, overlaps with other work and then waits for. The engine's completion interrupt gives the
+// semaphore.
+struct CopyTicket {
+  StaticSemaphore_t semaphore_buffer;
+  SemaphoreHandle_t done = nullptr;
+  void* dst = nullptr;
+  // kept for redoing the copy with memcpy if the engine never finishes it
+  const void* src = nullptr;
+  size_t len = 0;
+  bool dma = false;
+};
+auto init_copy_ticket(CopyTicket& ticket) -> void;
+auto start_copy(CopyTicket& ticket, void* dst, const void* src, size_t len) -> void;
+// Blocks until the copy has landed and the CPU sees it in dst. Returns whether the engine did it. If the engine hasn't
+// finished within a timeout it is reinstalled and the copy redone with memcpy, so src must still be valid.
+auto wait_copy(CopyTicket& ticket) -> bool;
+
+// Logs memcpy against the engine for 16 to 128 KB frames.
+auto run_frame_copy_benchmark() -> void;
+
+}  // namespace camera
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_camera.h"
+
+namespace camera {
+
+// Measured settings per sensor. The driver reads the PID during esp_camera_init(), so the first init runs with the
+// default profile's xclk and fb_count and is repeated once if the detected sensor wants different ones.
+struct SensorProfile {
+  uint16_t pid;
+  const char* name;
+  int xclk_freq_hz;
+  size_t fb_count;
+  // starting quality, the governor moves it from there
+  int jpeg_quality;
+  // fastest the stream sends, the governor only stretches it
+  uint32_t frame_interval_us;
+  // capture task pause after each stored frame
+  uint32_t capture_delay_ms;
+  // the stream skips frames while free internal RAM is below this
+  size_t send_reserve_bytes;
+};
+
+// VGA frames are about 17.6 KB
+constexpr SensorProfile ov2640_profile{
+  .pid = OV2640_PID,
+  .name = "OV2640",
+  .xclk_freq_hz = 20000000,
+  .fb_count = 8,
+  .jpeg_quality = 8,
+  .frame_interval_us = 60 * 1000,
+  .capture_delay_ms = 10,
+  .send_reserve_bytes = 16 * 1024,
+};
+
+// VGA frames are about 34 KB, and it needs longer between frames
+constexpr SensorProfile ov5640_profile{
+  .pid = OV5640_PID,
+  .name = "OV5640",
+  .xclk_freq_hz = 20000000,
+  .fb_count = 8,
+  .jpeg_quality = 8,
+  .frame_interval_us = 120 * 1000,
+  .capture_delay_ms = 30,
+  .send_reserve_bytes = 32 * 1024,
+};
+
+constexpr std::array sensor_profiles{ov2640_profile, ov5640_profile};
+
+// what the board ships with, also used for sensors without a profile
+constexpr const SensorProfile& default_sensor_profile = ov2640_profile;
+
+constexpr auto sensor_profile_for(uint16_t pid) -> const SensorProfile& {
+  for (const SensorProfile& profile : sensor_profiles) {
+    if (profile.pid == pid) {
+      return profile;
+    }
+  }
+  return default_sensor_profile;
+}
+
+// The detected sensor's profile, the default one until the camera has been initialized.
+[[nodiscard]] auto active_sensor_profile() -> const SensorProfile&;
+
+}  // namespace camera
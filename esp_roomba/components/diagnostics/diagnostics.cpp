@@ -59,6 +59,9 @@ static auto init_adc() -> esp_err_t {
 
 // --------------------- Temperature Initialization ---------------------
 static auto init_temp_sensor() -> esp_err_t {
+  if (temp_sensor != nullptr) {
+    return ESP_OK;
+  }
   // Valid range on ESP32-S3 is ~20 to 90 °C
   temperature_sensor_config_t temp_cfg = {
     .range_min = 20, .range_max = 90, .clk_src = TEMPERATURE_SENSOR_CLK_SRC_DEFAULT, .flags = {0}};
@@ -73,6 +76,17 @@ static auto init_temp_sensor() -> esp_err_t {
   return ESP_OK;
 }
 
+auto read_chip_temperature(float *celsius) -> esp_err_t {
+  if (celsius == nullptr) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  esp_err_t err = init_temp_sensor();
+  if (err != ESP_OK) {
+    return err;
+  }
+  return temperature_sensor_get_celsius(temp_sensor, celsius);
+}
+
 // --------------------- Monitor Initialization ---------------------
 auto init_system_monitor() -> esp_err_t {
   ESP_ERROR_CHECK(init_temp_sensor());
@@ -173,7 +187,7 @@ auto print_system_status(const system_status_t *status) -> void {
   }
 
   // Warnings
-  if (status->temperature > 80.0F) {
+  if (status->temperature > high_temperature_celsius) {
     ESP_LOGW(TAG, "WARNING: High temperature detected!");
   }
   if (status->free_heap < 10000) {
@@ -18,8 +18,13 @@ struct SystemStatus {
 
 using system_status_t = struct SystemStatus;
 
+// print_system_status warns above this
+constexpr float high_temperature_celsius = 80.0F;
+
 
 auto init_system_monitor() -> esp_err_t;
 auto print_system_status(const system_status_t *status) -> void;
 auto get_system_status(system_status_t *status) -> esp_err_t;
 auto cleanup_system_monitor() -> void;
+// Installs the temperature sensor on first use, works without init_system_monitor.
+auto read_chip_temperature(float *celsius) -> esp_err_t;
@@ -0,0 +1,231 @@
+#include "task_profiler.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "esp_log.h"
+#include "freertos/semphr.h"
+#include "metrics.hpp"
+#include "sdkconfig.h"
+
+static const char* TAG = "task_profiler";
+
+struct StackRegistration {
+  TaskHandle_t task;
+  size_t stack_size;
+};
+
+struct RunTimeRecord {
+  UBaseType_t task_number;
+  configRUN_TIME_COUNTER_TYPE run_time;
+};
+
+static std::array<StackRegistration, max_profiled_tasks> s_stacks{};
+static size_t s_stack_count = 0;
+
+// only touched by the sampling task
+static std::array<TaskStatus_t, max_profiled_tasks> s_status{};
+static std::array<RunTimeRecord, max_profiled_tasks> s_previous{};
+static size_t s_previous_count = 0;
+static configRUN_TIME_COUNTER_TYPE s_previous_total = 0;
+
+// latest sample, guarded by s_snapshot_mutex
+static TaskProfileSnapshot s_snapshot{};
+static SemaphoreHandle_t s_snapshot_mutex = nullptr;
+
+static metrics::Gauge s_core0_load{"roomba_cpu_core0_load_percent", "Share of core 0 not spent in its idle task"};
+static metrics::Gauge s_core1_load{"roomba_cpu_core1_load_percent", "Share of core 1 not spent in its idle task"};
+static metrics::Gauge s_min_stack_free{
+  "roomba_task_min_stack_free_bytes", "Smallest stack high water mark across all tasks"};
+
+auto register_task_stack(TaskHandle_t task, size_t stack_size) -> void {
+  if (task == nullptr || s_stack_count >= s_stacks.size()) {
+    return;
+  }
+  s_stacks[s_stack_count++] = StackRegistration{task, stack_size};
+}
+
+static auto registered_stack_size(TaskHandle_t task) -> uint32_t {
+  for (size_t i = 0; i < s_stack_count; i++) {
+    if (s_stacks[i].task == task) {
+      return static_cast<uint32_t>(s_stacks[i].stack_size);
+    }
+  }
+  return 0;
+}
+
+static auto previous_run_time(UBaseType_t task_number) -> configRUN_TIME_COUNTER_TYPE {
+  for (size_t i = 0; i < s_previous_count; i++) {
+    if (s_previous[i].task_number == task_number) {
+      return s_previous[i].run_time;
+    }
+  }
+  // new task, count everything it has done so far
+  return 0;
+}
+
+auto sample_task_profiles() -> esp_err_t {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+  if (s_snapshot_mutex == nullptr) {
+    s_snapshot_mutex = xSemaphoreCreateMutex();
+  }
+
+  configRUN_TIME_COUNTER_TYPE total = 0;
+  UBaseType_t count = uxTaskGetSystemState(s_status.data(), s_status.size(), &total);
+  if (count == 0) {
+    ESP_LOGE(TAG, "More than %u tasks, increase max_profiled_tasks", static_cast<unsigned>(max_profiled_tasks));
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  // the counters are free running, unsigned subtraction copes with them wrapping
+  configRUN_TIME_COUNTER_TYPE window = total - s_previous_total;
+  bool first_sample = s_previous_total == 0;
+
+  TaskProfileSnapshot snapshot{};
+  snapshot.task_count = count;
+  snapshot.window_us = static_cast<uint32_t>(window);
+  snapshot.core_load_percent.fill(0.0F);
+
+  uint32_t min_stack_free = UINT32_MAX;
+  for (UBaseType_t i = 0; i < count; i++) {
+    const TaskStatus_t& status = s_status[i];
+    TaskProfile& profile = snapshot.tasks[i];
+
+    strlcpy(profile.name.data(), status.pcTaskName, profile.name.size());
+    profile.priority = status.uxCurrentPriority;
+    profile.core = status.xCoreID;
+    profile.state = status.eCurrentState;
+    profile.stack_free = status.usStackHighWaterMark;
+    profile.stack_size = registered_stack_size(status.xHandle);
+
+    configRUN_TIME_COUNTER_TYPE delta = status.ulRunTimeCounter - previous_run_time(status.xTaskNumber);
+    profile.cpu_percent =
+      (first_sample || window == 0) ? 0.0F : 100.0F * static_cast<float>(delta) / static_cast<float>(window);
+
+    min_stack_free = std::min(min_stack_free, profile.stack_free);
+  }
+
+  for (BaseType_t core = 0; core < portNUM_PROCESSORS; core++) {
+    TaskHandle_t idle = xTaskGetIdleTaskHandleForCore(core);
+    for (size_t i = 0; i < snapshot.task_count; i++) {
+      if (s_status[i].xHandle == idle) {
+        float idle_percent = snapshot.tasks[i].cpu_percent;
+        snapshot.core_load_percent[core] = first_sample ? 0.0F : std::max(0.0F, 100.0F - idle_percent);
+      }
+    }
+  }
+
+  for (UBaseType_t i = 0; i < count; i++) {
+    s_previous[i] = RunTimeRecord{s_status[i].xTaskNumber, s_status[i].ulRunTimeCounter};
+  }
+  s_previous_count = count;
+  s_previous_total = total;
+
+  s_core0_load.set(static_cast<int32_t>(snapshot.core_load_percent[0]));
+#if portNUM_PROCESSORS > 1
+  s_core1_load.set(static_cast<int32_t>(snapshot.core_load_percent[1]));
+#endif
+  s_min_stack_free.set(static_cast<int32_t>(min_stack_free));
+
+  if (xSemaphoreTake(s_snapshot_mutex, portMAX_DELAY) == pdTRUE) {
+    s_snapshot = snapshot;
+    xSemaphoreGive(s_snapshot_mutex);
+  }
+  return ESP_OK;
+#else
+  return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+auto get_task_profiles(TaskProfileSnapshot* snapshot) -> esp_err_t {
+  if (snapshot == nullptr) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (s_snapshot_mutex == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (xSemaphoreTake(s_snapshot_mutex, pdMS_TO_TICKS(100)) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  *snapshot = s_snapshot;
+  xSemaphoreGive(s_snapshot_mutex);
+  return ESP_OK;
+}
+
+static auto core_label(BaseType_t core) -> int {
+  return core == tskNO_AFFINITY ? -1 : static_cast<int>(core);
+}
+
+auto render_task_profiles_json(std::string& out) -> void {
+  static TaskProfileSnapshot snapshot;
+  if (get_task_profiles(&snapshot) != ESP_OK) {
+    out += "{}";
+    return;
+  }
+
+  std::array<char, 192> line{};
+  snprintf(
+    line.data(),
+    line.size(),
+    "{\"window_us\":%" PRIu32 ",\"core_load\":[%.1f,%.1f],\"tasks\":[",
+    snapshot.window_us,
+    snapshot.core_load_percent[0],
+    portNUM_PROCESSORS > 1 ? snapshot.core_load_percent[portNUM_PROCESSORS - 1] : 0.0F);
+  out += line.data();
+
+  for (size_t i = 0; i < snapshot.task_count; i++) {
+    const TaskProfile& task = snapshot.tasks[i];
+    snprintf(
+      line.data(),
+      line.size(),
+      "%s{\"name\":\"%s\",\"prio\":%u,\"core\":%d,\"state\":%d,\"cpu\":%.1f,\"stack_free\":%" PRIu32
+      ",\"stack_size\":%" PRIu32 "}",
+      i == 0 ? "" : ",",
+      task.name.data(),
+      static_cast<unsigned>(task.priority),
+      core_label(task.core),
+      static_cast<int>(task.state),
+      task.cpu_percent,
+      task.stack_free,
+      task.stack_size);
+    out += line.data();
+  }
+  out += "]}";
+}
+
+auto print_task_profiles() -> void {
+  static TaskProfileSnapshot snapshot;
+  if (get_task_profiles(&snapshot) != ESP_OK) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "=== Task Profile (%" PRIu32 " ms window) ===", snapshot.window_us / 1000);
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    ESP_LOGI(TAG, "Core %d load: %.1f%%", core, snapshot.core_load_percent[core]);
+  }
+  for (size_t i = 0; i < snapshot.task_count; i++) {
+    const TaskProfile& task = snapshot.tasks[i];
+    if (task.stack_size > 0) {
+      ESP_LOGI(
+        TAG,
+        "%-16s core %2d prio %2u cpu %5.1f%% stack %" PRIu32 "/%" PRIu32 " free",
+        task.name.data(),
+        core_label(task.core),
+        static_cast<unsigned>(task.priority),
+        task.cpu_percent,
+        task.stack_free,
+        task.stack_size);
+    } else {
+      ESP_LOGI(
+        TAG,
+        "%-16s core %2d prio %2u cpu %5.1f%% stack %" PRIu32 " free",
+        task.name.data(),
+        core_label(task.core),
+        static_cast<unsigned>(task.priority),
+        task.cpu_percent,
+        task.stack_free);
+    }
+  }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+constexpr size_t max_profiled_tasks = 32;
+
+struct TaskProfile {
+  std::array<char, configMAX_TASK_NAME_LEN> name;
+  UBaseType_t priority;
+  BaseType_t core;        // tskNO_AFFINITY if the task isn't pinned
+  eTaskState state;
+  float cpu_percent;      // percent of a single core since the previous sample
+  uint32_t stack_free;    // stack high water mark in bytes
+  uint32_t stack_size;    // 0 unless registered with register_task_stack
+};
+
+struct TaskProfileSnapshot {
+  std::array<TaskProfile, max_profiled_tasks> tasks;
+  size_t task_count;
+  std::array<float, portNUM_PROCESSORS> core_load_percent;  // 100 - idle task share per core
+  uint32_t window_us;                                         // time covered by the cpu percentages
+};
+
+// Lets the profiler report headroom for tasks created with static stacks.
+auto register_task_stack(TaskHandle_t task, size_t stack_size) -> void;
+
+// Takes a new sample, cpu percentages are relative to the previous call.
+// Requires CONFIG_FREERTOS_USE_TRACE_FACILITY and CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS.
+auto sample_task_profiles() -> esp_err_t;
+
+// Copies out the latest sample, safe to call from any task.
+auto get_task_profiles(TaskProfileSnapshot* snapshot) -> esp_err_t;
+auto render_task_profiles_json(std::string& out) -> void;
+auto print_task_profiles() -> void;
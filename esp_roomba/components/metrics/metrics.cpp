@@ -0,0 +1,212 @@
+#include "metrics.hpp"
+
+#include <esp_cpu.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+namespace metrics {
+
+static const char* TAG = "metrics";
+
+// Registration only happens from static constructors, before the scheduler starts,
+// so the registry itself does not need to be synchronized.
+static auto registry() -> std::array<Metric*, max_metrics>& {
+  static std::array<Metric*, max_metrics> s_metrics{};
+  return s_metrics;
+}
+static size_t s_metric_count = 0;
+static size_t s_dropped_count = 0;
+static std::atomic<bool> s_dropped_reported{false};
+
+static auto register_metric(Metric* metric) -> uint8_t {
+  if (s_metric_count >= max_metrics) {
+    // too early for logging, report_dropped() tells on the first export
+    s_dropped_count++;
+    return UINT8_MAX;
+  }
+  registry()[s_metric_count] = metric;
+  return static_cast<uint8_t>(s_metric_count++);
+}
+
+Metric::Metric(const char* name, const char* help, MetricType type)
+    : m_name(name), m_help(help), m_type(type), m_id(name != nullptr ? register_metric(this) : UINT8_MAX) {}
+
+Histogram::Histogram(const char* name, const char* help, std::initializer_list<uint32_t> bounds)
+    : Metric(name, help, MetricType::Histogram), m_bucket_count(std::min(bounds.size(), max_histogram_buckets)) {
+  std::copy_n(bounds.begin(), m_bucket_count, m_bounds.begin());
+}
+
+// Which metrics are dropped depends on static init order, so say how many are missing instead of failing quietly.
+static auto report_dropped() -> void {
+  if (s_dropped_count > 0 && !s_dropped_reported.exchange(true)) {
+    ESP_LOGE(
+      TAG,
+      "%u metrics not registered, raise max_metrics (%u)",
+      static_cast<unsigned>(s_dropped_count),
+      static_cast<unsigned>(max_metrics));
+  }
+}
+
+auto metric_count() -> size_t {
+  return s_metric_count;
+}
+
+auto metric_at(size_t index) -> const Metric* {
+  return index < s_metric_count ? registry()[index] : nullptr;
+}
+
+static auto append_format(std::string& out, const char* format, auto... args) -> void {
+  std::array<char, 160> line{};
+  int len = snprintf(line.data(), line.size(), format, args...);
+  if (len > 0) {
+    out.append(line.data(), std::min(static_cast<size_t>(len), line.size() - 1));
+  }
+}
+
+auto render_prometheus(std::string& out) -> void {
+  report_dropped();
+  for (size_t i = 0; i < s_metric_count; i++) {
+    const Metric* metric = registry()[i];
+    append_format(out, "# HELP %s %s\n", metric->name(), metric->help());
+
+    switch (metric->type()) {
+      case MetricType::Counter: {
+        const auto* counter = static_cast<const Counter*>(metric);
+        append_format(out, "# TYPE %s counter\n%s %" PRIu32 "\n", metric->name(), metric->name(), counter->value());
+        break;
+      }
+      case MetricType::Gauge: {
+        const auto* gauge = static_cast<const Gauge*>(metric);
+        append_format(out, "# TYPE %s gauge\n%s %" PRId32 "\n", metric->name(), metric->name(), gauge->value());
+        break;
+      }
+      case MetricType::Histogram: {
+        const auto* histogram = static_cast<const Histogram*>(metric);
+        append_format(out, "# TYPE %s histogram\n", metric->name());
+        uint32_t cumulative = 0;
+        for (size_t bucket = 0; bucket < histogram->bucket_count(); bucket++) {
+          cumulative += histogram->count(bucket);
+          append_format(
+            out, "%s_bucket{le=\"%" PRIu32 "\"} %" PRIu32 "\n", metric->name(), histogram->bound(bucket), cumulative);
+        }
+        cumulative += histogram->count(histogram->bucket_count());
+        append_format(out, "%s_bucket{le=\"+Inf\"} %" PRIu32 "\n", metric->name(), cumulative);
+        append_format(out, "%s_sum %" PRIu32 "\n", metric->name(), histogram->sum());
+        append_format(out, "%s_count %" PRIu32 "\n", metric->name(), cumulative);
+        break;
+      }
+    }
+  }
+}
+
+static auto put_u32(uint8_t* out, uint32_t value) -> uint8_t* {
+  out[0] = static_cast<uint8_t>(value);
+  out[1] = static_cast<uint8_t>(value >> 8);
+  out[2] = static_cast<uint8_t>(value >> 16);
+  out[3] = static_cast<uint8_t>(value >> 24);
+  return out + sizeof(uint32_t);
+}
+
+auto encode_binary(uint8_t* out, size_t capacity) -> size_t {
+  report_dropped();
+  uint8_t* cursor = out;
+  const uint8_t* end = out + capacity;
+  if (cursor == end) {
+    return 0;
+  }
+  *cursor++ = static_cast<uint8_t>(s_metric_count);
+
+  for (size_t i = 0; i < s_metric_count; i++) {
+    const Metric* metric = registry()[i];
+    size_t needed = 2 + sizeof(uint32_t);
+    if (metric->type() == MetricType::Histogram) {
+      const auto* histogram = static_cast<const Histogram*>(metric);
+      needed = 3 + (histogram->bucket_count() + 2) * sizeof(uint32_t);
+    }
+    if (static_cast<size_t>(end - cursor) < needed) {
+      return 0;
+    }
+
+    *cursor++ = metric->id();
+    *cursor++ = static_cast<uint8_t>(metric->type());
+    switch (metric->type()) {
+      case MetricType::Counter:
+        cursor = put_u32(cursor, static_cast<const Counter*>(metric)->value());
+        break;
+      case MetricType::Gauge:
+        cursor = put_u32(cursor, static_cast<uint32_t>(static_cast<const Gauge*>(metric)->value()));
+        break;
+      case MetricType::Histogram: {
+        const auto* histogram = static_cast<const Histogram*>(metric);
+        *cursor++ = static_cast<uint8_t>(histogram->bucket_count());
+        for (size_t bucket = 0; bucket <= histogram->bucket_count(); bucket++) {
+          cursor = put_u32(cursor, histogram->count(bucket));
+        }
+        cursor = put_u32(cursor, histogram->sum());
+        break;
+      }
+    }
+  }
+  return static_cast<size_t>(cursor - out);
+}
+
+auto render_schema_json(std::string& out) -> void {
+  report_dropped();
+  out += '[';
+  for (size_t i = 0; i < s_metric_count; i++) {
+    const Metric* metric = registry()[i];
+    append_format(
+      out,
+      "%s{\"id\":%u,\"name\":\"%s\",\"type\":%u",
+      i == 0 ? "" : ",",
+      static_cast<unsigned>(metric->id()),
+      metric->name(),
+      static_cast<unsigned>(metric->type()));
+    if (metric->type() == MetricType::Histogram) {
+      const auto* histogram = static_cast<const Histogram*>(metric);
+      out += ",\"bounds\":[";
+      for (size_t bucket = 0; bucket < histogram->bucket_count(); bucket++) {
+        append_format(out, "%s%" PRIu32, bucket == 0 ? "" : ",", histogram->bound(bucket));
+      }
+      out += ']';
+    }
+    out += '}';
+  }
+  out += ']';
+}
+
+auto run_benchmark() -> void {
+  static constexpr uint32_t iterations = 100000;
+  Counter counter{nullptr, nullptr};
+  Gauge gauge{nullptr, nullptr};
+  Histogram histogram{nullptr, nullptr, {100, 500, 1000, 5000, 10000, 50000, 100000}};
+
+  auto measure = [](auto&& operation) -> uint32_t {
+    uint32_t start = esp_cpu_get_cycle_count();
+    for (uint32_t i = 0; i < iterations; i++) {
+      operation(i);
+    }
+    return (esp_cpu_get_cycle_count() - start) / iterations;
+  };
+
+  // baseline loop cost so the numbers below are the cost of the metric update alone
+  volatile uint32_t sink = 0;
+  uint32_t baseline = measure([&sink](uint32_t i) { sink = i; });
+  uint32_t counter_cycles = measure([&counter](uint32_t) { counter.increment(); });
+  uint32_t gauge_cycles = measure([&gauge](uint32_t i) { gauge.set(static_cast<int32_t>(i)); });
+  uint32_t histogram_cycles = measure([&histogram](uint32_t i) { histogram.observe(i % 120000); });
+
+  ESP_LOGI(TAG, "=== Metrics Benchmark (%" PRIu32 " iterations, core %d) ===", iterations, xPortGetCoreID());
+  ESP_LOGI(TAG, "Loop baseline: %" PRIu32 " cycles", baseline);
+  ESP_LOGI(TAG, "Counter::increment: %" PRIu32 " cycles", counter_cycles - std::min(counter_cycles, baseline));
+  ESP_LOGI(TAG, "Gauge::set: %" PRIu32 " cycles", gauge_cycles - std::min(gauge_cycles, baseline));
+  ESP_LOGI(TAG, "Histogram::observe: %" PRIu32 " cycles", histogram_cycles - std::min(histogram_cycles, baseline));
+}
+
+}  // namespace metrics
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+namespace metrics {
+
+// Counters and gauges are 32 bit on purpose: 64 bit atomics on the ESP32-S3 are emulated with a lock,
+// 32 bit ones compile down to a single wait-free s32c1i loop. Counters wrap, which Prometheus treats as a reset.
+enum class MetricType : uint8_t { Counter = 0, Gauge = 1, Histogram = 2 };
+
+// about 80 are registered, metrics past the cap are dropped and reported on the first export
+constexpr size_t max_metrics = 128;
+constexpr size_t max_histogram_buckets = 12;
+
+// A metric constructed with a null name is not registered and never exported.
+class Metric {
+ public:
+  Metric(const char* name, const char* help, MetricType type);
+
+  Metric(const Metric&) = delete;
+  auto operator=(const Metric&) -> Metric& = delete;
+  Metric(Metric&&) = delete;
+  auto operator=(Metric&&) -> Metric& = delete;
+
+  [[nodiscard]] auto name() const -> const char* {
+    return m_name;
+  }
+  [[nodiscard]] auto help() const -> const char* {
+    return m_help;
+  }
+  [[nodiscard]] auto type() const -> MetricType {
+    return m_type;
+  }
+  // position in the registry, stable for the lifetime of a firmware image
+  [[nodiscard]] auto id() const -> uint8_t {
+    return m_id;
+  }
+
+ protected:
+  ~Metric() = default;
+
+ private:
+  const char* m_name;
+  const char* m_help;
+  MetricType m_type;
+  uint8_t m_id;
+};
+
+class Counter : public Metric {
+ public:
+  Counter(const char* name, const char* help) : Metric(name, help, MetricType::Counter) {}
+
+  auto increment(uint32_t amount = 1) -> void {
+    m_value.fetch_add(amount, std::memory_order_relaxed);
+  }
+  [[nodiscard]] auto value() const -> uint32_t {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<uint32_t> m_value{0};
+};
+
+class Gauge : public Metric {
+ public:
+  Gauge(const char* name, const char* help) : Metric(name, help, MetricType::Gauge) {}
+
+  auto set(int32_t value) -> void {
+    m_value.store(value, std::memory_order_relaxed);
+  }
+  auto add(int32_t amount) -> void {
+    m_value.fetch_add(amount, std::memory_order_relaxed);
+  }
+  [[nodiscard]] auto value() const -> int32_t {
+    return m_value.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<int32_t> m_value{0};
+};
+
+// Fixed bucket histogram, bounds are inclusive upper limits in ascending order.
+// The implicit +Inf bucket is the last slot of the counts array.
+class Histogram : public Metric {
+ public:
+  Histogram(const char* name, const char* help, std::initializer_list<uint32_t> bounds);
+
+  auto observe(uint32_t value) -> void {
+    size_t bucket = 0;
+    while (bucket < m_bucket_count && value > m_bounds[bucket]) {
+      ++bucket;
+    }
+    m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  [[nodiscard]] auto bucket_count() const -> size_t {
+    return m_bucket_count;
+  }
+  [[nodiscard]] auto bound(size_t bucket) const -> uint32_t {
+    return m_bounds[bucket];
+  }
+  // non-cumulative count of the bucket, bucket_count() is the +Inf bucket
+  [[nodiscard]] auto count(size_t bucket) const -> uint32_t {
+    return m_counts[bucket].load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] auto sum() const -> uint32_t {
+    return m_sum.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::array<uint32_t, max_histogram_buckets> m_bounds{};
+  std::array<std::atomic<uint32_t>, max_histogram_buckets + 1> m_counts{};
+  std::atomic<uint32_t> m_sum{0};
+  size_t m_bucket_count{0};
+};
+
+// Metrics register themselves on construction, which should only happen during static initialization.
+auto metric_count() -> size_t;
+auto metric_at(size_t index) -> const Metric*;
+
+// Prometheus text exposition format (version 0.0.4)
+auto render_prometheus(std::string& out) -> void;
+
+// Compact binary snapshot, all values little endian:
+//   u8 metric count, then per metric: u8 id, u8 type, then
+//   counter: u32 value | gauge: i32 value | histogram: u8 buckets, u32 counts[buckets + 1], u32 sum
+// Returns the number of bytes written or 0 if the output buffer is too small.
+auto encode_binary(uint8_t* out, size_t capacity) -> size_t;
+
+// JSON array describing the binary ids: [{"id":0,"name":"...","type":0,"bounds":[...]}, ...]
+auto render_schema_json(std::string& out) -> void;
+
+// Measures the cost of the hot path operations and logs the result.
+auto run_benchmark() -> void;
+
+}  // namespace metrics
@@ -0,0 +1,231 @@
+#include "avi_writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace recorder {
+
+namespace {
+
+// file layout up to the first frame, offsets are patched by close()
+constexpr long riff_size_offset = 4;
+constexpr long avih_us_per_frame_offset = 32;
+constexpr long avih_max_bytes_per_sec_offset = 36;
+constexpr long avih_total_frames_offset = 48;
+constexpr long avih_suggested_buffer_offset = 60;
+constexpr long strh_scale_offset = 128;
+constexpr long strh_rate_offset = 132;
+constexpr long strh_length_offset = 140;
+constexpr long strh_suggested_buffer_offset = 144;
+constexpr long movi_size_offset = 216;
+constexpr long movi_fourcc_offset = 220;
+constexpr size_t header_size = 224;
+// LIST sizes count from their list type fourcc to the end of the list
+constexpr uint32_t hdrl_size = 192;
+constexpr uint32_t strl_size = 116;
+
+constexpr uint32_t avif_has_index = 0x10;
+constexpr uint32_t aviif_keyframe = 0x10;
+// strh rate is rate / scale frames per second, a fine scale keeps measured rates like 16.7 fps exact enough
+constexpr uint32_t rate_scale = 1000;
+
+class HeaderBuilder {
+ public:
+  auto fourcc(const char* code) -> HeaderBuilder& {
+    std::memcpy(&m_data[m_pos], code, 4);
+    m_pos += 4;
+    return *this;
+  }
+  auto u32(uint32_t value) -> HeaderBuilder& {
+    for (int i = 0; i < 4; i++) {
+      m_data[m_pos++] = static_cast<uint8_t>(value >> (8 * i));
+    }
+    return *this;
+  }
+  auto u16(uint16_t value) -> HeaderBuilder& {
+    m_data[m_pos++] = static_cast<uint8_t>(value);
+    m_data[m_pos++] = static_cast<uint8_t>(value >> 8);
+    return *this;
+  }
+  [[nodiscard]] auto position() const -> size_t {
+    return m_pos;
+  }
+  [[nodiscard]] auto data() const -> const uint8_t* {
+    return m_data.data();
+  }
+
+ private:
+  std::array<uint8_t, header_size> m_data{};
+  size_t m_pos = 0;
+};
+
+auto le32(uint32_t value) -> std::array<uint8_t, 4> {
+  return {
+    static_cast<uint8_t>(value),
+    static_cast<uint8_t>(value >> 8),
+    static_cast<uint8_t>(value >> 16),
+    static_cast<uint8_t>(value >> 24)};
+}
+
+}  // namespace
+
+AviWriter::~AviWriter() {
+  if (m_file != nullptr) {
+    (void)close();
+  }
+}
+
+auto AviWriter::open(const char* path, uint16_t width, uint16_t height, std::span<uint8_t> io_buffer, size_t max_frames)
+  -> std::expected<void, AviError> {
+  if (m_file != nullptr) {
+    (void)close();
+  }
+  m_file = fopen(path, "wb");
+  if (m_file == nullptr) {
+    return std::unexpected(AviError::OpenFailed);
+  }
+  if (!io_buffer.empty()) {
+    setvbuf(m_file, reinterpret_cast<char*>(io_buffer.data()), _IOFBF, io_buffer.size());
+  }
+
+  m_width = width;
+  m_height = height;
+  m_max_chunk = 0;
+  m_first_timestamp_us = 0;
+  m_last_timestamp_us = 0;
+  m_index.clear();
+  m_index.reserve(max_frames);
+
+  // sizes, counts and rates start at zero and are filled in by close()
+  HeaderBuilder header;
+  header.fourcc("RIFF").u32(0).fourcc("AVI ");
+  header.fourcc("LIST").u32(hdrl_size).fourcc("hdrl");
+  header.fourcc("avih").u32(56);
+  header.u32(0)                // us per frame
+    .u32(0)                    // max bytes per second
+    .u32(0)                    // padding granularity
+    .u32(avif_has_index)       // flags
+    .u32(0)                    // total frames
+    .u32(0)                    // initial frames
+    .u32(1)                    // streams
+    .u32(0)                    // suggested buffer size
+    .u32(width)
+    .u32(height)
+    .u32(0).u32(0).u32(0).u32(0);
+  header.fourcc("LIST").u32(strl_size).fourcc("strl");
+  header.fourcc("strh").u32(56);
+  header.fourcc("vids").fourcc("MJPG")
+    .u32(0)                    // flags
+    .u16(0).u16(0)             // priority, language
+    .u32(0)                    // initial frames
+    .u32(rate_scale)           // scale
+    .u32(0)                    // rate
+    .u32(0)                    // start
+    .u32(0)                    // length in frames
+    .u32(0)                    // suggested buffer size
+    .u32(UINT32_MAX)           // quality, default
+    .u32(0)                    // sample size, varies per frame
+    .u16(0).u16(0).u16(width).u16(height);
+  header.fourcc("strf").u32(40);
+  header.u32(40)               // BITMAPINFOHEADER size
+    .u32(width)
+    .u32(height)
+    .u16(1)                    // planes
+    .u16(24)                   // bit count
+    .fourcc("MJPG")
+    .u32(static_cast<uint32_t>(width) * height * 3)
+    .u32(0).u32(0).u32(0).u32(0);
+  header.fourcc("LIST").u32(0).fourcc("movi");
+
+  if (!write(header.data(), header.position())) {
+    fclose(m_file);
+    m_file = nullptr;
+    return std::unexpected(AviError::WriteFailed);
+  }
+  m_movi_end = header_size;
+  return {};
+}
+
+auto AviWriter::write_frame(const uint8_t* jpeg, size_t len, int64_t timestamp_us) -> std::expected<void, AviError> {
+  if (m_file == nullptr) {
+    return std::unexpected(AviError::NotOpen);
+  }
+  // chunks are word aligned
+  size_t padded = (len + 1) & ~size_t{1};
+  uint64_t index_bytes = 8 + 16 * (m_index.size() + 1);
+  if (m_movi_end + 8 + padded + index_bytes > max_file_bytes) {
+    return std::unexpected(AviError::TooLarge);
+  }
+
+  auto size = le32(static_cast<uint32_t>(len));
+  static constexpr uint8_t pad = 0;
+  if (!write("00dc", 4) || !write(size.data(), size.size()) || !write(jpeg, len) ||
+      (padded != len && !write(&pad, 1))) {
+    return std::unexpected(AviError::WriteFailed);
+  }
+
+  m_index.push_back(IndexEntry{static_cast<uint32_t>(m_movi_end - movi_fourcc_offset), static_cast<uint32_t>(len)});
+  m_movi_end += 8 + padded;
+  m_max_chunk = std::max(m_max_chunk, static_cast<uint32_t>(len));
+  if (m_index.size() == 1) {
+    m_first_timestamp_us = timestamp_us;
+  }
+  m_last_timestamp_us = timestamp_us;
+  return {};
+}
+
+auto AviWriter::close() -> std::expected<void, AviError> {
+  if (m_file == nullptr) {
+    return std::unexpected(AviError::NotOpen);
+  }
+
+  bool ok = write("idx1", 4);
+  auto index_size = le32(static_cast<uint32_t>(16 * m_index.size()));
+  ok = ok && write(index_size.data(), index_size.size());
+  for (const IndexEntry& entry : m_index) {
+    auto flags = le32(aviif_keyframe);
+    auto offset = le32(entry.offset);
+    auto size = le32(entry.size);
+    ok = ok && write("00dc", 4) && write(flags.data(), 4) && write(offset.data(), 4) && write(size.data(), 4);
+  }
+
+  // a single frame has no measurable rate, call it one per second
+  auto frames = static_cast<uint32_t>(m_index.size());
+  int64_t duration = duration_us();
+  uint32_t us_per_frame = frames > 1 && duration > 0 ? static_cast<uint32_t>(duration / (frames - 1)) : 1000000;
+  uint32_t rate = static_cast<uint32_t>((1000000ULL * rate_scale + us_per_frame / 2) / us_per_frame);
+  uint64_t file_size = m_movi_end + 8 + 16ULL * frames;
+  uint32_t bytes_per_sec =
+    duration > 0 ? static_cast<uint32_t>((m_movi_end - header_size) * 1000000ULL / static_cast<uint64_t>(duration)) : 0;
+
+  ok = ok && write_at(riff_size_offset, static_cast<uint32_t>(file_size - 8));
+  ok = ok && write_at(avih_us_per_frame_offset, us_per_frame);
+  ok = ok && write_at(avih_max_bytes_per_sec_offset, bytes_per_sec);
+  ok = ok && write_at(avih_total_frames_offset, frames);
+  ok = ok && write_at(avih_suggested_buffer_offset, m_max_chunk + 8);
+  ok = ok && write_at(strh_scale_offset, rate_scale);
+  ok = ok && write_at(strh_rate_offset, rate);
+  ok = ok && write_at(strh_length_offset, frames);
+  ok = ok && write_at(strh_suggested_buffer_offset, m_max_chunk + 8);
+  ok = ok && write_at(movi_size_offset, static_cast<uint32_t>(m_movi_end - movi_fourcc_offset));
+
+  ok = fclose(m_file) == 0 && ok;
+  m_file = nullptr;
+  m_index.clear();
+  if (!ok) {
+    return std::unexpected(AviError::WriteFailed);
+  }
+  return {};
+}
+
+auto AviWriter::write(const void* data, size_t len) -> bool {
+  return fwrite(data, 1, len, m_file) == len;
+}
+
+auto AviWriter::write_at(long position, uint32_t value) -> bool {
+  auto bytes = le32(value);
+  return fseek(m_file, position, SEEK_SET) == 0 && write(bytes.data(), bytes.size());
+}
+
+}  // namespace recorder
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <expected>
+#include <span>
+#include <vector>
+
+namespace recorder {
+
+enum class AviError : uint8_t { NotOpen, OpenFailed, WriteFailed, TooLarge };
+
+// MJPEG in an AVI 1.0 container (RIFF 'AVI ' with an idx1 index), written with plain stdio so it runs the same
+// against a FAT file on the SD card and a regular file on a Linux host.
+//
+// Frames are appended as '00dc' chunks as they come in. The index is kept in memory and written by close(), which
+// also patches the headers with the frame count and the rate measured from the frame timestamps.
+class AviWriter {
+ public:
+  // AVI 1.0 readers choke past 1 GiB, rotate well before that
+  static constexpr uint64_t max_file_bytes = 1ULL << 30;
+
+  AviWriter() = default;
+  ~AviWriter();
+  AviWriter(const AviWriter&) = delete;
+  auto operator=(const AviWriter&) -> AviWriter& = delete;
+
+  // io_buffer becomes the stdio buffer, so the file system sees writes of its size. Pass an empty span for the
+  // default buffer. max_frames sizes the index up front, more frames still work but reallocate.
+  auto open(const char* path, uint16_t width, uint16_t height, std::span<uint8_t> io_buffer, size_t max_frames)
+    -> std::expected<void, AviError>;
+  auto write_frame(const uint8_t* jpeg, size_t len, int64_t timestamp_us) -> std::expected<void, AviError>;
+  // Writes the index and patches the headers, the writer can be opened again afterwards.
+  auto close() -> std::expected<void, AviError>;
+
+  [[nodiscard]] auto is_open() const -> bool {
+    return m_file != nullptr;
+  }
+  [[nodiscard]] auto frames() const -> uint32_t {
+    return static_cast<uint32_t>(m_index.size());
+  }
+  // size of the file so far, not counting the index
+  [[nodiscard]] auto bytes() const -> uint64_t {
+    return m_movi_end;
+  }
+  [[nodiscard]] auto duration_us() const -> int64_t {
+    return m_index.empty() ? 0 : m_last_timestamp_us - m_first_timestamp_us;
+  }
+
+ private:
+  struct IndexEntry {
+    uint32_t offset;  // from the 'movi' fourcc
+    uint32_t size;
+  };
+
+  auto write(const void* data, size_t len) -> bool;
+  auto write_at(long position, uint32_t value) -> bool;
+
+  FILE* m_file = nullptr;
+  uint16_t m_width = 0;
+  uint16_t m_height = 0;
+  uint32_t m_max_chunk = 0;
+  uint64_t m_movi_end = 0;
+  int64_t m_first_timestamp_us = 0;
+  int64_t m_last_timestamp_us = 0;
+  std::vector<IndexEntry> m_index;
+};
+
+}  // namespace recorder
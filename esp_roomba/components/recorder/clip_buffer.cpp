@@ -0,0 +1,344 @@
+#include "clip_buffer.hpp"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "avi_writer.hpp"
+#include "camera.hpp"
+#include "metrics.hpp"
+#include "recorder.hpp"
+
+namespace recorder {
+
+static const char* TAG = "clip";
+
+// frames in the ring at most, more than a 3 MB arena holds at VGA
+constexpr size_t max_clip_frames = 256;
+constexpr uint32_t save_stack_size = 4096;
+constexpr UBaseType_t save_priority = 2;
+
+struct FrameSlot {
+  uint32_t offset;  // into the arena
+  uint32_t len;
+  int64_t timestamp_us;
+  uint16_t width;
+  uint16_t height;
+};
+
+// frames, written by the capture task only
+static uint8_t* s_arena = nullptr;
+static size_t s_arena_size = 0;
+static std::array<FrameSlot, max_clip_frames> s_slots{};
+static size_t s_oldest = 0;  // index into s_slots
+static size_t s_frame_count = 0;
+// held while a frame is copied in, so freezing waits for it
+static SemaphoreHandle_t s_frames_mutex = nullptr;
+
+// motor commands, from the httpd and Wi-Fi tasks
+static ClipMotorCommand* s_motor = nullptr;
+static size_t s_motor_capacity = 0;
+static size_t s_motor_next = 0;
+static size_t s_motor_count = 0;
+static portMUX_TYPE s_motor_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static std::atomic<bool> s_frozen{false};
+static std::atomic<int64_t> s_trigger_us{0};
+static std::atomic<uint32_t> s_event_number{0};
+static std::array<char, 32> s_reason{};
+static std::atomic<uint32_t> s_save_seconds{0};
+
+static metrics::Counter s_events{"roomba_clip_events_total", "Clip triggers"};
+static metrics::Gauge s_clip_span_ms{"roomba_clip_span_ms", "Time covered by the frames currently in the clip ring"};
+
+static auto slot_at(size_t age) -> FrameSlot& {
+  return s_slots[(s_oldest + age) % s_slots.size()];
+}
+
+static auto overlaps(const FrameSlot& slot, size_t start, size_t len) -> bool {
+  return slot.offset < start + len && start < slot.offset + slot.len;
+}
+
+// Places a frame right after the newest one, or at the start of the arena if it doesn't fit before the end,
+// dropping the oldest frames up to the newest one in the way.
+static auto allocate(size_t len) -> size_t {
+  size_t start = 0;
+  if (s_frame_count > 0) {
+    const FrameSlot& newest = slot_at(s_frame_count - 1);
+    start = newest.offset + newest.len;
+    if (start + len > s_arena_size) {
+      start = 0;
+    }
+  }
+  size_t evict = 0;
+  for (size_t age = 0; age < s_frame_count; age++) {
+    if (overlaps(slot_at(age), start, len)) {
+      evict = age + 1;
+    }
+  }
+  if (s_frame_count == s_slots.size()) {
+    evict = std::max<size_t>(evict, 1);
+  }
+  s_oldest = (s_oldest + evict) % s_slots.size();
+  s_frame_count -= evict;
+  return start;
+}
+
+// runs in the capture task
+static auto on_frame(const camera_fb_t& fb) -> void {
+  if (s_frozen || fb.len > s_arena_size) {
+    return;
+  }
+  if (xSemaphoreTake(s_frames_mutex, 0) != pdTRUE) {
+    return;
+  }
+  // checked again, a trigger may have frozen the ring while this was waiting
+  if (!s_frozen) {
+    size_t offset = allocate(fb.len);
+    memcpy(s_arena + offset, fb.buf, fb.len);
+    slot_at(s_frame_count) = FrameSlot{
+      .offset = static_cast<uint32_t>(offset),
+      .len = static_cast<uint32_t>(fb.len),
+      .timestamp_us = static_cast<int64_t>(fb.timestamp.tv_sec) * 1000000 + fb.timestamp.tv_usec,
+      .width = static_cast<uint16_t>(fb.width),
+      .height = static_cast<uint16_t>(fb.height),
+    };
+    s_frame_count++;
+    s_clip_span_ms.set(
+      static_cast<int32_t>((slot_at(s_frame_count - 1).timestamp_us - slot_at(0).timestamp_us) / 1000));
+  }
+  xSemaphoreGive(s_frames_mutex);
+}
+
+auto init_clip_buffer(const ClipConfig& config) -> esp_err_t {
+  if (s_arena != nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  s_frames_mutex = xSemaphoreCreateMutex();
+  s_arena = static_cast<uint8_t*>(heap_caps_malloc(config.frame_budget_bytes, MALLOC_CAP_SPIRAM));
+  s_motor = static_cast<ClipMotorCommand*>(
+    heap_caps_calloc(config.motor_records, sizeof(ClipMotorCommand), MALLOC_CAP_SPIRAM));
+  if (s_frames_mutex == nullptr || s_arena == nullptr || s_motor == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the clip ring");
+    heap_caps_free(s_arena);
+    heap_caps_free(s_motor);
+    s_arena = nullptr;
+    s_motor = nullptr;
+    return ESP_ERR_NO_MEM;
+  }
+  s_arena_size = config.frame_budget_bytes;
+  s_motor_capacity = config.motor_records;
+  camera::add_frame_listener(on_frame);
+  ESP_LOGI(
+    TAG,
+    "Clip ring: %u KB of frames, %u motor commands",
+    static_cast<unsigned>(s_arena_size / 1024),
+    static_cast<unsigned>(s_motor_capacity));
+  return ESP_OK;
+}
+
+auto clip_record_motor(const uint8_t* speeds, size_t len, int64_t timestamp_us) -> void {
+  if (s_motor == nullptr || len != sizeof(ClipMotorCommand::speeds)) {
+    return;
+  }
+  ClipMotorCommand command{.timestamp_us = timestamp_us, .speeds = {}};
+  memcpy(command.speeds.data(), speeds, len);
+  portENTER_CRITICAL(&s_motor_lock);
+  // checked under the lock, trigger_clip() takes it once after freezing
+  if (s_frozen) {
+    portEXIT_CRITICAL(&s_motor_lock);
+    return;
+  }
+  s_motor[s_motor_next] = command;
+  s_motor_next = (s_motor_next + 1) % s_motor_capacity;
+  s_motor_count = std::min(s_motor_count + 1, s_motor_capacity);
+  portEXIT_CRITICAL(&s_motor_lock);
+}
+
+auto trigger_clip(std::string_view reason) -> uint32_t {
+  if (s_arena == nullptr) {
+    return 0;
+  }
+  if (s_frozen.exchange(true)) {
+    return s_event_number;
+  }
+  // wait out a frame or command that is being copied in
+  xSemaphoreTake(s_frames_mutex, portMAX_DELAY);
+  xSemaphoreGive(s_frames_mutex);
+  portENTER_CRITICAL(&s_motor_lock);
+  portEXIT_CRITICAL(&s_motor_lock);
+
+  s_trigger_us = esp_timer_get_time();
+  size_t len = std::min(reason.size(), s_reason.size() - 1);
+  // ends up in json and csv
+  std::ranges::replace_copy_if(
+    reason.substr(0, len), s_reason.begin(), [](char c) { return c == '"' || c == '\\' || c == '\n'; }, '_');
+  s_reason[len] = '\0';
+  s_events.increment();
+  uint32_t number = s_event_number.fetch_add(1) + 1;
+  ESP_LOGW(
+    TAG,
+    "Event %" PRIu32 " (%s), clip frozen with %u frames",
+    number,
+    s_reason.data(),
+    static_cast<unsigned>(s_frame_count));
+  return number;
+}
+
+auto release_clip() -> void {
+  s_frozen = false;
+}
+
+auto clip_frozen() -> bool {
+  return s_frozen;
+}
+
+auto for_each_clip_frame(std::chrono::seconds seconds, ClipFrameVisitor visitor, void* ctx) -> size_t {
+  if (!s_frozen) {
+    return 0;
+  }
+  int64_t since = s_trigger_us - std::chrono::microseconds(seconds).count();
+  size_t visited = 0;
+  for (size_t age = 0; age < s_frame_count; age++) {
+    const FrameSlot& slot = slot_at(age);
+    if (slot.timestamp_us < since) {
+      continue;
+    }
+    visited++;
+    if (!visitor(ClipFrame{s_arena + slot.offset, slot.len, slot.timestamp_us}, ctx)) {
+      break;
+    }
+  }
+  return visited;
+}
+
+auto for_each_clip_motor(std::chrono::seconds seconds, ClipMotorVisitor visitor, void* ctx) -> size_t {
+  if (!s_frozen || s_motor == nullptr) {
+    return 0;
+  }
+  int64_t since = s_trigger_us - std::chrono::microseconds(seconds).count();
+  size_t visited = 0;
+  size_t oldest = (s_motor_next + s_motor_capacity - s_motor_count) % s_motor_capacity;
+  for (size_t i = 0; i < s_motor_count; i++) {
+    const ClipMotorCommand& command = s_motor[(oldest + i) % s_motor_capacity];
+    if (command.timestamp_us < since) {
+      continue;
+    }
+    visited++;
+    if (!visitor(command, ctx)) {
+      break;
+    }
+  }
+  return visited;
+}
+
+static auto save_task(void* /*arg*/) -> void {
+  auto seconds = std::chrono::seconds(s_save_seconds.load());
+  uint32_t event = s_event_number.load();
+  std::array<char, 48> path{};
+
+  // size the AVI from the newest frame, the ring only holds one resolution at a time in practice
+  uint16_t width = s_frame_count > 0 ? slot_at(s_frame_count - 1).width : 0;
+  uint16_t height = s_frame_count > 0 ? slot_at(s_frame_count - 1).height : 0;
+  snprintf(path.data(), path.size(), "%s/EVT%05" PRIu32 ".AVI", sd_mount_point(), event);
+  AviWriter avi;
+  bool ok = avi.open(path.data(), width, height, {}, s_frame_count).has_value();
+  if (ok) {
+    for_each_clip_frame(
+      seconds,
+      [](const ClipFrame& frame, void* ctx) {
+        return static_cast<AviWriter*>(ctx)->write_frame(frame.jpeg, frame.len, frame.timestamp_us).has_value();
+      },
+      &avi);
+    ok = avi.close().has_value();
+  }
+
+  snprintf(path.data(), path.size(), "%s/EVT%05" PRIu32 ".CSV", sd_mount_point(), event);
+  FILE* csv = ok ? fopen(path.data(), "w") : nullptr;
+  if (csv != nullptr) {
+    fprintf(csv, "# %s, trigger at %" PRId64 " us\ntimestamp_us,m1,m2,m3,m4\n", s_reason.data(), s_trigger_us.load());
+    for_each_clip_motor(
+      seconds,
+      [](const ClipMotorCommand& command, void* ctx) {
+        fprintf(
+          static_cast<FILE*>(ctx),
+          "%" PRId64 ",%d,%d,%d,%d\n",
+          command.timestamp_us,
+          command.speeds[0],
+          command.speeds[1],
+          command.speeds[2],
+          command.speeds[3]);
+        return true;
+      },
+      csv);
+    ok = fclose(csv) == 0;
+  } else {
+    ok = false;
+  }
+
+  if (ok) {
+    ESP_LOGI(TAG, "Saved event %" PRIu32 " to %s/EVT%05" PRIu32 ".*", event, sd_mount_point(), event);
+  } else {
+    ESP_LOGE(TAG, "Failed to save event %" PRIu32, event);
+  }
+  release_clip();
+  s_save_seconds = 0;
+  vTaskDelete(nullptr);
+}
+
+auto save_clip(std::chrono::seconds seconds) -> esp_err_t {
+  if (!s_frozen || sd_mount_point() == nullptr) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  uint32_t expected = 0;
+  auto save_seconds = static_cast<uint32_t>(std::max<int64_t>(seconds.count(), 1));
+  if (!s_save_seconds.compare_exchange_strong(expected, save_seconds)) {
+    // already saving
+    return ESP_ERR_INVALID_STATE;
+  }
+  // only exists while saving, so an unused clip ring costs no stack
+  BaseType_t created =
+    xTaskCreatePinnedToCore(save_task, "clip_save", save_stack_size, nullptr, save_priority, nullptr, 0);
+  if (created != pdPASS) {
+    s_save_seconds = 0;
+    return ESP_ERR_NO_MEM;
+  }
+  return ESP_OK;
+}
+
+auto clip_saving() -> bool {
+  return s_save_seconds.load() != 0;
+}
+
+auto render_clip_status_json(std::string& out) -> void {
+  std::array<char, 192> line{};
+  int64_t span_ms = 0;
+  size_t frame_count = 0;
+  if (s_arena != nullptr && xSemaphoreTake(s_frames_mutex, pdMS_TO_TICKS(10)) == pdTRUE) {
+    frame_count = s_frame_count;
+    span_ms = frame_count > 1 ? (slot_at(frame_count - 1).timestamp_us - slot_at(0).timestamp_us) / 1000 : 0;
+    xSemaphoreGive(s_frames_mutex);
+  }
+  snprintf(
+    line.data(),
+    line.size(),
+    "{\"frozen\":%s,\"event\":%" PRIu32 ",\"reason\":\"%s\",\"frames\":%u,\"span_ms\":%" PRId64 ",\"motor\":%u}",
+    s_frozen ? "true" : "false",
+    s_event_number.load(),
+    s_frozen ? s_reason.data() : "",
+    static_cast<unsigned>(frame_count),
+    span_ms,
+    static_cast<unsigned>(s_motor_count));
+  out += line.data();
+}
+
+}  // namespace recorder
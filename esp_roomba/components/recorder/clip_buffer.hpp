@@ -0,0 +1,60 @@
+#pragma once
+
+#include <esp_err.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace recorder {
+
+// Pre-roll ring of the most recent frames and motor commands, so an event can be exported together with the
+// seconds leading up to it.
+//
+// Everything lives in two PSRAM blocks allocated once by init_clip_buffer(). Frames are packed back to back into a
+// byte arena and the oldest ones are overwritten, so keeping the ring costs one memcpy per frame and no allocation.
+struct ClipConfig {
+  // JPEG bytes kept, at ~30 KB per VGA frame 3 MB covers about 6 s of 16 fps video
+  size_t frame_budget_bytes = 3 * 1024 * 1024;
+  // 30 s of commands at the client's 100 Hz
+  size_t motor_records = 3000;
+};
+
+struct ClipFrame {
+  const uint8_t* jpeg;
+  size_t len;
+  int64_t timestamp_us;
+};
+
+struct ClipMotorCommand {
+  int64_t timestamp_us;
+  std::array<int8_t, 4> speeds;
+};
+
+auto init_clip_buffer(const ClipConfig& config = {}) -> esp_err_t;
+// Any task, does nothing while the ring is frozen or not allocated.
+auto clip_record_motor(const uint8_t* speeds, size_t len, int64_t timestamp_us) -> void;
+
+// Freezes the ring until release_clip(), so the moments before the event survive the export. Returns the event
+// number, 0 if the ring is not allocated. A trigger while frozen keeps the first event.
+auto trigger_clip(std::string_view reason) -> uint32_t;
+auto release_clip() -> void;
+[[nodiscard]] auto clip_frozen() -> bool;
+
+// Visit the frozen frames / commands from `seconds` before the trigger up to it, oldest first.
+// The visitor returns false to stop early. Returns how many were visited.
+using ClipFrameVisitor = bool (*)(const ClipFrame& frame, void* ctx);
+using ClipMotorVisitor = bool (*)(const ClipMotorCommand& command, void* ctx);
+auto for_each_clip_frame(std::chrono::seconds seconds, ClipFrameVisitor visitor, void* ctx) -> size_t;
+auto for_each_clip_motor(std::chrono::seconds seconds, ClipMotorVisitor visitor, void* ctx) -> size_t;
+
+// Writes EVTnnnnn.AVI and EVTnnnnn.CSV (motor commands) to the SD card from the recorder task, then releases the
+// ring. Needs recorder::init().
+auto save_clip(std::chrono::seconds seconds) -> esp_err_t;
+[[nodiscard]] auto clip_saving() -> bool;
+
+auto render_clip_status_json(std::string& out) -> void;
+
+}  // namespace recorder
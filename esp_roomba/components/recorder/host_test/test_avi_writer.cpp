@@ -0,0 +1,192 @@
+// Writes a few fake JPEG frames with AviWriter, rotates to a second file and walks both files chunk by chunk,
+// independently of the writer's own offsets.
+
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "avi_writer.hpp"
+
+static int s_failures = 0;
+
+#define CHECK(condition)                                                   \
+  do {                                                                     \
+    if (!(condition)) {                                                    \
+      std::fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+      s_failures++;                                                        \
+    }                                                                      \
+  } while (0)
+
+struct Frame {
+  std::vector<uint8_t> jpeg;
+  int64_t timestamp_us;
+};
+
+static auto make_frame(size_t len, uint8_t seed, int64_t timestamp_us) -> Frame {
+  Frame frame{std::vector<uint8_t>(len), timestamp_us};
+  for (size_t i = 0; i < len; i++) {
+    frame.jpeg[i] = static_cast<uint8_t>(seed + i * 7);
+  }
+  frame.jpeg[0] = 0xFF;
+  frame.jpeg[1] = 0xD8;
+  return frame;
+}
+
+static auto read_file(const std::string& path) -> std::vector<uint8_t> {
+  std::vector<uint8_t> data;
+  FILE* file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return data;
+  }
+  std::array<uint8_t, 4096> block{};
+  size_t got = 0;
+  while ((got = std::fread(block.data(), 1, block.size(), file)) > 0) {
+    data.insert(data.end(), block.begin(), block.begin() + static_cast<long>(got));
+  }
+  std::fclose(file);
+  return data;
+}
+
+static auto u32_at(const std::vector<uint8_t>& data, size_t offset) -> uint32_t {
+  if (offset + 4 > data.size()) {
+    return 0;
+  }
+  return static_cast<uint32_t>(data[offset]) | static_cast<uint32_t>(data[offset + 1]) << 8 |
+         static_cast<uint32_t>(data[offset + 2]) << 16 | static_cast<uint32_t>(data[offset + 3]) << 24;
+}
+
+static auto fourcc_at(const std::vector<uint8_t>& data, size_t offset, const char* code) -> bool {
+  return offset + 4 <= data.size() && std::memcmp(&data[offset], code, 4) == 0;
+}
+
+// Finds a top level LIST of the given type inside [begin, end), returns the offset of its "LIST" fourcc.
+static auto find_list(const std::vector<uint8_t>& data, size_t begin, size_t end, const char* type) -> size_t {
+  size_t offset = begin;
+  while (offset + 12 <= end) {
+    uint32_t size = u32_at(data, offset + 4);
+    if (fourcc_at(data, offset, "LIST") && fourcc_at(data, offset + 8, type)) {
+      return offset;
+    }
+    offset += 8 + ((size + 1) & ~1U);
+  }
+  return std::string::npos;
+}
+
+static auto verify(const std::string& path, const std::vector<Frame>& frames, uint16_t width, uint16_t height) -> void {
+  std::vector<uint8_t> data = read_file(path);
+  CHECK(data.size() > 12);
+  if (data.size() <= 12) {
+    return;
+  }
+
+  CHECK(fourcc_at(data, 0, "RIFF"));
+  CHECK(fourcc_at(data, 8, "AVI "));
+  CHECK(u32_at(data, 4) == data.size() - 8);
+
+  size_t hdrl = find_list(data, 12, data.size(), "hdrl");
+  CHECK(hdrl != std::string::npos);
+  if (hdrl == std::string::npos) {
+    return;
+  }
+  size_t hdrl_end = hdrl + 8 + u32_at(data, hdrl + 4);
+  CHECK(hdrl_end <= data.size());
+
+  // avih comes first in hdrl: us per frame, max bytes/s, padding, flags, total frames, initial, streams, buffer, w, h
+  size_t avih = hdrl + 12;
+  CHECK(fourcc_at(data, avih, "avih"));
+  CHECK(u32_at(data, avih + 4) == 56);
+  CHECK(u32_at(data, avih + 8 + 16) == frames.size());
+  CHECK(u32_at(data, avih + 8 + 24) == 1);
+  CHECK(u32_at(data, avih + 8 + 32) == width);
+  CHECK(u32_at(data, avih + 8 + 36) == height);
+  if (frames.size() > 1) {
+    auto expected_us = static_cast<uint32_t>(
+      (frames.back().timestamp_us - frames.front().timestamp_us) / static_cast<int64_t>(frames.size() - 1));
+    CHECK(u32_at(data, avih + 8) == expected_us);
+  }
+
+  size_t strl = find_list(data, avih + 8 + 56, hdrl_end, "strl");
+  CHECK(strl != std::string::npos);
+  if (strl != std::string::npos) {
+    CHECK(strl + 8 + u32_at(data, strl + 4) == hdrl_end);
+    size_t strh = strl + 12;
+    CHECK(fourcc_at(data, strh, "strh"));
+    CHECK(fourcc_at(data, strh + 8, "vids"));
+    CHECK(fourcc_at(data, strh + 12, "MJPG"));
+    // dwLength
+    CHECK(u32_at(data, strh + 8 + 32) == frames.size());
+  }
+
+  size_t movi = find_list(data, hdrl_end, data.size(), "movi");
+  CHECK(movi != std::string::npos);
+  if (movi == std::string::npos) {
+    return;
+  }
+  size_t movi_fourcc = movi + 8;
+  size_t movi_end = movi_fourcc + u32_at(data, movi + 4);
+  CHECK(movi_end <= data.size());
+
+  // frame chunks, in order and with the data that went in
+  std::vector<size_t> chunk_offsets;
+  size_t offset = movi_fourcc + 4;
+  for (const Frame& frame : frames) {
+    CHECK(fourcc_at(data, offset, "00dc"));
+    CHECK(u32_at(data, offset + 4) == frame.jpeg.size());
+    CHECK(offset + 8 + frame.jpeg.size() <= movi_end);
+    if (offset + 8 + frame.jpeg.size() <= data.size()) {
+      CHECK(std::memcmp(&data[offset + 8], frame.jpeg.data(), frame.jpeg.size()) == 0);
+    }
+    chunk_offsets.push_back(offset);
+    offset += 8 + ((frame.jpeg.size() + 1) & ~size_t{1});
+  }
+  CHECK(offset == movi_end);
+
+  // idx1 follows movi, one keyframe entry per chunk with its offset from the 'movi' fourcc
+  CHECK(fourcc_at(data, movi_end, "idx1"));
+  CHECK(u32_at(data, movi_end + 4) == 16 * frames.size());
+  CHECK(movi_end + 8 + 16 * frames.size() == data.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    size_t entry = movi_end + 8 + 16 * i;
+    CHECK(fourcc_at(data, entry, "00dc"));
+    CHECK(u32_at(data, entry + 4) == 0x10);
+    CHECK(u32_at(data, entry + 8) == chunk_offsets[i] - movi_fourcc);
+    CHECK(u32_at(data, entry + 12) == frames[i].jpeg.size());
+  }
+}
+
+static auto write_file(recorder::AviWriter& writer, const std::string& path, const std::vector<Frame>& frames) -> void {
+  std::vector<uint8_t> io_buffer(512);
+  CHECK(writer.open(path.c_str(), 640, 480, io_buffer, frames.size()).has_value());
+  for (const Frame& frame : frames) {
+    CHECK(writer.write_frame(frame.jpeg.data(), frame.jpeg.size(), frame.timestamp_us).has_value());
+  }
+  CHECK(writer.frames() == frames.size());
+  CHECK(writer.close().has_value());
+  CHECK(!writer.is_open());
+}
+
+auto main(int argc, char** argv) -> int {
+  std::string dir = argc > 1 ? argv[1] : ".";
+
+  // odd lengths exercise the chunk padding, the 2 KB frames cross the 512 byte stdio buffer
+  std::vector<Frame> first{
+    make_frame(1001, 1, 1000000), make_frame(2048, 2, 1062500), make_frame(777, 3, 1125000)};
+  std::vector<Frame> second{make_frame(3000, 4, 5000000), make_frame(15, 5, 5100000)};
+
+  // the same writer rotates to a new file, as the recorder does
+  recorder::AviWriter writer;
+  write_file(writer, dir + "/avi_test_1.avi", first);
+  write_file(writer, dir + "/avi_test_2.avi", second);
+
+  verify(dir + "/avi_test_1.avi", first, 640, 480);
+  verify(dir + "/avi_test_2.avi", second, 640, 480);
+
+  if (s_failures > 0) {
+    std::fprintf(stderr, "%d checks failed\n", s_failures);
+    return 1;
+  }
+  std::printf("avi_writer: all checks passed\n");
+  return 0;
+}
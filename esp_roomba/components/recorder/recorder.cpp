@@ -0,0 +1,387 @@
+#include "recorder.hpp"
+
+#include <dirent.h>
+#include <driver/sdspi_host.h>
+#include <driver/spi_common.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_vfs_fat.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <sdmmc_cmd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <span>
+
+#include "avi_writer.hpp"
+#include "camera.hpp"
+#include "metrics.hpp"
+#include "tracing.hpp"
+
+namespace recorder {
+
+static const char* TAG = "recorder";
+
+// XIAO ESP32S3 Sense microSD slot
+constexpr gpio_num_t sd_cs = GPIO_NUM_21;
+constexpr gpio_num_t sd_sck = GPIO_NUM_7;
+constexpr gpio_num_t sd_miso = GPIO_NUM_8;
+constexpr gpio_num_t sd_mosi = GPIO_NUM_9;
+constexpr spi_host_device_t sd_spi_host = SPI2_HOST;
+
+// per half, about 15 VGA frames, enough to ride out a slow card erase
+constexpr size_t staging_size = 512 * 1024;
+// stdio buffer in DMA capable RAM, the card only ever sees writes of this size
+constexpr size_t io_block_size = 16 * 1024;
+// FAT allocation unit, large clusters keep the FAT updates rare
+constexpr size_t allocation_unit_size = 32 * 1024;
+// sizes each file's index up front, 10 minutes at 30 fps
+constexpr size_t expected_frames_per_file = 30 * 60 * 10;
+constexpr uint32_t writer_stack_size = 4096;
+// below every task on the capture, stream and motor path
+constexpr UBaseType_t writer_priority = 2;
+// how quickly a stop request closes the file when no half fills up
+constexpr TickType_t writer_poll_ticks = pdMS_TO_TICKS(500);
+
+struct StagedFrame {
+  uint32_t len;
+  uint16_t width;
+  uint16_t height;
+  int64_t timestamp_us;
+};
+
+struct Staging {
+  uint8_t* data;
+  size_t used;
+};
+
+static RecorderConfig s_config;
+static sdmmc_card_t* s_card = nullptr;
+static std::atomic<RecorderState> s_state{RecorderState::Unavailable};
+static std::atomic<bool> s_stop_requested{false};
+
+// the capture task fills s_staging[s_filling] and hands it to the writer through s_full_halves once it's full
+static std::array<Staging, 2> s_staging{};
+static std::array<std::atomic<bool>, 2> s_half_full{};
+static size_t s_filling = 0;
+static SemaphoreHandle_t s_staging_mutex = nullptr;
+static QueueHandle_t s_full_halves = nullptr;
+
+// writer task only, apart from the atomics read for the status
+static AviWriter s_avi;
+static uint8_t* s_io_buffer = nullptr;
+static int64_t s_file_opened_us = 0;
+static std::atomic<uint32_t> s_file_number{0};
+static std::atomic<uint32_t> s_file_frames{0};
+static std::atomic<uint64_t> s_file_bytes{0};
+// set after a write error, whatever is still staged is thrown away
+static bool s_failed = false;
+
+static metrics::Counter s_frames_written{"roomba_recorder_frames_total", "Frames written to the SD card"};
+static metrics::Counter s_frames_dropped{
+  "roomba_recorder_frames_dropped_total", "Frames not recorded because both staging halves were busy"};
+static metrics::Counter s_bytes_written{"roomba_recorder_bytes_total", "Frame bytes written to the SD card"};
+static metrics::Counter s_files{"roomba_recorder_files_total", "Recording files finished"};
+static metrics::Histogram s_half_write_ms{
+  "roomba_recorder_half_write_ms", "Time to write one staging half to the card", {10, 25, 50, 100, 250, 500, 1000}};
+
+static auto align8(size_t len) -> size_t {
+  return (len + 7) & ~size_t{7};
+}
+
+// runs in the capture task
+static auto on_frame(const camera_fb_t& fb) -> void {
+  if (s_state != RecorderState::Recording) {
+    return;
+  }
+  int64_t start = esp_timer_get_time();
+  size_t needed = sizeof(StagedFrame) + align8(fb.len);
+  // only contended while the writer grabs the last partial half
+  if (xSemaphoreTake(s_staging_mutex, 0) != pdTRUE) {
+    s_frames_dropped.increment();
+    return;
+  }
+
+  if (s_staging[s_filling].used + needed > staging_size) {
+    size_t other = 1 - s_filling;
+    if (needed > staging_size || s_half_full[other]) {
+      xSemaphoreGive(s_staging_mutex);
+      s_frames_dropped.increment();
+      return;
+    }
+    s_half_full[s_filling] = true;
+    xQueueSend(s_full_halves, &s_filling, 0);
+    s_filling = other;
+  }
+
+  Staging& half = s_staging[s_filling];
+  StagedFrame header{
+    .len = static_cast<uint32_t>(fb.len),
+    .width = static_cast<uint16_t>(fb.width),
+    .height = static_cast<uint16_t>(fb.height),
+    .timestamp_us = static_cast<int64_t>(fb.timestamp.tv_sec) * 1000000 + fb.timestamp.tv_usec,
+  };
+  memcpy(half.data + half.used, &header, sizeof(header));
+  memcpy(half.data + half.used + sizeof(header), fb.buf, fb.len);
+  half.used += needed;
+  xSemaphoreGive(s_staging_mutex);
+  tracing::record(tracing::Span::RecordStage, start, esp_timer_get_time(), static_cast<uint32_t>(fb.len));
+}
+
+static auto file_path(uint32_t number, std::span<char> out) -> void {
+  // 8.3 names, long file names are disabled in the FAT config
+  snprintf(out.data(), out.size(), "%s/REC%05" PRIu32 ".AVI", s_config.mount_point, number);
+}
+
+// continue numbering after the files already on the card
+static auto find_last_file_number() -> uint32_t {
+  uint32_t last = 0;
+  DIR* dir = opendir(s_config.mount_point);
+  if (dir == nullptr) {
+    return last;
+  }
+  while (dirent* entry = readdir(dir)) {
+    unsigned number = 0;
+    if (sscanf(entry->d_name, "REC%05u.AVI", &number) == 1) {
+      last = std::max<uint32_t>(last, number);
+    }
+  }
+  closedir(dir);
+  return last;
+}
+
+static auto close_file() -> void {
+  if (!s_avi.is_open()) {
+    return;
+  }
+  uint32_t frames = s_avi.frames();
+  if (auto result = s_avi.close(); !result) {
+    ESP_LOGE(TAG, "Failed to finish REC%05" PRIu32 ".AVI", s_file_number.load());
+    return;
+  }
+  s_files.increment();
+  ESP_LOGI(TAG, "Finished REC%05" PRIu32 ".AVI, %" PRIu32 " frames", s_file_number.load(), frames);
+}
+
+static auto open_next_file(uint16_t width, uint16_t height) -> bool {
+  std::array<char, 48> path{};
+  uint32_t number = s_file_number.load() + 1;
+  file_path(number, path);
+  auto result = s_avi.open(path.data(), width, height, {s_io_buffer, io_block_size}, expected_frames_per_file);
+  if (!result) {
+    ESP_LOGE(TAG, "Failed to create %s", path.data());
+    return false;
+  }
+  s_file_number = number;
+  s_file_frames = 0;
+  s_file_bytes = s_avi.bytes();
+  s_file_opened_us = esp_timer_get_time();
+  ESP_LOGI(TAG, "Recording to %s (%ux%u)", path.data(), width, height);
+  return true;
+}
+
+static auto should_rotate() -> bool {
+  auto age = std::chrono::microseconds(esp_timer_get_time() - s_file_opened_us);
+  return s_avi.bytes() >= s_config.rotate_bytes || age >= s_config.rotate_after;
+}
+
+// the card went away or filled up, give the camera back and wait for the next start
+static auto abort_recording() -> void {
+  close_file();
+  s_failed = true;
+  if (s_state.exchange(RecorderState::Idle) == RecorderState::Recording) {
+    camera::release();
+    s_stop_requested = true;
+  }
+}
+
+static auto write_half(size_t index) -> void {
+  Staging& half = s_staging[index];
+  if (half.used == 0 || s_failed) {
+    half.used = 0;
+    return;
+  }
+  int64_t start = esp_timer_get_time();
+  size_t offset = 0;
+  while (offset < half.used) {
+    StagedFrame header{};
+    memcpy(&header, half.data + offset, sizeof(header));
+    const uint8_t* jpeg = half.data + offset + sizeof(header);
+    offset += sizeof(header) + align8(header.len);
+
+    if (s_avi.is_open() && should_rotate()) {
+      close_file();
+    }
+    if (!s_avi.is_open() && !open_next_file(header.width, header.height)) {
+      abort_recording();
+      break;
+    }
+    auto result = s_avi.write_frame(jpeg, header.len, header.timestamp_us);
+    if (!result && result.error() == AviError::TooLarge) {
+      close_file();
+      if (open_next_file(header.width, header.height)) {
+        result = s_avi.write_frame(jpeg, header.len, header.timestamp_us);
+      }
+    }
+    if (!result) {
+      ESP_LOGE(TAG, "Write failed, stopping the recording");
+      abort_recording();
+      break;
+    }
+    s_frames_written.increment();
+    s_bytes_written.increment(header.len);
+    s_file_frames = s_avi.frames();
+    s_file_bytes = s_avi.bytes();
+  }
+  half.used = 0;
+  int64_t end = esp_timer_get_time();
+  s_half_write_ms.observe(static_cast<uint32_t>((end - start) / 1000));
+  tracing::record(tracing::Span::RecordWrite, start, end, static_cast<uint32_t>(offset));
+}
+
+static auto writer_task(void* /*arg*/) -> void {
+  while (true) {
+    size_t index = 0;
+    if (xQueueReceive(s_full_halves, &index, writer_poll_ticks) == pdTRUE) {
+      write_half(index);
+      s_half_full[index] = false;
+    }
+
+    if (s_stop_requested) {
+      // on_frame already ignores new frames, the mutex waits out one that is still being copied
+      xSemaphoreTake(s_staging_mutex, portMAX_DELAY);
+      while (xQueueReceive(s_full_halves, &index, 0) == pdTRUE) {
+        write_half(index);
+        s_half_full[index] = false;
+      }
+      write_half(s_filling);
+      xSemaphoreGive(s_staging_mutex);
+      close_file();
+      s_failed = false;
+      s_stop_requested = false;
+    }
+  }
+}
+
+static auto mount_card() -> esp_err_t {
+  spi_bus_config_t bus{};
+  bus.mosi_io_num = sd_mosi;
+  bus.miso_io_num = sd_miso;
+  bus.sclk_io_num = sd_sck;
+  bus.quadwp_io_num = -1;
+  bus.quadhd_io_num = -1;
+  bus.max_transfer_sz = io_block_size;
+  esp_err_t err = spi_bus_initialize(sd_spi_host, &bus, SPI_DMA_CH_AUTO);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "SPI bus init failed: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+  host.slot = sd_spi_host;
+  sdspi_device_config_t slot = SDSPI_DEVICE_CONFIG_DEFAULT();
+  slot.gpio_cs = sd_cs;
+  slot.host_id = sd_spi_host;
+
+  esp_vfs_fat_sdmmc_mount_config_t mount{};
+  mount.format_if_mount_failed = false;
+  mount.max_files = 2;
+  mount.allocation_unit_size = allocation_unit_size;
+  err = esp_vfs_fat_sdspi_mount(s_config.mount_point, &host, &slot, &mount, &s_card);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to mount the SD card: %s", esp_err_to_name(err));
+    spi_bus_free(sd_spi_host);
+    return err;
+  }
+  sdmmc_card_print_info(stdout, s_card);
+  return ESP_OK;
+}
+
+auto init(const RecorderConfig& config) -> esp_err_t {
+  if (s_state != RecorderState::Unavailable) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  s_config = config;
+
+  for (Staging& half : s_staging) {
+    half.data = static_cast<uint8_t*>(heap_caps_malloc(staging_size, MALLOC_CAP_SPIRAM));
+    half.used = 0;
+  }
+  s_io_buffer = static_cast<uint8_t*>(heap_caps_malloc(io_block_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_DMA));
+  s_staging_mutex = xSemaphoreCreateMutex();
+  s_full_halves = xQueueCreate(s_staging.size(), sizeof(size_t));
+  if (s_staging[0].data == nullptr || s_staging[1].data == nullptr || s_io_buffer == nullptr ||
+      s_staging_mutex == nullptr || s_full_halves == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate the staging buffers");
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t err = mount_card();
+  if (err != ESP_OK) {
+    return err;
+  }
+  s_file_number = find_last_file_number();
+
+  if (xTaskCreatePinnedToCore(writer_task, "recorder", writer_stack_size, nullptr, writer_priority, nullptr, 0) !=
+      pdPASS) {
+    ESP_LOGE(TAG, "Failed to create the writer task");
+    return ESP_ERR_NO_MEM;
+  }
+  camera::add_frame_listener(on_frame);
+  s_state = RecorderState::Idle;
+  return ESP_OK;
+}
+
+auto start() -> esp_err_t {
+  // the previous file is still being finished
+  if (s_stop_requested) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  RecorderState expected = RecorderState::Idle;
+  if (!s_state.compare_exchange_strong(expected, RecorderState::Recording)) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  camera::acquire();
+  return ESP_OK;
+}
+
+auto stop() -> void {
+  RecorderState expected = RecorderState::Recording;
+  if (!s_state.compare_exchange_strong(expected, RecorderState::Idle)) {
+    return;
+  }
+  camera::release();
+  s_stop_requested = true;
+}
+
+auto get_state() -> RecorderState {
+  return s_state;
+}
+
+auto sd_mount_point() -> const char* {
+  return s_card != nullptr ? s_config.mount_point : nullptr;
+}
+
+auto render_status_json(std::string& out) -> void {
+  static constexpr std::array<const char*, 3> state_names = {"unavailable", "idle", "recording"};
+  std::array<char, 160> line{};
+  snprintf(
+    line.data(),
+    line.size(),
+    "{\"state\":\"%s\",\"file\":\"REC%05" PRIu32 ".AVI\",\"frames\":%" PRIu32 ",\"bytes\":%" PRIu64 "}",
+    state_names[static_cast<size_t>(s_state.load())],
+    s_file_number.load(),
+    s_file_frames.load(),
+    s_file_bytes.load());
+  out += line.data();
+}
+
+}  // namespace recorder
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <esp_err.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace recorder {
+
+struct RecorderConfig {
+  const char* mount_point = "/sdcard";
+  // a new file is started once either limit is reached
+  uint64_t rotate_bytes = 256ULL * 1024 * 1024;
+  std::chrono::seconds rotate_after{10 * 60};
+};
+
+enum class RecorderState : uint8_t { Unavailable, Idle, Recording };
+
+// Mounts the microSD card, allocates the staging buffers and starts the writer task.
+//
+// Frames are copied into one half of a PSRAM staging buffer by the capture task. Full halves are handed to a low
+// priority task that writes them out as MJPEG AVI files. If the writer falls behind, frames are dropped rather than
+// holding up the capture task or the stream.
+auto init(const RecorderConfig& config = {}) -> esp_err_t;
+// Holds the camera while recording.
+auto start() -> esp_err_t;
+// The open file is finished by the writer task shortly after.
+auto stop() -> void;
+[[nodiscard]] auto get_state() -> RecorderState;
+auto render_status_json(std::string& out) -> void;
+// nullptr until init() has mounted the card
+[[nodiscard]] auto sd_mount_point() -> const char*;
+
+}  // namespace recorder
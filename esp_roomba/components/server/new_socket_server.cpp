@@ -4,15 +4,20 @@
 #include <esp_http_server.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <lwip/inet.h>
 #include <lwip/netdb.h>
 #include <lwip/sockets.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 
 #include "hal/ledc_types.h"
+#include "metrics.hpp"
 #include "soc/gpio_num.h"
 
 namespace server {
@@ -20,11 +25,23 @@ namespace server {
 static const char* TAG = "ws_server";
 
 static httpd_handle_t s_server = nullptr;
+static SemaphoreHandle_t s_send_mutex = nullptr;
+
+constexpr size_t max_extra_uri_handlers = 8;
+static std::array<httpd_uri_t, max_extra_uri_handlers> s_extra_uri_handlers{};
+static size_t s_extra_uri_handler_count = 0;
 
 // ----------------------- WebSocket Handler ----------------------
 
 static WsMessageHandler g_ws_binary_handler = nullptr;
 static WsMessageHandler g_ws_text_handler = nullptr;
+static WsOpenHandler g_ws_open_handler = nullptr;
+static WsCloseHandler g_ws_close_handler = nullptr;
+static std::atomic<bool> s_traffic_tagging{true};
+
+static metrics::Counter s_ws_messages_received{
+  "roomba_ws_messages_received_total", "WebSocket data frames received from clients"};
+static metrics::Counter s_ws_bytes_received{"roomba_ws_bytes_received_total", "WebSocket payload bytes received"};
 
 auto set_ws_binary_handler(WsMessageHandler handler) -> void {
   g_ws_binary_handler = handler;
@@ -32,6 +49,150 @@ auto set_ws_binary_handler(WsMessageHandler handler) -> void {
 auto set_ws_text_handler(WsMessageHandler handler) -> void {
   g_ws_text_handler = handler;
 }
+auto set_ws_open_handler(WsOpenHandler handler) -> void {
+  g_ws_open_handler = handler;
+}
+auto set_ws_close_handler(WsCloseHandler handler) -> void {
+  g_ws_close_handler = handler;
+}
+
+auto add_uri_handler(const httpd_uri_t& uri) -> void {
+  if (s_extra_uri_handler_count >= max_extra_uri_handlers) {
+    ESP_LOGE(TAG, "Too many uri handlers, dropping %s", uri.uri);
+    return;
+  }
+  s_extra_uri_handlers[s_extra_uri_handler_count++] = uri;
+  if (s_server != nullptr) {
+    httpd_register_uri_handler(s_server, &uri);
+  }
+}
+
+auto ws_send(int fd, httpd_ws_frame_t& ws_pkt) -> esp_err_t {
+  if (s_server == nullptr || fd < 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (xSemaphoreTake(s_send_mutex, portMAX_DELAY) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  esp_err_t err = httpd_ws_send_data(s_server, fd, &ws_pkt);
+  xSemaphoreGive(s_send_mutex);
+  return err;
+}
+
+auto ws_send_text(int fd, const char* text, size_t len) -> esp_err_t {
+  httpd_ws_frame_t ws_pkt = {
+    .final = true,
+    .fragmented = false,
+    .type = HTTPD_WS_TYPE_TEXT,
+    .payload = reinterpret_cast<uint8_t*>(const_cast<char*>(text)),
+    .len = len,
+  };
+  return ws_send(fd, ws_pkt);
+}
+
+auto ws_send_binary(int fd, const uint8_t* data, size_t len) -> esp_err_t {
+  httpd_ws_frame_t ws_pkt = {
+    .final = true,
+    .fragmented = false,
+    .type = HTTPD_WS_TYPE_BINARY,
+    .payload = const_cast<uint8_t*>(data),
+    .len = len,
+  };
+  return ws_send(fd, ws_pkt);
+}
+
+auto ws_send_binary_chunked(int fd, size_t len, std::span<uint8_t> staging, ChunkFiller fill, void* ctx)
+  -> esp_err_t {
+  if (s_server == nullptr || fd < 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  if (staging.empty() || fill == nullptr) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (xSemaphoreTake(s_send_mutex, portMAX_DELAY) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  esp_err_t err = ESP_OK;
+  size_t sent = 0;
+  while (sent < len && err == ESP_OK) {
+    size_t chunk = fill(staging.data(), std::min(staging.size(), len - sent), ctx);
+    if (chunk == 0) {
+      err = ESP_ERR_INVALID_SIZE;
+      break;
+    }
+    httpd_ws_frame_t ws_pkt = {
+      .final = sent + chunk >= len,
+      .fragmented = true,
+      .type = sent == 0 ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_CONTINUE,
+      .payload = staging.data(),
+      .len = chunk,
+    };
+    err = httpd_ws_send_data(s_server, fd, &ws_pkt);
+    sent += chunk;
+  }
+  xSemaphoreGive(s_send_mutex);
+  return err;
+}
+
+auto ws_send_binary_parts(int fd, std::span<const std::span<const uint8_t>> parts) -> esp_err_t {
+  if (s_server == nullptr || fd < 0) {
+    return ESP_ERR_INVALID_STATE;
+  }
+  // the last part with data carries the final bit
+  size_t last = parts.size();
+  for (size_t i = 0; i < parts.size(); i++) {
+    last = parts[i].empty() ? last : i;
+  }
+  if (last == parts.size()) {
+    return ESP_ERR_INVALID_ARG;
+  }
+  if (xSemaphoreTake(s_send_mutex, portMAX_DELAY) != pdTRUE) {
+    return ESP_ERR_TIMEOUT;
+  }
+  esp_err_t err = ESP_OK;
+  bool first = true;
+  for (size_t i = 0; i <= last && err == ESP_OK; i++) {
+    if (parts[i].empty()) {
+      continue;
+    }
+    httpd_ws_frame_t ws_pkt = {
+      .final = i == last,
+      .fragmented = true,
+      .type = first ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_CONTINUE,
+      .payload = const_cast<uint8_t*>(parts[i].data()),
+      .len = parts[i].size(),
+    };
+    err = httpd_ws_send_data(s_server, fd, &ws_pkt);
+    first = false;
+  }
+  xSemaphoreGive(s_send_mutex);
+  return err;
+}
+
+auto set_traffic_class(int fd, TrafficClass traffic_class) -> esp_err_t {
+  int tos = s_traffic_tagging.load() ? static_cast<int>(traffic_class) : static_cast<int>(TrafficClass::BestEffort);
+  if (lwip_setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) != 0) {
+    ESP_LOGW(TAG, "Failed to set IP_TOS 0x%02x on fd=%d", tos, fd);
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+auto set_traffic_tagging(bool enabled) -> void {
+  s_traffic_tagging.store(enabled);
+}
+
+auto traffic_tagging() -> bool {
+  return s_traffic_tagging.load();
+}
+
+static auto close_handler(httpd_handle_t /*hd*/, int sockfd) -> void {
+  ESP_LOGI(TAG, "Connection closed (fd=%d)", sockfd);
+  if (g_ws_close_handler != nullptr) {
+    g_ws_close_handler(sockfd);
+  }
+  lwip_close(sockfd);
+}
 
 static auto ws_handler(httpd_req_t* req) -> esp_err_t {
   // HTTP GET means handshake
@@ -40,8 +201,13 @@ static auto ws_handler(httpd_req_t* req) -> esp_err_t {
     int fd = httpd_req_to_sockfd(req);
     int yes = 1;
     lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    // motor commands and their acks, moved to video once the socket starts carrying frames
+    set_traffic_class(fd, TrafficClass::Voice);
 
     ESP_LOGI(TAG, "WS handshake done, new connection (fd=%d)", httpd_req_to_sockfd(req));
+    if (g_ws_open_handler != nullptr) {
+      g_ws_open_handler(fd);
+    }
     return ESP_OK;
   }
   // For actual data frames from the client
@@ -73,6 +239,9 @@ static auto ws_handler(httpd_req_t* req) -> esp_err_t {
     return ret;
   }
 
+  s_ws_messages_received.increment();
+  s_ws_bytes_received.increment(ws_pkt.len);
+
   int fd = httpd_req_to_sockfd(req);
   if (ws_pkt.type == HTTPD_WS_TYPE_BINARY) {
     // Handle binary motor commands
@@ -90,8 +259,8 @@ auto start_webserver() -> httpd_handle_t {
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.recv_wait_timeout = 4;    // Reduce from default
   config.send_wait_timeout = 4;    // Reduce from default
-  config.max_uri_handlers = 1;     // We only need one
-  config.max_open_sockets = 1;     // For single client
+  config.max_uri_handlers = 1 + max_extra_uri_handlers;
+  config.max_open_sockets = 3;     // ws client plus room for http scrapes without purging it
   config.lru_purge_enable = true;  // Enable purging of old packets
   config.backlog_conn = 1;         // Minimum connection backlog
   // Optionally tweak for performance:
@@ -99,6 +268,11 @@ auto start_webserver() -> httpd_handle_t {
   // config.recv_wait_timeout = ...
   // config.send_wait_timeout = ...
   config.core_id = 0;
+  config.close_fn = close_handler;
+
+  if (s_send_mutex == nullptr) {
+    s_send_mutex = xSemaphoreCreateMutex();
+  }
 
   ESP_LOGI(TAG, "Starting HTTP WS server on port %d", config.server_port);
   httpd_handle_t server = nullptr;
@@ -113,6 +287,11 @@ auto start_webserver() -> httpd_handle_t {
       .supported_subprotocol = nullptr};
     httpd_register_uri_handler(server, &ws_uri);
     ESP_LOGI(TAG, "WS /ws handler registered");
+
+    for (size_t i = 0; i < s_extra_uri_handler_count; i++) {
+      httpd_register_uri_handler(server, &s_extra_uri_handlers[i]);
+      ESP_LOGI(TAG, "%s handler registered", s_extra_uri_handlers[i].uri);
+    }
   } else {
     ESP_LOGE(TAG, "Error starting server! So Restarting");
     esp_restart();
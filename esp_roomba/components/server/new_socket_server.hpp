@@ -2,6 +2,9 @@
 
 #include <esp_http_server.h>
 
+#include <cstdint>
+#include <span>
+
 namespace server {
 
 auto start_webserver() -> httpd_handle_t;
@@ -11,5 +14,41 @@ auto broadcast_message(httpd_handle_t hd, const char* message) -> void;
 using WsMessageHandler = void (*)(httpd_ws_frame_t&, uint8_t*, int);
 auto set_ws_binary_handler(WsMessageHandler handler) -> void;
 auto set_ws_text_handler(WsMessageHandler handler) -> void;
+
+// called with the socket fd once a WebSocket handshake completes
+using WsOpenHandler = void (*)(int);
+auto set_ws_open_handler(WsOpenHandler handler) -> void;
+
+// called with the socket fd whenever a client connection is closed
+using WsCloseHandler = void (*)(int);
+auto set_ws_close_handler(WsCloseHandler handler) -> void;
+
+// extra http handlers, registered when the server starts (or immediately if it's already running)
+auto add_uri_handler(const httpd_uri_t& uri) -> void;
+
+// The Wi-Fi driver picks the WMM access category from the IP precedence (top 3 TOS bits) of each packet.
+enum class TrafficClass : uint8_t {
+  BestEffort = 0x00,
+  Video = 0xA0,  // precedence 5 => AC_VI
+  Voice = 0xC0,  // precedence 6 => AC_VO
+};
+auto set_traffic_class(int fd, TrafficClass traffic_class) -> esp_err_t;
+// with tagging off every socket is left best effort, for comparing latency with and without it
+auto set_traffic_tagging(bool enabled) -> void;
+auto traffic_tagging() -> bool;
+
+// Sends are serialized so frames from different tasks don't interleave on the same socket.
+auto ws_send(int fd, httpd_ws_frame_t& ws_pkt) -> esp_err_t;
+auto ws_send_text(int fd, const char* text, size_t len) -> esp_err_t;
+auto ws_send_binary(int fd, const uint8_t* data, size_t len) -> esp_err_t;
+
+// Copies the next part of a message into `chunk` (at most `capacity` bytes) and returns how many bytes it wrote.
+using ChunkFiller = size_t (*)(uint8_t* chunk, size_t capacity, void* ctx);
+// Sends one binary message of `len` bytes as WebSocket fragments of up to staging.size() bytes. Each fragment is
+// filled right before it is sent, so the first bytes are on their way before the rest has been copied. The send lock
+// is held until the last fragment. A failure part way leaves a truncated message and the client has to reconnect.
+auto ws_send_binary_chunked(int fd, size_t len, std::span<uint8_t> staging, ChunkFiller fill, void* ctx) -> esp_err_t;
+// Sends one binary message made of `parts` back to back, each part as its own fragment straight out of its buffer.
+auto ws_send_binary_parts(int fd, std::span<const std::span<const uint8_t>> parts) -> esp_err_t;
 }  // namespace server
 
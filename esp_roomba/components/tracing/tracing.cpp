@@ -0,0 +1,174 @@
+#include "tracing.hpp"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <new>
+#include <vector>
+
+#include "sdkconfig.h"
+
+namespace tracing {
+
+static const char* TAG = "tracing";
+
+struct Event {
+  int64_t begin_us;
+  uint32_t duration_us;
+  uint32_t arg;
+  uint16_t task;
+  Span span;
+};
+
+struct Ring {
+  std::atomic<uint32_t> head;
+  std::array<Event, events_per_core> events;
+};
+
+// index matches the Span enum
+static constexpr std::array<const char*, static_cast<size_t>(Span::Count)> span_names = {
+  "sensor_wait",
+  "capture_copy",
+  "stream_copy",
+  "duplicate_wait",
+  "send",
+  "pace",
+  "motor_apply",
+  "record_stage",
+  "record_write",
+  "frame_age",
+  "credit_wait",
+};
+
+// rings live in PSRAM, internal RAM is better spent on lwIP buffers
+static Ring* s_rings = nullptr;
+static std::atomic<bool> s_enabled{false};
+
+static auto allocate_rings() -> bool {
+  if (s_rings != nullptr) {
+    return true;
+  }
+  void* memory = heap_caps_calloc(portNUM_PROCESSORS, sizeof(Ring), MALLOC_CAP_SPIRAM);
+  if (memory == nullptr) {
+    ESP_LOGE(TAG, "Failed to allocate trace rings");
+    return false;
+  }
+  auto* rings = static_cast<Ring*>(memory);
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    new (&rings[core]) Ring{};
+  }
+  s_rings = rings;
+  return true;
+}
+
+auto record(Span span, int64_t begin_us, int64_t end_us, uint32_t arg) -> void {
+  if (!s_enabled.load(std::memory_order_acquire)) {
+    return;
+  }
+  Ring& ring = s_rings[xPortGetCoreID()];
+  // reserving the slot atomically keeps tasks preempting each other on the same core from sharing it
+  uint32_t slot = ring.head.fetch_add(1, std::memory_order_relaxed) % events_per_core;
+  ring.events[slot] = Event{
+    .begin_us = begin_us,
+    .duration_us = static_cast<uint32_t>(end_us - begin_us),
+    .arg = arg,
+    .task = static_cast<uint16_t>(uxTaskGetTaskNumber(xTaskGetCurrentTaskHandle())),
+    .span = span,
+  };
+}
+
+auto set_enabled(bool enabled) -> void {
+  if (enabled && !allocate_rings()) {
+    return;
+  }
+  s_enabled.store(enabled);
+}
+
+auto is_enabled() -> bool {
+  return s_enabled.load();
+}
+
+static auto write_line(Writer writer, void* ctx, const char* format, auto... args) -> void {
+  std::array<char, 192> line{};
+  int len = snprintf(line.data(), line.size(), format, args...);
+  if (len > 0) {
+    writer(line.data(), std::min(static_cast<size_t>(len), line.size() - 1), ctx);
+  }
+}
+
+static auto write_thread_names(Writer writer, void* ctx) -> void {
+#if CONFIG_FREERTOS_USE_TRACE_FACILITY
+  std::vector<TaskStatus_t> tasks(uxTaskGetNumberOfTasks() + 2);
+  UBaseType_t count = uxTaskGetSystemState(tasks.data(), tasks.size(), nullptr);
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    for (UBaseType_t i = 0; i < count; i++) {
+      write_line(
+        writer,
+        ctx,
+        ",{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        core,
+        static_cast<unsigned>(tasks[i].xTaskNumber),
+        tasks[i].pcTaskName);
+    }
+  }
+#endif
+}
+
+auto dump_chrome_json(Writer writer, void* ctx) -> void {
+  writer("[", 1, ctx);
+  if (s_rings == nullptr) {
+    writer("]", 1, ctx);
+    return;
+  }
+
+  bool was_enabled = s_enabled.exchange(false);
+  // let any record() that already passed the enabled check finish writing its slot
+  vTaskDelay(pdMS_TO_TICKS(2));
+
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    write_line(
+      writer,
+      ctx,
+      "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,\"args\":{\"name\":\"core %d\"}}",
+      core == 0 ? "" : ",",
+      core,
+      core);
+  }
+  write_thread_names(writer, ctx);
+
+  for (int core = 0; core < portNUM_PROCESSORS; core++) {
+    const Ring& ring = s_rings[core];
+    uint32_t head = ring.head.load();
+    uint32_t count = std::min<uint32_t>(head, events_per_core);
+    // oldest first
+    for (uint32_t i = head - count; i != head; i++) {
+      const Event& event = ring.events[i % events_per_core];
+      if (event.span >= Span::Count) {
+        continue;
+      }
+      write_line(
+        writer,
+        ctx,
+        ",{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%u,\"ts\":%" PRId64 ",\"dur\":%" PRIu32
+        ",\"args\":{\"v\":%" PRIu32 "}}",
+        span_names[static_cast<size_t>(event.span)],
+        core,
+        static_cast<unsigned>(event.task),
+        event.begin_us,
+        event.duration_us,
+        event.arg);
+    }
+  }
+  writer("]", 1, ctx);
+
+  s_enabled.store(was_enabled);
+}
+
+}  // namespace tracing
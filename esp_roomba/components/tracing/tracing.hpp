@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_timer.h"
+
+namespace tracing {
+
+// Fixed set of pipeline stages, names are resolved when the trace is dumped.
+enum class Span : uint8_t {
+  SensorWait,     // esp_camera_fb_get, waiting for the sensor / DMA
+  CaptureCopy,    // copying the driver frame buffer into a free frame slot
+  StreamCopy,     // stream task copying a chunk of the leased frame into internal RAM
+  DuplicateWait,  // stream task waiting for a frame it hasn't sent yet
+  Send,           // blocking WebSocket send
+  Pace,           // sleep that levels out the frame rate
+  MotorApply,     // writing a new command to the motor drivers
+  RecordStage,    // capture task copying a frame into the recorder's staging buffer
+  RecordWrite,    // recorder task writing a staging buffer to the SD card
+  FrameAge,       // a frame's VSYNC until the capture task stored it, DMA plus driver queueing
+  CreditWait,     // stream task waiting for the client to grant a frame
+  Count
+};
+
+constexpr size_t events_per_core = 512;
+
+// Appends a completed span to the ring of the calling core. Lock free, safe from any task.
+auto record(Span span, int64_t begin_us, int64_t end_us, uint32_t arg = 0) -> void;
+
+auto set_enabled(bool enabled) -> void;
+[[nodiscard]] auto is_enabled() -> bool;
+
+// Writes the recorded spans as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+// Recording is paused while dumping so the rings stay consistent.
+using Writer = void (*)(const char* data, size_t len, void* ctx);
+auto dump_chrome_json(Writer writer, void* ctx) -> void;
+
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(Span span, uint32_t arg = 0) : m_begin(esp_timer_get_time()), m_arg(arg), m_span(span) {}
+  ~ScopedSpan() {
+    record(m_span, m_begin, esp_timer_get_time(), m_arg);
+  }
+
+  ScopedSpan(const ScopedSpan&) = delete;
+  auto operator=(const ScopedSpan&) -> ScopedSpan& = delete;
+  ScopedSpan(ScopedSpan&&) = delete;
+  auto operator=(ScopedSpan&&) -> ScopedSpan& = delete;
+
+  auto set_arg(uint32_t arg) -> void {
+    m_arg = arg;
+  }
+
+ private:
+  int64_t m_begin;
+  uint32_t m_arg;
+  Span m_span;
+};
+
+}  // namespace tracing
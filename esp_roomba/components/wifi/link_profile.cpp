@@ -0,0 +1,83 @@
+#include "link_profile.hpp"
+
+#include <array>
+#include <atomic>
+
+#include "esp_log.h"
+#include "metrics.hpp"
+
+namespace wifi {
+
+namespace {
+constexpr const char* TAG = "LinkProfile";
+
+constexpr uint8_t all_protocols = WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G | WIFI_PROTOCOL_11N;
+
+// index matches LinkProfile
+constexpr std::array<LinkProfileSettings, 3> profiles = {{
+  {"latency", WIFI_PS_NONE, 80, WIFI_BW_HT20, all_protocols},
+  {"throughput", WIFI_PS_NONE, 80, WIFI_BW_HT40, all_protocols},
+  {"power", WIFI_PS_MIN_MODEM, 52, WIFI_BW_HT20, all_protocols},
+}};
+
+std::atomic<LinkProfile> s_active{LinkProfile::PowerSaver};
+metrics::Gauge s_profile_gauge{"roomba_wifi_link_profile", "0 latency, 1 throughput, 2 power saver"};
+metrics::Counter s_profile_switches{"roomba_wifi_link_profile_switches_total", "Link profile changes"};
+
+// only touches what changed, rewriting them on a connected station isn't free
+auto apply_to_interface(wifi_interface_t interface, const LinkProfileSettings& settings) -> esp_err_t {
+  wifi_bandwidth_t bandwidth = WIFI_BW_HT20;
+  esp_err_t err = esp_wifi_get_bandwidth(interface, &bandwidth);
+  if (err == ESP_OK && bandwidth != settings.bandwidth) {
+    err = esp_wifi_set_bandwidth(interface, settings.bandwidth);
+  }
+  uint8_t protocols = 0;
+  if (err == ESP_OK) {
+    err = esp_wifi_get_protocol(interface, &protocols);
+  }
+  if (err == ESP_OK && protocols != settings.protocols) {
+    err = esp_wifi_set_protocol(interface, settings.protocols);
+  }
+  return err;
+}
+}  // namespace
+
+auto link_profile_settings(LinkProfile profile) -> const LinkProfileSettings& {
+  return profiles[static_cast<size_t>(profile)];
+}
+
+auto active_link_profile() -> LinkProfile {
+  return s_active;
+}
+
+auto apply_link_profile(LinkProfile profile) -> std::expected<void, WifiError> {
+  wifi_mode_t mode = WIFI_MODE_NULL;
+  if (esp_wifi_get_mode(&mode) != ESP_OK || mode == WIFI_MODE_NULL) {
+    return std::unexpected(WifiError::NotInitialized);
+  }
+
+  const LinkProfileSettings& settings = link_profile_settings(profile);
+  esp_err_t err = esp_wifi_set_ps(settings.power_save);
+  if (err == ESP_OK) {
+    err = esp_wifi_set_max_tx_power(settings.max_tx_power_qdbm);
+  }
+  if (err == ESP_OK && (mode == WIFI_MODE_STA || mode == WIFI_MODE_APSTA)) {
+    err = apply_to_interface(WIFI_IF_STA, settings);
+  }
+  if (err == ESP_OK && (mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA)) {
+    err = apply_to_interface(WIFI_IF_AP, settings);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to apply %s profile: %s", settings.name, esp_err_to_name(err));
+    return std::unexpected(WifiError::SystemError);
+  }
+
+  if (s_active.exchange(profile) != profile) {
+    s_profile_switches.increment();
+    ESP_LOGI(TAG, "Link profile: %s", settings.name);
+  }
+  s_profile_gauge.set(static_cast<int32_t>(profile));
+  return {};
+}
+
+}  // namespace wifi
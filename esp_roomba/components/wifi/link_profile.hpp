@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstdint>
+#include <expected>
+
+#include "esp_wifi.h"
+#include "wifi_manager.hpp"
+
+namespace wifi {
+
+enum class LinkProfile : uint8_t {
+  // no power save so commands aren't held until the next beacon, HT20 for fewer retries
+  Latency,
+  // no power save and HT40 for the video stream
+  Throughput,
+  // modem sleep and lower TX power while nobody is connected
+  PowerSaver,
+};
+
+struct LinkProfileSettings {
+  const char* name;
+  wifi_ps_type_t power_save;
+  int8_t max_tx_power_qdbm;  // quarter dBm, 80 = 20 dBm
+  wifi_bandwidth_t bandwidth;
+  uint8_t protocols;  // WIFI_PROTOCOL_* bitmap
+};
+
+[[nodiscard]] auto link_profile_settings(LinkProfile profile) -> const LinkProfileSettings&;
+
+// Applies to every running interface. Power save and TX power change immediately, a station only picks up
+// bandwidth and protocol changes on its next association.
+auto apply_link_profile(LinkProfile profile) -> std::expected<void, WifiError>;
+[[nodiscard]] auto active_link_profile() -> LinkProfile;
+
+}  // namespace wifi
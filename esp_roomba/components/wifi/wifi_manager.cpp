@@ -1,9 +1,15 @@
 // wifi_manager.cpp
 #include "wifi_manager.hpp"
 
+#include <array>
 #include <cstdio>
+#include <cstring>
 
 #include "esp_log.h"
+#include "esp_mac.h"
+#include "esp_wnm.h"
+#include "metrics.hpp"
+#include "nvs.h"
 #include "nvs_flash.h"
 
 namespace wifi {
@@ -11,6 +17,77 @@ namespace wifi {
 namespace {
 constexpr const char* TAG = "WifiManager";
 
+constexpr EventBits_t got_ip_bit = BIT0;
+
+// last AP that handed out an address, the lease itself is kept by lwIP (CONFIG_LWIP_DHCP_RESTORE_LAST_IP)
+constexpr const char* cache_namespace = "wifi_cache";
+constexpr const char* cache_key = "last_ap";
+constexpr uint8_t cached_ap_version = 1;
+
+struct CachedAp {
+  uint8_t version;
+  std::array<char, 33> ssid;
+  std::array<uint8_t, 6> bssid;
+  uint8_t channel;
+};
+
+metrics::Gauge s_boot_to_ip{"roomba_wifi_boot_to_ip_ms", "Time from boot to the first station address"};
+metrics::Gauge s_reconnect_time{"roomba_wifi_reconnect_ms", "Time from the last drop to having an address again"};
+metrics::Counter s_disconnects{"roomba_wifi_disconnects_total", "Station disconnects after having an address"};
+metrics::Gauge s_handoff_time{
+  "roomba_wifi_handoff_ms", "Time without an address during the last roam, from leaving the old AP"};
+metrics::Counter s_roams{"roomba_wifi_roams_total", "Handoffs to a stronger AP"};
+metrics::Counter s_background_scans{"roomba_wifi_background_scans_total", "Roaming scans while connected"};
+metrics::Gauge s_link_rssi{"roomba_wifi_link_rssi_dbm", "Smoothed RSSI of the associated AP"};
+metrics::Gauge s_link_phy_rate{"roomba_wifi_link_phy_rate_kbps", "Nominal PHY rate the smoothed RSSI supports"};
+metrics::Gauge s_link_capacity{"roomba_wifi_link_capacity_kbps", "Smoothed estimate of usable throughput"};
+metrics::Gauge s_link_goodput{"roomba_wifi_link_goodput_kbps", "Bytes senders got through over the last period"};
+metrics::Counter s_send_failures{"roomba_wifi_send_failures_total", "Network writes reported as failed"};
+metrics::Gauge s_last_disconnect_reason{
+  "roomba_wifi_last_disconnect_reason", "wifi_err_reason_t of the last disconnect"};
+
+// weights of the newest sample in the moving averages
+constexpr float rssi_smoothing = 0.25F;
+constexpr float capacity_smoothing = 0.3F;
+// share of the PHY rate left for TCP payload after MAC overhead, acks and contention
+constexpr float mac_efficiency = 0.5F;
+
+struct RateStep {
+  int8_t min_rssi;
+  uint32_t ht20_kbps;
+};
+
+// HT20 long guard interval, MCS7 down to MCS0 with the usual sensitivity margins
+constexpr std::array<RateStep, 8> rate_steps = {{
+  {-64, 65000},
+  {-66, 58500},
+  {-70, 52000},
+  {-74, 39000},
+  {-77, 26000},
+  {-79, 19500},
+  {-82, 13000},
+  {-85, 6500},
+}};
+constexpr uint32_t min_rate_kbps = 1000;
+constexpr uint32_t legacy_max_rate_kbps = 54000;
+
+auto phy_rate_for(int8_t rssi, const wifi_ap_record_t& ap) -> uint32_t {
+  uint32_t rate = min_rate_kbps;
+  for (const auto& step : rate_steps) {
+    if (rssi >= step.min_rssi) {
+      rate = step.ht20_kbps;
+      break;
+    }
+  }
+  if (!ap.phy_11n) {
+    return std::min(rate, legacy_max_rate_kbps);
+  }
+  return ap.second != WIFI_SECOND_CHAN_NONE ? rate * 2 : rate;
+}
+
+metrics::Counter s_cache_misses{
+  "roomba_wifi_cached_ap_misses_total", "Times the cached AP couldn't be joined and a full scan was needed"};
+
 auto get_disconnect_reason_str(uint8_t reason) -> const char* {
   switch (reason) {
     case WIFI_REASON_UNSPECIFIED:
@@ -115,16 +192,31 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
   if (event_base == WIFI_EVENT) {
     switch (event_id) {
       case WIFI_EVENT_STA_START:
-        ESP_LOGI(TAG, "Attempting to connect to SSID: %s", manager->m_config.ssid.c_str());
+        ESP_LOGI(TAG, "Attempting to connect to SSID: %s", manager->current_ssid());
         esp_wifi_connect();
         break;
 
       case WIFI_EVENT_STA_CONNECTED: {
         auto* event = static_cast<wifi_event_sta_connected_t*>(event_data);
         manager->m_connected = true;
-        ESP_LOGI(TAG, "Successfully connected to SSID: %s", manager->m_config.ssid.c_str());
+        ESP_LOGI(TAG, "Successfully connected to SSID: %s", manager->current_ssid());
         ESP_LOGI(TAG, "Channel: %d, Auth Mode: %d", event->channel, event->authmode);
 
+        if (manager->m_config.roaming.enabled) {
+          // one shot, re-armed on every association and after every roaming scan
+          esp_wifi_set_rssi_threshold(manager->m_config.roaming.trigger_rssi);
+        }
+
+        if (manager->m_config.static_ip && !manager->m_static_ip_applied) {
+          if (manager->m_config.dhcp_timeout.count() == 0) {
+            manager->apply_static_ip();
+          } else {
+            esp_timer_start_once(
+              manager->m_dhcp_timer,
+              std::chrono::duration_cast<std::chrono::microseconds>(manager->m_config.dhcp_timeout).count());
+          }
+        }
+
         if (manager->m_connected_callback) {
           wifi_ap_record_t ap_info;
           if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
@@ -146,8 +238,21 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
         auto* event = static_cast<wifi_event_sta_disconnected_t*>(event_data);
         manager->m_connected = false;
 
+        manager->m_last_disconnect_reason = event->reason;
+        s_last_disconnect_reason.set(event->reason);
+
+        bool had_ip = manager->m_connection_info.connected;
+        manager->m_connection_info.connected = false;
+        xEventGroupClearBits(manager->m_events, got_ip_bit);
+        esp_timer_stop(manager->m_dhcp_timer);
+        if (had_ip && manager->m_roam_started_at == 0) {
+          manager->m_disconnected_at = esp_timer_get_time();
+          manager->m_timings.disconnects++;
+          s_disconnects.increment();
+        }
+
         const char* reason_str = get_disconnect_reason_str(event->reason);
-        ESP_LOGW(TAG, "Disconnected from SSID: %s", manager->m_config.ssid.c_str());
+        ESP_LOGW(TAG, "Disconnected from SSID: %s", manager->current_ssid());
         ESP_LOGW(TAG, "Reason: %s (Code: %d)", reason_str, event->reason);
 
         WifiError error;
@@ -158,7 +263,7 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
             error = WifiError::InvalidCredentials;
             break;
           case WIFI_REASON_NO_AP_FOUND:
-            ESP_LOGW(TAG, "Network not found. Please check SSID: %s", manager->m_config.ssid.c_str());
+            ESP_LOGW(TAG, "Network not found. Please check SSID: %s", manager->current_ssid());
             error = WifiError::NetworkNotFound;
             break;
           case WIFI_REASON_BEACON_TIMEOUT:
@@ -174,6 +279,14 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
           if (manager->m_connection_failed_callback) {
             manager->m_connection_failed_callback(error);
           }
+          // a drop from a working link retries the same AP once, failing to join it at all means it moved
+          if (!had_ip) {
+            if (manager->m_pinned_bssid) {
+              manager->fall_back_to_scan();
+            } else if (manager->m_networks.size() > 1) {
+              manager->next_network();
+            }
+          }
           ESP_LOGI(TAG, "Retrying connection...");
           esp_wifi_connect();
         } else if (manager->m_disconnected_callback) {
@@ -181,6 +294,25 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
         }
         break;
       }
+
+      case WIFI_EVENT_STA_BSS_RSSI_LOW: {
+        auto* event = static_cast<wifi_event_bss_rssi_low_t*>(event_data);
+        ESP_LOGW(TAG, "RSSI dropped to %d dBm, looking for a better AP", static_cast<int>(event->rssi));
+#if CONFIG_ESP_WIFI_11KV_SUPPORT
+        // an 802.11v AP answers with a transition request, the supplicant then roams on its own
+        if (esp_wnm_is_btm_supported_connection()) {
+          esp_wnm_send_bss_transition_mgmt_query(REASON_FRAME_LOSS, nullptr, 0);
+        }
+#endif
+        manager->start_background_scan();
+        break;
+      }
+
+      case WIFI_EVENT_SCAN_DONE:
+        if (manager->m_background_scan.exchange(false)) {
+          manager->evaluate_roam_candidates();
+        }
+        break;
     }
   } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
     auto* event = static_cast<ip_event_got_ip_t*>(event_data);
@@ -190,6 +322,7 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
     ESP_LOGI(TAG, "Got IP Address: " IPSTR, IP2STR(&event->ip_info.ip));
     ESP_LOGI(TAG, "Netmask: " IPSTR, IP2STR(&event->ip_info.netmask));
     ESP_LOGI(TAG, "Gateway: " IPSTR, IP2STR(&event->ip_info.gw));
+    manager->on_got_ip();
 
     if (manager->m_connected_callback) {
       manager->m_connected_callback(manager->m_connection_info);
@@ -200,6 +333,358 @@ void WifiManager::event_handler(void* arg, esp_event_base_t event_base, int32_t
   }
 }
 
+void WifiManager::dhcp_timeout_handler(void* arg) {
+  auto* manager = static_cast<WifiManager*>(arg);
+  if ((xEventGroupGetBits(manager->m_events) & got_ip_bit) == 0) {
+    ESP_LOGW(TAG, "No DHCP lease after %lld ms", static_cast<long long>(manager->m_config.dhcp_timeout.count()));
+    manager->apply_static_ip();
+  }
+}
+
+void WifiManager::on_got_ip() {
+  esp_timer_stop(m_dhcp_timer);
+  int64_t now = esp_timer_get_time();
+  if (m_timings.boot_to_ip_us == 0) {
+    m_timings.boot_to_ip_us = now;
+    s_boot_to_ip.set(static_cast<int32_t>(now / 1000));
+    ESP_LOGI(TAG, "Boot to IP: %lld ms", static_cast<long long>(now / 1000));
+  }
+  if (m_roam_started_at != 0) {
+    m_timings.last_handoff_us = now - m_roam_started_at;
+    m_timings.roams++;
+    m_roam_started_at = 0;
+    s_roams.increment();
+    s_handoff_time.set(static_cast<int32_t>(m_timings.last_handoff_us / 1000));
+    ESP_LOGI(TAG, "Roamed to %s in %lld ms", current_ssid(), static_cast<long long>(m_timings.last_handoff_us / 1000));
+  }
+  if (m_disconnected_at != 0) {
+    m_timings.last_reconnect_us = now - m_disconnected_at;
+    m_disconnected_at = 0;
+    s_reconnect_time.set(static_cast<int32_t>(m_timings.last_reconnect_us / 1000));
+    ESP_LOGI(TAG, "Reconnected in %lld ms", static_cast<long long>(m_timings.last_reconnect_us / 1000));
+  }
+  save_cached_ap();
+  xEventGroupSetBits(m_events, got_ip_bit);
+}
+
+auto WifiManager::apply_cached_ap(wifi_config_t& wifi_config) -> bool {
+  nvs_handle_t handle;
+  if (nvs_open(cache_namespace, NVS_READONLY, &handle) != ESP_OK) {
+    return false;
+  }
+  CachedAp cached{};
+  size_t len = sizeof(cached);
+  esp_err_t err = nvs_get_blob(handle, cache_key, &cached, &len);
+  nvs_close(handle);
+
+  if (err != ESP_OK || len != sizeof(cached) || cached.version != cached_ap_version) {
+    return false;
+  }
+  cached.ssid.back() = '\0';
+  auto index = find_network(cached.ssid.data());
+  if (!index) {
+    return false;
+  }
+
+  m_network_index = *index;
+  fill_sta_config(m_networks[m_network_index], wifi_config);
+  std::copy(cached.bssid.begin(), cached.bssid.end(), wifi_config.sta.bssid);
+  wifi_config.sta.bssid_set = true;
+  wifi_config.sta.channel = cached.channel;
+  ESP_LOGI(TAG, "Joining cached AP " MACSTR " on channel %d", MAC2STR(cached.bssid.data()), cached.channel);
+  return true;
+}
+
+void WifiManager::save_cached_ap() {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    return;
+  }
+  CachedAp cached{};
+  cached.version = cached_ap_version;
+  const std::string& ssid = m_networks[m_network_index].ssid;
+  std::copy_n(ssid.data(), std::min(ssid.size(), cached.ssid.size() - 1), cached.ssid.data());
+  std::copy(std::begin(ap_info.bssid), std::end(ap_info.bssid), cached.bssid.begin());
+  cached.channel = ap_info.primary;
+
+  nvs_handle_t handle;
+  if (nvs_open(cache_namespace, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+  // only write when the AP changed, this runs on every reconnect
+  CachedAp stored{};
+  size_t len = sizeof(stored);
+  if (nvs_get_blob(handle, cache_key, &stored, &len) != ESP_OK || memcmp(&stored, &cached, sizeof(cached)) != 0) {
+    if (nvs_set_blob(handle, cache_key, &cached, sizeof(cached)) == ESP_OK) {
+      nvs_commit(handle);
+    }
+  }
+  nvs_close(handle);
+}
+
+void WifiManager::fall_back_to_scan() {
+  m_pinned_bssid = false;
+  s_cache_misses.increment();
+  wifi_config_t wifi_config = {};
+  if (esp_wifi_get_config(WIFI_IF_STA, &wifi_config) != ESP_OK) {
+    return;
+  }
+  wifi_config.sta.bssid_set = false;
+  wifi_config.sta.channel = 0;
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  ESP_LOGW(TAG, "AP unreachable, scanning for %s", current_ssid());
+}
+
+auto WifiManager::current_ssid() const -> const char* {
+  return m_networks.empty() ? "" : m_networks[m_network_index].ssid.c_str();
+}
+
+auto WifiManager::find_network(std::string_view ssid) const -> std::optional<size_t> {
+  for (size_t i = 0; i < m_networks.size(); i++) {
+    if (m_networks[i].ssid == ssid) {
+      return i;
+    }
+  }
+  return std::nullopt;
+}
+
+void WifiManager::fill_sta_config(const NetworkCredentials& network, wifi_config_t& wifi_config) const {
+  wifi_config = {};
+  std::copy_n(
+    network.ssid.data(), std::min(network.ssid.size(), size_t{32}), reinterpret_cast<char*>(wifi_config.sta.ssid));
+  std::copy_n(
+    network.password.data(),
+    std::min(network.password.size(), size_t{64}),
+    reinterpret_cast<char*>(wifi_config.sta.password));
+
+  wifi_config.sta.scan_method = m_config.scan_method;
+  wifi_config.sta.threshold.rssi = m_config.min_rssi;
+  wifi_config.sta.threshold.authmode = m_config.min_authmode;
+  // lets 802.11k/v capable APs hand us neighbor reports and transition requests
+  wifi_config.sta.rm_enabled = 1;
+  wifi_config.sta.btm_enabled = 1;
+}
+
+void WifiManager::next_network() {
+  m_network_index = (m_network_index + 1) % m_networks.size();
+  wifi_config_t wifi_config;
+  fill_sta_config(m_networks[m_network_index], wifi_config);
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  ESP_LOGI(TAG, "Trying next network: %s", current_ssid());
+}
+
+void WifiManager::roam_timer_handler(void* arg) {
+  auto* manager = static_cast<WifiManager*>(arg);
+  if (!manager->m_connection_info.connected) {
+    return;
+  }
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK && ap_info.rssi < manager->m_config.roaming.scan_below_rssi) {
+    manager->start_background_scan();
+  }
+}
+
+void WifiManager::record_send_result(bool success, size_t bytes) {
+  m_send_attempts.fetch_add(1, std::memory_order_relaxed);
+  if (success) {
+    m_sent_bytes.fetch_add(static_cast<uint32_t>(bytes), std::memory_order_relaxed);
+  } else {
+    m_send_failures.fetch_add(1, std::memory_order_relaxed);
+    s_send_failures.increment();
+  }
+}
+
+auto WifiManager::subscribe_link_quality(LinkQualityCallback callback) -> bool {
+  size_t count = m_link_subscriber_count.load();
+  if (count >= m_link_subscribers.size()) {
+    ESP_LOGE(TAG, "Too many link quality subscribers");
+    return false;
+  }
+  m_link_subscribers[count] = std::move(callback);
+  m_link_subscriber_count.store(count + 1, std::memory_order_release);
+  return true;
+}
+
+auto WifiManager::link_quality() const -> LinkQuality {
+  portENTER_CRITICAL(&m_link_lock);
+  LinkQuality link = m_link;
+  portEXIT_CRITICAL(&m_link_lock);
+  return link;
+}
+
+void WifiManager::link_timer_handler(void* arg) {
+  static_cast<WifiManager*>(arg)->sample_link();
+}
+
+void WifiManager::sample_link() {
+  static uint32_t previous_attempts = 0;
+  static uint32_t previous_failures = 0;
+  static int64_t previous_time = esp_timer_get_time();
+
+  int64_t now = esp_timer_get_time();
+  int64_t period_us = std::max<int64_t>(now - previous_time, 1);
+  previous_time = now;
+  uint32_t bytes = m_sent_bytes.exchange(0, std::memory_order_relaxed);
+  uint32_t attempts = m_send_attempts.load(std::memory_order_relaxed);
+  uint32_t failures = m_send_failures.load(std::memory_order_relaxed);
+  uint32_t period_attempts = attempts - previous_attempts;
+  uint32_t period_failures = failures - previous_failures;
+  previous_attempts = attempts;
+  previous_failures = failures;
+
+  LinkQuality link = link_quality();
+  link.send_failures = failures;
+  link.last_disconnect_reason = m_last_disconnect_reason;
+  link.goodput_kbps = static_cast<uint32_t>(static_cast<int64_t>(bytes) * 8 * 1000 / period_us);
+
+  wifi_ap_record_t ap_info;
+  link.connected = m_connection_info.connected && esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK;
+  if (link.connected) {
+    if (link.rssi == 0) {
+      link.rssi = ap_info.rssi;
+    } else {
+      link.rssi = static_cast<int8_t>(
+        rssi_smoothing * static_cast<float>(ap_info.rssi) + (1.0F - rssi_smoothing) * static_cast<float>(link.rssi));
+    }
+    link.ht40 = ap_info.second != WIFI_SECOND_CHAN_NONE;
+    link.phy_rate_kbps = phy_rate_for(link.rssi, ap_info);
+
+    // failed writes mean the link is already short of what the estimate says
+    float failure_ratio =
+      period_attempts == 0 ? 0.0F : static_cast<float>(period_failures) / static_cast<float>(period_attempts);
+    float sample = static_cast<float>(link.phy_rate_kbps) * mac_efficiency * (1.0F - failure_ratio);
+    if (link.capacity_kbps == 0) {
+      link.capacity_kbps = static_cast<uint32_t>(sample);
+    } else {
+      link.capacity_kbps = static_cast<uint32_t>(
+        capacity_smoothing * sample + (1.0F - capacity_smoothing) * static_cast<float>(link.capacity_kbps));
+    }
+  } else {
+    link.rssi = 0;
+    link.phy_rate_kbps = 0;
+    link.capacity_kbps = 0;
+  }
+
+  portENTER_CRITICAL(&m_link_lock);
+  m_link = link;
+  portEXIT_CRITICAL(&m_link_lock);
+
+  s_link_rssi.set(link.rssi);
+  s_link_phy_rate.set(static_cast<int32_t>(link.phy_rate_kbps));
+  s_link_capacity.set(static_cast<int32_t>(link.capacity_kbps));
+  s_link_goodput.set(static_cast<int32_t>(link.goodput_kbps));
+
+  size_t subscriber_count = m_link_subscriber_count.load(std::memory_order_acquire);
+  for (size_t i = 0; i < subscriber_count; i++) {
+    m_link_subscribers[i](link);
+  }
+}
+
+void WifiManager::start_background_scan() {
+  if (!m_connection_info.connected || m_background_scan.exchange(true)) {
+    return;
+  }
+  // short dwell and back to the home channel between every scanned channel, so the stream only stutters
+  wifi_scan_config_t scan_config = {};
+  scan_config.show_hidden = false;
+  scan_config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+  scan_config.scan_time.active.min = 10;
+  scan_config.scan_time.active.max = 30;
+  scan_config.home_chan_dwell_time = 60;
+  if (esp_wifi_scan_start(&scan_config, false) != ESP_OK) {
+    m_background_scan = false;
+    return;
+  }
+  s_background_scans.increment();
+}
+
+void WifiManager::evaluate_roam_candidates() {
+  esp_wifi_set_rssi_threshold(m_config.roaming.trigger_rssi);
+
+  uint16_t count = 0;
+  esp_wifi_scan_get_ap_num(&count);
+  std::vector<wifi_ap_record_t> records(count);
+  if (count == 0 || esp_wifi_scan_get_ap_records(&count, records.data()) != ESP_OK) {
+    esp_wifi_clear_ap_list();
+    return;
+  }
+
+  wifi_ap_record_t current;
+  if (esp_wifi_sta_get_ap_info(&current) != ESP_OK) {
+    return;
+  }
+
+  const wifi_ap_record_t* best = nullptr;
+  std::optional<size_t> best_network;
+  for (const auto& record : records) {
+    if (memcmp(record.bssid, current.bssid, sizeof(record.bssid)) == 0) {
+      continue;
+    }
+    auto network = find_network(reinterpret_cast<const char*>(record.ssid));
+    if (network && (best == nullptr || record.rssi > best->rssi)) {
+      best = &record;
+      best_network = network;
+    }
+  }
+
+  if (best == nullptr || best->rssi < current.rssi + m_config.roaming.hysteresis_db) {
+    ESP_LOGD(TAG, "No AP stronger than the current %d dBm", current.rssi);
+    return;
+  }
+
+  ESP_LOGW(
+    TAG,
+    "Roaming from " MACSTR " (%d dBm) to %s " MACSTR " (%d dBm) on channel %d",
+    MAC2STR(current.bssid),
+    current.rssi,
+    reinterpret_cast<const char*>(best->ssid),
+    MAC2STR(best->bssid),
+    best->rssi,
+    best->primary);
+
+  m_network_index = *best_network;
+  wifi_config_t wifi_config;
+  fill_sta_config(m_networks[m_network_index], wifi_config);
+  std::copy(std::begin(best->bssid), std::end(best->bssid), wifi_config.sta.bssid);
+  wifi_config.sta.bssid_set = true;
+  wifi_config.sta.channel = best->primary;
+
+  m_pinned_bssid = true;
+  m_roam_started_at = esp_timer_get_time();
+  esp_wifi_set_config(WIFI_IF_STA, &wifi_config);
+  // the disconnect handler reconnects with the new config
+  esp_wifi_disconnect();
+}
+
+void WifiManager::apply_static_ip() {
+  if (!m_config.static_ip || m_static_ip_applied) {
+    return;
+  }
+  esp_err_t err = esp_netif_dhcpc_stop(m_sta_netif);
+  if (err != ESP_OK && err != ESP_ERR_ESP_NETIF_DHCP_ALREADY_STOPPED) {
+    ESP_LOGE(TAG, "Failed to stop DHCP client: %s", esp_err_to_name(err));
+    return;
+  }
+  // posts IP_EVENT_STA_GOT_IP like a lease would
+  if (esp_netif_set_ip_info(m_sta_netif, &*m_config.static_ip) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to set static IP");
+    return;
+  }
+  m_static_ip_applied = true;
+  ESP_LOGW(TAG, "Using static IP " IPSTR, IP2STR(&m_config.static_ip->ip));
+}
+
+auto WifiManager::wait_for_ip(std::chrono::milliseconds timeout) const -> std::expected<void, WifiError> {
+  if (m_events == nullptr) {
+    return std::unexpected(WifiError::NotInitialized);
+  }
+  EventBits_t bits = xEventGroupWaitBits(m_events, got_ip_bit, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout.count()));
+  if ((bits & got_ip_bit) == 0) {
+    return std::unexpected(WifiError::Timeout);
+  }
+  return {};
+}
+
 auto WifiManager::initialize_for_scan() -> std::expected<void, WifiError> {
   if (m_initialized) {
     ESP_LOGW(TAG, "WiFi manager already initialized");
@@ -288,6 +773,16 @@ auto WifiManager::initialize(const WifiConfig& config) -> std::expected<void, Wi
     ESP_LOGE(TAG, "SSID cannot be empty");
     return std::unexpected(WifiError::InvalidConfiguration);
   }
+  m_networks.clear();
+  m_networks.push_back(NetworkCredentials{config.ssid, config.password});
+  for (const auto& network : config.networks) {
+    if (network.ssid.empty()) {
+      ESP_LOGE(TAG, "SSID cannot be empty");
+      return std::unexpected(WifiError::InvalidConfiguration);
+    }
+    m_networks.push_back(network);
+  }
+  m_network_index = 0;
 
   if (auto result = initialize_nvs(); !result) {
     return result;
@@ -307,6 +802,42 @@ auto WifiManager::initialize(const WifiConfig& config) -> std::expected<void, Wi
     return std::unexpected(WifiError::SystemError);
   }
 
+  m_events = xEventGroupCreate();
+  esp_timer_create_args_t timer_args = {
+    .callback = &WifiManager::dhcp_timeout_handler,
+    .arg = this,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "dhcp_timeout",
+    .skip_unhandled_events = true,
+  };
+  esp_timer_create_args_t link_timer_args = {
+    .callback = &WifiManager::link_timer_handler,
+    .arg = this,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "link_monitor",
+    .skip_unhandled_events = true,
+  };
+  esp_timer_create_args_t roam_timer_args = {
+    .callback = &WifiManager::roam_timer_handler,
+    .arg = this,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "roam_scan",
+    .skip_unhandled_events = true,
+  };
+  if (
+    m_events == nullptr || esp_timer_create(&timer_args, &m_dhcp_timer) != ESP_OK ||
+    esp_timer_create(&roam_timer_args, &m_roam_timer) != ESP_OK ||
+    esp_timer_create(&link_timer_args, &m_link_timer) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to create connection event group or timers");
+    return std::unexpected(WifiError::SystemError);
+  }
+  esp_timer_start_periodic(
+    m_link_timer, std::chrono::duration_cast<std::chrono::microseconds>(m_config.link_monitor_interval).count());
+  if (m_config.roaming.enabled) {
+    esp_timer_start_periodic(
+      m_roam_timer, std::chrono::duration_cast<std::chrono::microseconds>(m_config.roaming.scan_interval).count());
+  }
+
   esp_event_handler_instance_register(
     WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiManager::event_handler, this, &m_wifi_event_handler);
   esp_event_handler_instance_register(
@@ -328,17 +859,9 @@ auto WifiManager::connect() -> std::expected<void, WifiError> {
 
   m_connecting = true;
 
-  wifi_config_t wifi_config = {};
-  std::copy_n(
-    m_config.ssid.data(), std::min(m_config.ssid.size(), size_t{32}), reinterpret_cast<char*>(wifi_config.sta.ssid));
-  std::copy_n(
-    m_config.password.data(),
-    std::min(m_config.password.size(), size_t{64}),
-    reinterpret_cast<char*>(wifi_config.sta.password));
-
-  wifi_config.sta.scan_method = m_config.scan_method;
-  wifi_config.sta.threshold.rssi = m_config.min_rssi;
-  wifi_config.sta.threshold.authmode = m_config.min_authmode;
+  wifi_config_t wifi_config;
+  fill_sta_config(m_networks[m_network_index], wifi_config);
+  m_pinned_bssid = m_config.use_cached_ap && apply_cached_ap(wifi_config);
 
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
@@ -390,6 +913,18 @@ void WifiManager::deinitialize() {
 
   esp_wifi_deinit();
 
+  for (esp_timer_handle_t* timer : {&m_dhcp_timer, &m_roam_timer, &m_link_timer}) {
+    if (*timer != nullptr) {
+      esp_timer_stop(*timer);
+      esp_timer_delete(*timer);
+      *timer = nullptr;
+    }
+  }
+  if (m_events != nullptr) {
+    vEventGroupDelete(m_events);
+    m_events = nullptr;
+  }
+
   if (m_sta_netif != nullptr) {
     esp_netif_destroy(m_sta_netif);
   }
@@ -1,6 +1,7 @@
 // wifi_manager.hpp
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <expected>
@@ -10,10 +11,14 @@
 #include <source_location>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 
 namespace wifi {
 
@@ -44,6 +49,22 @@ struct ConnectionInfo {
   bool connected{false};
 };
 
+struct NetworkCredentials {
+  std::string ssid;
+  std::string password;
+};
+
+struct RoamingConfig {
+  bool enabled{true};
+  // background scans only run while the link is weaker than this
+  int8_t scan_below_rssi{-67};
+  // scan right away, and ask the AP for a BSS transition, when the link drops below this
+  int8_t trigger_rssi{-75};
+  // a candidate has to be this much stronger than the current AP before handing off
+  uint8_t hysteresis_db{8};
+  std::chrono::milliseconds scan_interval{30000ms};
+};
+
 struct WifiConfig {
   std::string ssid;
   std::string password;
@@ -54,11 +75,41 @@ struct WifiConfig {
   int8_t min_rssi{-127};
   wifi_auth_mode_t min_authmode{WIFI_AUTH_OPEN};
   wifi_ps_type_t power_save{WIFI_PS_MIN_MODEM};
+  // go straight to the BSSID and channel that last handed out an address instead of scanning
+  bool use_cached_ap{true};
+  // used when DHCP doesn't answer within dhcp_timeout, a timeout of 0 skips DHCP entirely
+  std::optional<esp_netif_ip_info_t> static_ip{};
+  std::chrono::milliseconds dhcp_timeout{3000ms};
+  // more networks to roam between, ssid/password is tried first
+  std::vector<NetworkCredentials> networks{};
+  RoamingConfig roaming{};
+  std::chrono::milliseconds link_monitor_interval{1000ms};
+};
+
+struct ConnectionTimings {
+  int64_t boot_to_ip_us{0};    // 0 until the first address
+  int64_t last_reconnect_us{0};  // from the last drop to having an address again, 0 if there was no drop yet
+  uint32_t disconnects{0};
+  int64_t last_handoff_us{0};  // from leaving the old AP to having an address on the new one
+  uint32_t roams{0};
+};
+
+struct LinkQuality {
+  bool connected{false};
+  int8_t rssi{0};                // smoothed
+  bool ht40{false};
+  uint32_t phy_rate_kbps{0};     // nominal rate of the MCS the smoothed RSSI supports
+  uint32_t goodput_kbps{0};      // what the senders actually got through over the last period
+  uint32_t capacity_kbps{0};     // smoothed estimate of usable throughput
+  uint32_t send_failures{0};     // reported through record_send_result since boot
+  uint8_t last_disconnect_reason{0};
 };
 
 using ConnectedCallback = std::function<void(const ConnectionInfo&)>;
 using DisconnectedCallback = std::function<void(WifiError)>;
 using ConnectionFailedCallback = std::function<void(WifiError)>;
+// called from the esp_timer task once per link_monitor_interval, keep it short
+using LinkQualityCallback = std::function<void(const LinkQuality&)>;
 
 class WifiManager {
  public:
@@ -79,6 +130,11 @@ class WifiManager {
   [[nodiscard]] auto is_connected() const noexcept -> bool {
     return m_connected;
   }
+  // Blocks until the station has an address.
+  [[nodiscard]] auto wait_for_ip(std::chrono::milliseconds timeout) const -> std::expected<void, WifiError>;
+  [[nodiscard]] auto timings() const noexcept -> ConnectionTimings {
+    return m_timings;
+  }
 
   void on_connected(ConnectedCallback callback) {
     m_connected_callback = std::move(callback);
@@ -89,6 +145,11 @@ class WifiManager {
   void on_connection_failed(ConnectionFailedCallback callback) {
     m_connection_failed_callback = std::move(callback);
   }
+  // Safe while the monitor is running, there is no unsubscribe.
+  auto subscribe_link_quality(LinkQualityCallback callback) -> bool;
+  [[nodiscard]] auto link_quality() const -> LinkQuality;
+  // Senders report each network write so the capacity estimate reflects what the link really carries.
+  void record_send_result(bool success, size_t bytes);
 
   auto initialize_for_scan() -> std::expected<void, WifiError>;
   auto scan_networks() -> std::expected<void, WifiError>;
@@ -119,6 +180,22 @@ class WifiManager {
 
   void deinitialize();
   static void event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+  static void dhcp_timeout_handler(void* arg);
+  static void roam_timer_handler(void* arg);
+  static void link_timer_handler(void* arg);
+  void sample_link();
+
+  [[nodiscard]] auto current_ssid() const -> const char*;
+  [[nodiscard]] auto find_network(std::string_view ssid) const -> std::optional<size_t>;
+  void fill_sta_config(const NetworkCredentials& network, wifi_config_t& wifi_config) const;
+  void next_network();
+  void start_background_scan();
+  void evaluate_roam_candidates();
+  auto apply_cached_ap(wifi_config_t& wifi_config) -> bool;
+  void save_cached_ap();
+  void fall_back_to_scan();
+  void apply_static_ip();
+  void on_got_ip();
 
   std::atomic<bool> m_initialized{false};
   std::atomic<bool> m_connected{false};
@@ -127,6 +204,30 @@ class WifiManager {
   WifiConfig m_config{};
   ConnectionInfo m_connection_info{};
 
+  ConnectionTimings m_timings{};
+  int64_t m_disconnected_at{0};
+  int64_t m_roam_started_at{0};
+  // the station config names a single BSSID, from the cache or a roam decision
+  bool m_pinned_bssid{false};
+  bool m_static_ip_applied{false};
+
+  EventGroupHandle_t m_events{nullptr};
+  esp_timer_handle_t m_dhcp_timer{nullptr};
+  esp_timer_handle_t m_roam_timer{nullptr};
+  esp_timer_handle_t m_link_timer{nullptr};
+
+  // guards m_link, written by the link timer and read from any task
+  mutable portMUX_TYPE m_link_lock = portMUX_INITIALIZER_UNLOCKED;
+  LinkQuality m_link{};
+  std::atomic<uint32_t> m_sent_bytes{0};
+  std::atomic<uint32_t> m_send_attempts{0};
+  std::atomic<uint32_t> m_send_failures{0};
+  std::atomic<uint8_t> m_last_disconnect_reason{0};
+  std::array<LinkQualityCallback, 4> m_link_subscribers{};
+  std::atomic<size_t> m_link_subscriber_count{0};
+  std::atomic<bool> m_background_scan{false};
+  std::vector<NetworkCredentials> m_networks{};
+  size_t m_network_index{0};
   esp_netif_t* m_sta_netif{nullptr};
   esp_event_handler_instance_t m_wifi_event_handler{nullptr};
   esp_event_handler_instance_t m_ip_event_handler{nullptr};
@@ -0,0 +1,78 @@
+#include "boot.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/event_groups.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+
+#include "metrics.hpp"
+
+static const char* TAG = "boot";
+
+// index matches the BootStage enum
+static constexpr std::array<const char*, static_cast<size_t>(BootStage::Count)> stage_names = {
+  "nvs",
+  "wifi started",
+  "camera first frame",
+  "motors",
+  "server",
+  "diagnostics",
+  "ip",
+};
+
+static StaticEventGroup_t s_events_buffer;
+static EventGroupHandle_t s_events = nullptr;
+static std::array<std::atomic<int64_t>, static_cast<size_t>(BootStage::Count)> s_done_us{};
+
+static metrics::Gauge s_boot_to_frame{
+  "roomba_boot_to_first_frame_ms", "Time from reset until a frame, the server and an address were all available"};
+
+static auto stage_bit(BootStage stage) -> EventBits_t {
+  return EventBits_t{1} << static_cast<uint8_t>(stage);
+}
+
+auto init_boot() -> void {
+  s_events = xEventGroupCreateStatic(&s_events_buffer);
+}
+
+auto boot_mark(BootStage stage) -> void {
+  s_done_us[static_cast<size_t>(stage)].store(esp_timer_get_time());
+  xEventGroupSetBits(s_events, stage_bit(stage));
+}
+
+auto boot_wait(std::initializer_list<BootStage> stages, TickType_t timeout) -> bool {
+  EventBits_t bits = 0;
+  for (BootStage stage : stages) {
+    bits |= stage_bit(stage);
+  }
+  return (xEventGroupWaitBits(s_events, bits, pdFALSE, pdTRUE, timeout) & bits) == bits;
+}
+
+auto log_boot_timeline() -> void {
+  ESP_LOGI(TAG, "=== Boot timeline ===");
+  for (size_t i = 0; i < stage_names.size(); i++) {
+    int64_t done = s_done_us[i].load();
+    if (done == 0) {
+      ESP_LOGI(TAG, "%-20s pending", stage_names[i]);
+    } else {
+      ESP_LOGI(TAG, "%-20s %6" PRId64 " ms", stage_names[i], done / 1000);
+    }
+  }
+
+  int64_t streamable = 0;
+  for (BootStage stage : {BootStage::Camera, BootStage::Server, BootStage::Ip}) {
+    int64_t done = s_done_us[static_cast<size_t>(stage)].load();
+    if (done == 0) {
+      // a stage that failed or is still running would make the total look shorter than it is
+      ESP_LOGW(TAG, "Boot to first streamable frame: pending, %s not done", stage_names[static_cast<size_t>(stage)]);
+      return;
+    }
+    streamable = std::max(streamable, done / 1000);
+  }
+  s_boot_to_frame.set(static_cast<int32_t>(streamable));
+  ESP_LOGI(TAG, "Boot to first streamable frame: %" PRId64 " ms", streamable);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+#include <cstdint>
+#include <initializer_list>
+
+// Startup steps other steps can wait on. Camera means the first frame is sitting in the stream buffer.
+enum class BootStage : uint8_t { Nvs, WifiStarted, Camera, Motors, Server, Diagnostics, Ip, Count };
+
+// Call first thing in app_main.
+auto init_boot() -> void;
+// Records the time the stage finished and releases anyone waiting on it, safe from any task.
+auto boot_mark(BootStage stage) -> void;
+// true once every stage has been marked
+auto boot_wait(std::initializer_list<BootStage> stages, TickType_t timeout) -> bool;
+// Each stage relative to boot, and the time until a client could have received the first frame.
+auto log_boot_timeline() -> void;
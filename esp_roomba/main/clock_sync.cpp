@@ -0,0 +1,267 @@
+#include "clock_sync.hpp"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <string_view>
+
+#include "metrics.hpp"
+#include "new_socket_server.hpp"
+#include "server_integration.hpp"
+
+static const char* TAG = "clock_sync";
+
+constexpr size_t max_sync_clients = 2;
+// probes whose lowest round trip wins, a probe that waited behind a frame on the socket loses
+constexpr size_t filter_window = 8;
+// filtered points the drift is fitted over, at one probe a second about 4 minutes
+constexpr size_t drift_window = 32;
+// fewer points than this and the drift is too noisy to use
+constexpr size_t min_drift_points = 4;
+// crystals are within tens of ppm, anything beyond this is a bad fit
+constexpr double max_drift_ppm = 500.0;
+// answers that took longer than this are useless for a ms estimate
+constexpr int64_t max_rtt_us = 500000;
+
+static metrics::Histogram s_sync_rtt{
+  "roomba_clock_sync_rtt_us",
+  "Round trip of clock sync probes, excluding the client's turnaround",
+  {1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000}};
+static metrics::Gauge s_sync_clients{"roomba_clock_sync_clients", "Clients receiving clock sync probes"};
+
+struct SyncSample {
+  // device time halfway through the exchange
+  int64_t device_us;
+  // client clock minus device clock
+  int64_t offset_us;
+  int64_t rtt_us;
+};
+
+// client_us = device_us + offset_us + (device_us - reference_us) * drift_ppm / 1e6
+struct ClockEstimate {
+  int64_t reference_us = 0;
+  int64_t offset_us = 0;
+  double drift_ppm = 0.0;
+  int64_t rtt_us = 0;
+  uint32_t samples = 0;
+};
+
+// only touched by the httpd task
+struct ClientClock {
+  std::array<SyncSample, filter_window> recent{};
+  size_t recent_count = 0;
+  size_t recent_next = 0;
+  std::array<SyncSample, drift_window> filtered{};
+  size_t filtered_count = 0;
+  size_t filtered_next = 0;
+  int64_t last_filtered_us = 0;
+  ClockEstimate estimate;
+};
+
+// the main task sends the probes, so the subscriber list is shared like telemetry's
+static std::array<std::atomic<int>, max_sync_clients> s_subscribers{{-1, -1}};
+static std::array<ClientClock, max_sync_clients> s_clocks{};
+
+static auto update_client_count() -> void {
+  auto count = std::ranges::count_if(s_subscribers, [](const std::atomic<int>& fd) { return fd.load() >= 0; });
+  s_sync_clients.set(static_cast<int32_t>(count));
+}
+
+auto clock_sync_unsubscribe(int fd) -> void {
+  for (auto& subscriber : s_subscribers) {
+    int expected = fd;
+    subscriber.compare_exchange_strong(expected, -1);
+  }
+  update_client_count();
+}
+
+static auto slot_for(int fd) -> int {
+  for (size_t i = 0; i < s_subscribers.size(); i++) {
+    if (s_subscribers[i].load() == fd) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+static auto subscribe(int fd) -> bool {
+  if (slot_for(fd) >= 0) {
+    return true;
+  }
+  for (size_t i = 0; i < s_subscribers.size(); i++) {
+    int expected = -1;
+    if (s_subscribers[i].compare_exchange_strong(expected, fd)) {
+      s_clocks[i] = ClientClock{};
+      update_client_count();
+      return true;
+    }
+  }
+  return false;
+}
+
+// least squares line through the filtered offsets, anchored at the newest point
+static auto fit_estimate(ClientClock& clock, const SyncSample& best) -> void {
+  ClockEstimate& estimate = clock.estimate;
+  estimate.reference_us = best.device_us;
+  estimate.offset_us = best.offset_us;
+  estimate.rtt_us = best.rtt_us;
+  estimate.samples = static_cast<uint32_t>(clock.filtered_count);
+  if (clock.filtered_count < min_drift_points) {
+    return;
+  }
+
+  // relative to the newest point, keeps the sums small enough for doubles
+  double sum_x = 0.0;
+  double sum_y = 0.0;
+  double sum_xx = 0.0;
+  double sum_xy = 0.0;
+  for (size_t i = 0; i < clock.filtered_count; i++) {
+    const SyncSample& sample = clock.filtered[i];
+    double x = static_cast<double>(sample.device_us - best.device_us);
+    double y = static_cast<double>(sample.offset_us - best.offset_us);
+    sum_x += x;
+    sum_y += y;
+    sum_xx += x * x;
+    sum_xy += x * y;
+  }
+  auto n = static_cast<double>(clock.filtered_count);
+  double denominator = n * sum_xx - sum_x * sum_x;
+  if (denominator <= 0.0) {
+    return;
+  }
+  double slope = (n * sum_xy - sum_x * sum_y) / denominator;
+  double intercept = (sum_y - slope * sum_x) / n;
+  double drift_ppm = slope * 1e6;
+  if (std::abs(drift_ppm) > max_drift_ppm) {
+    ESP_LOGW(TAG, "Ignoring drift estimate of %.0f ppm", drift_ppm);
+    return;
+  }
+  estimate.drift_ppm = drift_ppm;
+  // the line smooths out the newest point's jitter too
+  estimate.offset_us = best.offset_us + static_cast<int64_t>(intercept);
+}
+
+static auto add_sample(ClientClock& clock, const SyncSample& sample) -> void {
+  clock.recent[clock.recent_next] = sample;
+  clock.recent_next = (clock.recent_next + 1) % filter_window;
+  clock.recent_count = std::min(clock.recent_count + 1, filter_window);
+
+  const SyncSample& best = *std::min_element(
+    clock.recent.begin(), clock.recent.begin() + static_cast<std::ptrdiff_t>(clock.recent_count),
+    [](const SyncSample& a, const SyncSample& b) { return a.rtt_us < b.rtt_us; });
+  // the same winner stays in the window for a while, only feed it to the fit once
+  if (best.device_us != clock.last_filtered_us) {
+    clock.last_filtered_us = best.device_us;
+    clock.filtered[clock.filtered_next] = best;
+    clock.filtered_next = (clock.filtered_next + 1) % drift_window;
+    clock.filtered_count = std::min(clock.filtered_count + 1, drift_window);
+  }
+  fit_estimate(clock, best);
+}
+
+static auto send_estimate(int fd, const ClockEstimate& estimate) -> void {
+  std::array<char, 160> line{};
+  int len = snprintf(
+    line.data(),
+    line.size(),
+    "clock {\"reference_us\":%" PRId64 ",\"offset_us\":%" PRId64 ",\"drift_ppm\":%.3f,\"rtt_us\":%" PRId64
+    ",\"samples\":%" PRIu32 "}",
+    estimate.reference_us,
+    estimate.offset_us,
+    estimate.drift_ppm,
+    estimate.rtt_us,
+    estimate.samples);
+  if (len > 0) {
+    server::ws_send_text(fd, line.data(), std::min(static_cast<size_t>(len), line.size() - 1));
+  }
+}
+
+static auto parse_i64(std::string_view& text, int64_t& value) -> bool {
+  while (!text.empty() && text.front() == ' ') {
+    text.remove_prefix(1);
+  }
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+  if (error != std::errc{}) {
+    return false;
+  }
+  text.remove_prefix(static_cast<size_t>(end - text.data()));
+  return true;
+}
+
+// "sync echo <t1> <t2> <t3>": t1 is the device time from the probe, t2 and t3 the client's receive and reply times
+static auto handle_echo(int fd, std::string_view args, int64_t received_us) -> void {
+  int slot = slot_for(fd);
+  int64_t t1 = 0;
+  int64_t t2 = 0;
+  int64_t t3 = 0;
+  if (slot < 0 || !parse_i64(args, t1) || !parse_i64(args, t2) || !parse_i64(args, t3)) {
+    ESP_LOGW(TAG, "Bad sync echo from fd=%d", fd);
+    return;
+  }
+  int64_t rtt = (received_us - t1) - (t3 - t2);
+  if (t1 > received_us || rtt < 0 || rtt > max_rtt_us) {
+    return;
+  }
+  s_sync_rtt.observe(static_cast<uint32_t>(rtt));
+  SyncSample sample{
+    .device_us = t1 + (received_us - t1) / 2,
+    .offset_us = ((t2 - t1) + (t3 - received_us)) / 2,
+    .rtt_us = rtt,
+  };
+  ClientClock& clock = s_clocks[static_cast<size_t>(slot)];
+  add_sample(clock, sample);
+  send_estimate(fd, clock.estimate);
+}
+
+// "sync start" | "sync stop" | "sync status" | "sync echo <t1> <t2> <t3>"
+static auto sync_command(int fd, std::string_view args) -> void {
+  // stamped before anything else, the handler's own work shouldn't count as network delay
+  int64_t received_us = esp_timer_get_time();
+  if (args.starts_with("echo ")) {
+    handle_echo(fd, args.substr(5), received_us);
+    return;
+  }
+  if (args == "start") {
+    if (!subscribe(fd)) {
+      ESP_LOGW(TAG, "No free clock sync slot for fd=%d", fd);
+      server::ws_send_text(fd, "sync busy", 9);
+    }
+    return;
+  }
+  if (args == "stop") {
+    clock_sync_unsubscribe(fd);
+    return;
+  }
+  if (args == "status") {
+    int slot = slot_for(fd);
+    send_estimate(fd, slot < 0 ? ClockEstimate{} : s_clocks[static_cast<size_t>(slot)].estimate);
+    return;
+  }
+  ESP_LOGW(TAG, "Unknown sync command: %.*s", static_cast<int>(args.size()), args.data());
+}
+
+auto init_clock_sync() -> void {
+  register_text_command("sync", sync_command);
+}
+
+auto clock_sync_tick() -> void {
+  for (auto& subscriber : s_subscribers) {
+    int fd = subscriber.load();
+    if (fd < 0) {
+      continue;
+    }
+    std::array<char, 32> probe{};
+    int len = snprintf(probe.data(), probe.size(), "sync %" PRId64, esp_timer_get_time());
+    if (server::ws_send_text(fd, probe.data(), static_cast<size_t>(len)) != ESP_OK) {
+      ESP_LOGW(TAG, "Clock sync probe failed, unsubscribing fd=%d", fd);
+      clock_sync_unsubscribe(fd);
+    }
+  }
+}
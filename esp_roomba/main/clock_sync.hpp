@@ -0,0 +1,11 @@
+#pragma once
+
+// Registers the "sync" ws command, call before starting the webserver.
+//
+// NTP style exchange where the device asks and the client answers, so the device holds all four timestamps and
+// runs the filter. The estimate goes back to the client, which uses it to move device timestamps (frame headers,
+// telemetry, acks) onto its own clock.
+auto init_clock_sync() -> void;
+// Sends a probe to every subscribed client, call about once a second.
+auto clock_sync_tick() -> void;
+auto clock_sync_unsubscribe(int fd) -> void;
@@ -0,0 +1,96 @@
+#include "espnow_control.hpp"
+
+#include <esp_log.h>
+#include <esp_now.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+#include "metrics.hpp"
+#include "motor_command.hpp"
+
+static const char* TAG = "espnow_control";
+
+// same as the motor deadman
+constexpr int64_t active_timeout_us = 400000;
+
+static std::array<uint8_t, ESP_NOW_ETH_ALEN> s_dongle_mac{};
+static std::atomic<int64_t> s_last_packet_us{0};
+
+static metrics::Counter s_packets{"roomba_espnow_commands_total", "Motor commands received over ESP-NOW"};
+static metrics::Counter s_rejected{
+  "roomba_espnow_rejected_total", "ESP-NOW packets dropped for coming from an unpaired sender or having a bad size"};
+static metrics::Gauge s_rssi{"roomba_espnow_rssi_dbm", "RSSI of the last packet from the dongle"};
+
+// runs in the Wi-Fi task, which sits above every application task including the video path
+static auto on_receive(const esp_now_recv_info_t* info, const uint8_t* data, int len) -> void {
+  if (info == nullptr || !std::equal(s_dongle_mac.begin(), s_dongle_mac.end(), info->src_addr)) {
+    s_rejected.increment();
+    return;
+  }
+  if (len != MotorCommand::data_size) {
+    s_rejected.increment();
+    return;
+  }
+  write_motor_data(data);
+  s_last_packet_us.store(esp_timer_get_time());
+  s_packets.increment();
+  if (info->rx_ctrl != nullptr) {
+    s_rssi.set(info->rx_ctrl->rssi);
+  }
+}
+
+auto init_espnow_control(const EspNowControlConfig& config) -> esp_err_t {
+  if (std::ranges::all_of(config.dongle_mac, [](uint8_t byte) { return byte == 0; })) {
+    ESP_LOGE(TAG, "No dongle MAC configured");
+    return ESP_ERR_INVALID_ARG;
+  }
+  std::ranges::copy(config.dongle_mac, s_dongle_mac.begin());
+
+  esp_err_t err = esp_now_init();
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "esp_now_init failed: %s", esp_err_to_name(err));
+    return err;
+  }
+
+  esp_now_peer_info_t peer{};
+  std::ranges::copy(config.dongle_mac, peer.peer_addr);
+  // 0 follows whatever channel the radio is on
+  peer.channel = 0;
+  wifi_mode_t mode = WIFI_MODE_STA;
+  esp_wifi_get_mode(&mode);
+  peer.ifidx = mode == WIFI_MODE_AP ? WIFI_IF_AP : WIFI_IF_STA;
+  peer.encrypt = config.lmk.has_value();
+  if (config.lmk) {
+    std::ranges::copy(*config.lmk, peer.lmk);
+  }
+  err = esp_now_add_peer(&peer);
+  if (err == ESP_OK) {
+    err = esp_now_register_recv_cb(on_receive);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to set up the dongle peer: %s", esp_err_to_name(err));
+    esp_now_deinit();
+    return err;
+  }
+
+  ESP_LOGI(
+    TAG,
+    "Accepting motor commands from %02x:%02x:%02x:%02x:%02x:%02x%s",
+    s_dongle_mac[0],
+    s_dongle_mac[1],
+    s_dongle_mac[2],
+    s_dongle_mac[3],
+    s_dongle_mac[4],
+    s_dongle_mac[5],
+    peer.encrypt ? " (encrypted)" : "");
+  return ESP_OK;
+}
+
+auto espnow_control_active() -> bool {
+  int64_t last = s_last_packet_us.load();
+  return last != 0 && esp_timer_get_time() - last < active_timeout_us;
+}
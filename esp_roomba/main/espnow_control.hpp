@@ -0,0 +1,22 @@
+#pragma once
+
+#include <esp_err.h>
+
+#include <array>
+#include <cstdint>
+#include <optional>
+
+// Motor commands straight from a paired ESP32 dongle, bypassing the AP, TCP and WebSocket framing.
+// Packets carry the same 4 byte payload as the WebSocket binary message and go through write_motor_data,
+// so sequencing and the deadman timeout behave the same for both transports.
+struct EspNowControlConfig {
+  // only this sender can drive the motors
+  std::array<uint8_t, 6> dongle_mac{};
+  // local master key shared with the dongle, unencrypted when not set
+  std::optional<std::array<uint8_t, 16>> lmk;
+};
+
+// Wi-Fi has to be started. The dongle must transmit on the channel the radio is on (the AP's channel as a station).
+auto init_espnow_control(const EspNowControlConfig& config) -> esp_err_t;
+// A packet from the dongle arrived within the motor deadman timeout.
+[[nodiscard]] auto espnow_control_active() -> bool;
@@ -0,0 +1,174 @@
+#include "event_clip.hpp"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "camera.hpp"
+#include "clip_buffer.hpp"
+#include "new_socket_server.hpp"
+#include "protocol.hpp"
+#include "server_integration.hpp"
+
+static const char* TAG = "event_clip";
+
+constexpr std::chrono::seconds default_clip_seconds{5};
+constexpr uint32_t send_stack_size = 4096;
+constexpr UBaseType_t send_priority = 2;
+
+// u8 packet type, u8 version, u32 frame index, u32 frame count, i64 capture time in us, then the JPEG
+constexpr size_t clip_frame_header_size = 2 + 2 * sizeof(uint32_t) + sizeof(int64_t);
+// u8 packet type, u8 version, u32 command count, then per command i64 time in us and 4 speeds
+constexpr size_t clip_motor_header_size = 2 + sizeof(uint32_t);
+constexpr size_t clip_motor_record_size = sizeof(int64_t) + 4;
+
+// the client the running export goes to, -1 when idle
+static std::atomic<int> s_send_fd{-1};
+static std::chrono::seconds s_send_seconds{default_clip_seconds};
+
+struct SendContext {
+  int fd;
+  uint32_t index;
+  uint32_t count;
+  // reused for every frame, grows to the largest one
+  std::vector<uint8_t> packet;
+};
+
+static auto put_le(uint8_t*& cursor, uint64_t value, size_t bytes) -> void {
+  for (size_t i = 0; i < bytes; i++) {
+    *cursor++ = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+static auto send_frames(SendContext& context) -> bool {
+  context.count = static_cast<uint32_t>(
+    recorder::for_each_clip_frame(s_send_seconds, [](const recorder::ClipFrame&, void*) { return true; }, nullptr));
+  context.index = 0;
+  recorder::for_each_clip_frame(
+    s_send_seconds,
+    [](const recorder::ClipFrame& frame, void* ctx) {
+      auto& context = *static_cast<SendContext*>(ctx);
+      context.packet.resize(clip_frame_header_size + frame.len);
+      uint8_t* cursor = context.packet.data();
+      *cursor++ = static_cast<uint8_t>(PacketType::ClipFrame);
+      *cursor++ = clip_version;
+      put_le(cursor, context.index++, sizeof(uint32_t));
+      put_le(cursor, context.count, sizeof(uint32_t));
+      put_le(cursor, static_cast<uint64_t>(frame.timestamp_us), sizeof(int64_t));
+      memcpy(cursor, frame.jpeg, frame.len);
+      return server::ws_send_binary(context.fd, context.packet.data(), context.packet.size()) == ESP_OK;
+    },
+    &context);
+  return context.index == context.count;
+}
+
+static auto send_motor_commands(SendContext& context) -> bool {
+  context.count = static_cast<uint32_t>(recorder::for_each_clip_motor(
+    s_send_seconds, [](const recorder::ClipMotorCommand&, void*) { return true; }, nullptr));
+  context.packet.resize(clip_motor_header_size + context.count * clip_motor_record_size);
+  uint8_t* cursor = context.packet.data();
+  *cursor++ = static_cast<uint8_t>(PacketType::ClipMotor);
+  *cursor++ = clip_version;
+  put_le(cursor, context.count, sizeof(uint32_t));
+  recorder::for_each_clip_motor(
+    s_send_seconds,
+    [](const recorder::ClipMotorCommand& command, void* ctx) {
+      auto& cursor = *static_cast<uint8_t**>(ctx);
+      put_le(cursor, static_cast<uint64_t>(command.timestamp_us), sizeof(int64_t));
+      memcpy(cursor, command.speeds.data(), command.speeds.size());
+      cursor += command.speeds.size();
+      return true;
+    },
+    &cursor);
+  return server::ws_send_binary(context.fd, context.packet.data(), context.packet.size()) == ESP_OK;
+}
+
+// a few MB of frames would hold up the httpd task for seconds, so the export gets its own short lived task
+static auto send_task(void* /*arg*/) -> void {
+  SendContext context{.fd = s_send_fd.load(), .index = 0, .count = 0, .packet = {}};
+  bool ok = send_motor_commands(context) && send_frames(context);
+  if (!ok) {
+    ESP_LOGW(TAG, "Clip export to fd=%d stopped after %" PRIu32 " frames", context.fd, context.index);
+  }
+  const char* reply = ok ? "clip sent" : "clip failed";
+  server::ws_send_text(context.fd, reply, strlen(reply));
+  s_send_fd = -1;
+  vTaskDelete(nullptr);
+}
+
+static auto parse_seconds(std::string_view text) -> std::chrono::seconds {
+  unsigned seconds = 0;
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), seconds);
+  if (error != std::errc{} || seconds == 0) {
+    return default_clip_seconds;
+  }
+  return std::chrono::seconds(seconds);
+}
+
+static auto reply_status(int fd) -> void {
+  std::string status;
+  recorder::render_clip_status_json(status);
+  server::ws_send_text(fd, status.data(), status.size());
+}
+
+// "clip trigger <reason>" | "clip send [seconds]" | "clip save [seconds]" | "clip release" | "clip status"
+static auto clip_command(int fd, std::string_view args) -> void {
+  auto split = args.find(' ');
+  std::string_view action = args.substr(0, split);
+  std::string_view rest = split == std::string_view::npos ? std::string_view{} : args.substr(split + 1);
+
+  if (action == "trigger") {
+    recorder::trigger_clip(rest.empty() ? std::string_view{"manual"} : rest);
+  } else if (action == "send") {
+    int idle = -1;
+    if (!recorder::clip_frozen() || recorder::clip_saving() || !s_send_fd.compare_exchange_strong(idle, fd)) {
+      server::ws_send_text(fd, "clip busy", 9);
+      return;
+    }
+    s_send_seconds = parse_seconds(rest);
+    BaseType_t created =
+      xTaskCreatePinnedToCore(send_task, "clip_send", send_stack_size, nullptr, send_priority, nullptr, 0);
+    if (created != pdPASS) {
+      ESP_LOGE(TAG, "Failed to create clip send task");
+      s_send_fd = -1;
+    }
+    return;
+  } else if (action == "save") {
+    if (s_send_fd.load() >= 0 || recorder::save_clip(parse_seconds(rest)) != ESP_OK) {
+      server::ws_send_text(fd, "clip busy", 9);
+      return;
+    }
+  } else if (action == "release") {
+    if (s_send_fd.load() >= 0 || recorder::clip_saving()) {
+      server::ws_send_text(fd, "clip busy", 9);
+      return;
+    }
+    recorder::release_clip();
+  } else if (action != "status") {
+    ESP_LOGW(TAG, "Unknown clip command: %.*s", static_cast<int>(args.size()), args.data());
+    return;
+  }
+  reply_status(fd);
+}
+
+auto init_event_clips(bool keep_camera_awake) -> void {
+  if (recorder::init_clip_buffer() != ESP_OK) {
+    ESP_LOGW(TAG, "Clip ring unavailable");
+    return;
+  }
+  if (keep_camera_awake) {
+    // never released, the pre-roll is only there if frames keep coming with nobody watching
+    camera::acquire();
+  } else {
+    ESP_LOGW(TAG, "Camera idles without a stream client, clips only hold frames captured while streaming");
+  }
+  register_text_command("clip", clip_command);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Allocates the pre-roll clip ring and registers the "clip" ws command, call before starting the webserver.
+// The ring only gets frames while the camera is capturing. With keep_camera_awake it holds a camera::acquire() for as
+// long as the ring exists, otherwise the sensor idles without a stream client and a clip only has the frames captured
+// while something was streaming or recording.
+auto init_event_clips(bool keep_camera_awake) -> void;
@@ -0,0 +1,167 @@
+#include "governor.hpp"
+
+#include <esp_log.h>
+#include <esp_pm.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include "camera.hpp"
+#include "diagnostics.hpp"
+#include "metrics.hpp"
+#include "sensor_profile.hpp"
+#include "sdkconfig.h"
+#include "server_integration.hpp"
+#include "wifi_manager.hpp"
+
+static const char* TAG = "governor";
+
+// APB stays at 80 MHz down to a CPU clock of 80 MHz, so the LEDC driven motor PWM and camera XCLK keep their
+// frequencies. Going lower would need every LEDC user to hold an APB lock.
+constexpr int min_cpu_freq_mhz = 80;
+constexpr int max_cpu_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ;
+
+// a level is only left once the temperature is this far below its threshold
+constexpr float hysteresis_celsius = 3.0F;
+
+struct ThermalStep {
+  float enter_celsius;
+  uint32_t frame_interval_us;
+  int jpeg_quality;
+  bool allow_max_cpu;
+};
+
+// index matches ThermalLevel, the sensor profile's interval and quality are the floor under every step
+static constexpr std::array<ThermalStep, 4> thermal_steps = {{
+  {0.0F, 0, 8, true},
+  {high_temperature_celsius - 10.0F, 100 * 1000, 8, true},
+  {high_temperature_celsius - 5.0F, 150 * 1000, 14, true},
+  {high_temperature_celsius, 250 * 1000, 20, false},
+}};
+
+// added on top of the thermal jpeg quality while the link can't comfortably carry the stream
+constexpr int max_link_penalty = 20;
+constexpr int link_penalty_step = 4;
+// back off once goodput gets within this share of the estimated capacity, recover below the second
+constexpr uint32_t link_backoff_percent = 80;
+constexpr uint32_t link_recover_percent = 33;
+
+static esp_pm_lock_handle_t s_cpu_lock = nullptr;
+static bool s_cpu_lock_held = false;
+static ThermalLevel s_level = ThermalLevel::Nominal;
+static std::atomic<int> s_link_penalty{0};
+
+static metrics::Gauge s_temperature{"roomba_chip_temperature_celsius", "On die temperature"};
+static metrics::Gauge s_level_gauge{"roomba_governor_thermal_level", "0 nominal, 1 warm, 2 hot, 3 critical"};
+static metrics::Counter s_level_changes{"roomba_governor_level_changes_total", "Thermal level transitions"};
+static metrics::Gauge s_cpu_freq{"roomba_governor_cpu_freq_mhz", "CPU clock the governor is asking for"};
+static metrics::Gauge s_frame_interval{"roomba_governor_frame_interval_us", "Minimum time between streamed frames"};
+static metrics::Gauge s_link_penalty_gauge{
+  "roomba_governor_link_quality_penalty", "JPEG quality steps added because of a weak Wi-Fi link"};
+static metrics::Gauge s_jpeg_quality{
+  "roomba_governor_jpeg_quality", "JPEG quality the camera runs at, lower is better"};
+
+// runs on the link monitor timer, only decides, update_governor applies it
+static auto on_link_quality(const wifi::LinkQuality& link) -> void {
+  if (!link.connected || link.goodput_kbps == 0) {
+    return;
+  }
+  int penalty = s_link_penalty;
+  if (link.goodput_kbps * 100 > link.capacity_kbps * link_backoff_percent) {
+    penalty = std::min(penalty + link_penalty_step, max_link_penalty);
+  } else if (link.goodput_kbps * 100 < link.capacity_kbps * link_recover_percent) {
+    // recover slowly so a single good sample doesn't bounce quality back up
+    penalty = std::max(penalty - 1, 0);
+  }
+  s_link_penalty = penalty;
+}
+
+auto init_governor() -> void {
+#if CONFIG_PM_ENABLE
+  esp_pm_config_t pm_config = {
+    .max_freq_mhz = max_cpu_freq_mhz,
+    .min_freq_mhz = min_cpu_freq_mhz,
+    // light sleep would stop XCLK and stall the sockets
+    .light_sleep_enable = false,
+  };
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if (err == ESP_OK) {
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "stream", &s_cpu_lock);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Frequency scaling unavailable: %s", esp_err_to_name(err));
+    s_cpu_lock = nullptr;
+  }
+#else
+  ESP_LOGW(TAG, "CONFIG_PM_ENABLE is off, only throttling frame rate and quality");
+#endif
+  s_frame_interval.set(static_cast<int32_t>(camera::active_sensor_profile().frame_interval_us));
+  s_jpeg_quality.set(camera::get_jpeg_quality());
+  s_cpu_freq.set(s_cpu_lock == nullptr ? max_cpu_freq_mhz : min_cpu_freq_mhz);
+  wifi::WifiManager::instance().subscribe_link_quality(on_link_quality);
+}
+
+static auto next_level(float celsius) -> ThermalLevel {
+  auto level = static_cast<size_t>(s_level);
+  while (level + 1 < thermal_steps.size() && celsius >= thermal_steps[level + 1].enter_celsius) {
+    level++;
+  }
+  while (level > 0 && celsius < thermal_steps[level].enter_celsius - hysteresis_celsius) {
+    level--;
+  }
+  return static_cast<ThermalLevel>(level);
+}
+
+static auto set_cpu_lock(bool held) -> void {
+  if (s_cpu_lock == nullptr || held == s_cpu_lock_held) {
+    return;
+  }
+  if (held) {
+    esp_pm_lock_acquire(s_cpu_lock);
+  } else {
+    esp_pm_lock_release(s_cpu_lock);
+  }
+  s_cpu_lock_held = held;
+  s_cpu_freq.set(held ? max_cpu_freq_mhz : min_cpu_freq_mhz);
+  ESP_LOGI(TAG, "CPU clock %d MHz", held ? max_cpu_freq_mhz : min_cpu_freq_mhz);
+}
+
+auto update_governor() -> void {
+  float celsius = 0.0F;
+  if (read_chip_temperature(&celsius) == ESP_OK) {
+    s_temperature.set(static_cast<int32_t>(celsius));
+    ThermalLevel level = next_level(celsius);
+    if (level != s_level) {
+      const ThermalStep& step = thermal_steps[static_cast<size_t>(level)];
+      uint32_t frame_interval_us = std::max(step.frame_interval_us, camera::active_sensor_profile().frame_interval_us);
+      ESP_LOGW(
+        TAG,
+        "%.1f C, thermal level %d -> %d: frame interval %lu us, jpeg quality %d",
+        celsius,
+        static_cast<int>(s_level),
+        static_cast<int>(level),
+        static_cast<unsigned long>(frame_interval_us),
+        step.jpeg_quality);
+      s_level = level;
+      s_level_gauge.set(static_cast<int32_t>(level));
+      s_level_changes.increment();
+
+      set_stream_frame_interval_us(frame_interval_us);
+      s_frame_interval.set(static_cast<int32_t>(frame_interval_us));
+    }
+  }
+
+  int link_penalty = s_link_penalty;
+  s_link_penalty_gauge.set(link_penalty);
+  int base_quality =
+    std::max(thermal_steps[static_cast<size_t>(s_level)].jpeg_quality, camera::active_sensor_profile().jpeg_quality);
+  int quality = std::min(base_quality + link_penalty, 63);
+  if (quality != camera::get_jpeg_quality() && camera::set_jpeg_quality(quality) == ESP_OK) {
+    s_jpeg_quality.set(quality);
+  }
+
+  // full clock only while frames are being produced, and never when critical
+  bool streaming = camera::get_state() == camera::State::Capturing;
+  set_cpu_lock(streaming && thermal_steps[static_cast<size_t>(s_level)].allow_max_cpu);
+}
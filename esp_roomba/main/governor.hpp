@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstdint>
+
+enum class ThermalLevel : uint8_t { Nominal = 0, Warm = 1, Hot = 2, Critical = 3 };
+
+// Sets up dynamic frequency scaling, call after camera::setup().
+auto init_governor() -> void;
+// Applies the clock, frame rate and quality for the current load, temperature and link, call periodically.
+auto update_governor() -> void;
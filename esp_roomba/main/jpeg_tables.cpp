@@ -0,0 +1,97 @@
+#include "jpeg_tables.hpp"
+
+#include <esp_log.h>
+
+#include <array>
+#include <atomic>
+#include <cstring>
+
+#include "metrics.hpp"
+#include "new_socket_server.hpp"
+#include "protocol.hpp"
+
+static const char* TAG = "jpeg_tables";
+
+// the OV2640's headers are about 600 bytes, frames with more than this go out whole
+constexpr size_t max_jpeg_tables_size = 1024;
+constexpr uint8_t jpeg_marker_sos = 0xDA;
+
+// u8 packet type, u8 version, then the headers
+static std::array<uint8_t, 2 + max_jpeg_tables_size> s_tables_packet{};
+static size_t s_tables_size = 0;
+// set by "start" on the httpd task
+static std::atomic<bool> s_tables_stale{true};
+
+static metrics::Counter s_tables_sent{
+  "roomba_stream_jpeg_tables_sent_total", "Times the JPEG headers changed and were sent to the client again"};
+static metrics::Gauge s_tables_bytes{
+  "roomba_stream_jpeg_table_bytes", "JPEG header bytes left off each frame in tables mode, at the current quality"};
+static metrics::Counter s_bytes_saved{
+  "roomba_stream_jpeg_table_bytes_saved_total", "JPEG header bytes not sent thanks to tables mode"};
+
+auto jpeg_scan_offset(std::span<const uint8_t> jpeg) -> std::optional<size_t> {
+  if (jpeg.size() < 4 || jpeg[0] != camera::JPEG_SOI_MARKER_FIRST || jpeg[1] != camera::JPEG_SOI_MARKER_SECOND) {
+    return std::nullopt;
+  }
+  size_t offset = 2;
+  while (offset + 4 <= jpeg.size()) {
+    if (jpeg[offset] != 0xFF) {
+      return std::nullopt;
+    }
+    uint8_t marker = jpeg[offset + 1];
+    if (marker == 0xFF) {
+      // fill byte
+      offset++;
+      continue;
+    }
+    if (marker == jpeg_marker_sos) {
+      return offset;
+    }
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      // TEM and RSTn have no length
+      offset += 2;
+      continue;
+    }
+    size_t length = (static_cast<size_t>(jpeg[offset + 2]) << 8) | jpeg[offset + 3];
+    if (length < 2) {
+      return std::nullopt;
+    }
+    offset += 2 + length;
+  }
+  return std::nullopt;
+}
+
+auto strip_jpeg_tables(int fd, const camera::JpegBuffer& frame) -> size_t {
+  std::optional<size_t> scan = jpeg_scan_offset({frame.buffer, frame.len});
+  if (!scan || *scan > max_jpeg_tables_size) {
+    return 0;
+  }
+  bool changed = s_tables_stale.exchange(false) || *scan != s_tables_size ||
+                 memcmp(s_tables_packet.data() + 2, frame.buffer, *scan) != 0;
+  if (changed) {
+    s_tables_packet[0] = static_cast<uint8_t>(PacketType::JpegTables);
+    s_tables_packet[1] = jpeg_tables_version;
+    memcpy(s_tables_packet.data() + 2, frame.buffer, *scan);
+    s_tables_size = *scan;
+    if (server::ws_send_binary(fd, s_tables_packet.data(), 2 + s_tables_size) != ESP_OK) {
+      // try again with the next frame, this one goes out whole
+      s_tables_stale = true;
+      return 0;
+    }
+    s_tables_sent.increment();
+    s_tables_bytes.set(static_cast<int32_t>(s_tables_size));
+    ESP_LOGI(
+      TAG,
+      "JPEG tables changed, %u of %u bytes left off each frame at quality %d",
+      static_cast<unsigned>(s_tables_size),
+      static_cast<unsigned>(frame.len),
+      camera::get_jpeg_quality());
+  } else {
+    s_bytes_saved.increment(static_cast<uint32_t>(s_tables_size));
+  }
+  return s_tables_size;
+}
+
+auto reset_jpeg_tables() -> void {
+  s_tables_stale = true;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+
+#include "camera.hpp"
+
+// Offset of the SOS marker, where the entropy coded scan starts. Everything in front of it (SOI, APP0, DQT, SOF0, DHT)
+// is the same for every frame until the resolution or quality changes. nullopt if the markers don't parse.
+[[nodiscard]] auto jpeg_scan_offset(std::span<const uint8_t> jpeg) -> std::optional<size_t>;
+
+// "start tables", only called from the stream task. Sends the frame's headers as a PacketType::JpegTables packet when
+// they differ from the ones the client has, and returns how many bytes to leave off the front of the frame. 0 means
+// the frame has to go out whole.
+auto strip_jpeg_tables(int fd, const camera::JpegBuffer& frame) -> size_t;
+// the next frame sends its tables again, for a new stream or client
+auto reset_jpeg_tables() -> void;
@@ -1,21 +1,50 @@
 #include <esp_log.h>
 #include <nvs_flash.h>
 
+#include "boot.hpp"
 #include "camera.hpp"
+#include "clock_sync.hpp"
 #include "diagnostics.hpp"
 #include "esp_chip_info.h"
 #include "esp_system.h"
+#include "espnow_control.hpp"
+#include "event_clip.hpp"
+#include "governor.hpp"
+#include "link_profile.hpp"
 #include "motor_command.hpp"
 #include "new_socket_server.hpp"
+#include "recorder.hpp"
 #include "server_integration.hpp"
+#include "snapshot.hpp"
+#include "task_profiler.hpp"
+#include "telemetry.hpp"
+#include "tracing.hpp"
 #include "wifi_ap.hpp"
 #include "wifi_manager.hpp"
 
 static const char* TAG = "Main";
 
+// drive from a paired ESP32 dongle over ESP-NOW as well as over WebSockets
+constexpr bool use_espnow_control = false;
+constexpr EspNowControlConfig espnow_control_config{
+  .dongle_mac = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+  .lmk = std::nullopt,
+};
+// microSD recording, the slot's SPI pins (GPIO 7, 8, 9) are wired to motors 2 and 3 on this board,
+// only enable it with the motors moved to other pins
+constexpr bool use_sd_recorder = false;
+// keeps the sensor capturing for the clip ring's pre-roll, at the cost of never letting the camera idle
+constexpr bool clip_keeps_camera_awake = true;
+
+constexpr uint32_t telemetry_interval_ms = 1000;
+constexpr uint32_t status_interval_ms = 15000;
+
 constexpr size_t camStackSize = 6144;
 constexpr size_t streamStackSize = 8192;
 constexpr size_t motorStackSize = 4096;
+constexpr uint32_t bootCameraStackSize = 4096;
+// how long the timeline waits for the stages it reports, one still missing after that is logged as pending
+constexpr uint32_t boot_timeline_timeout_ms = 10000;
 constexpr size_t captureTaskPriority = configMAX_PRIORITIES - 5;
 constexpr size_t motorTaskPriority = configMAX_PRIORITIES - 3;
 constexpr size_t streamTaskPriority = configMAX_PRIORITIES - 4;
@@ -43,27 +72,21 @@ static auto init_nvs() -> void {
 
 static httpd_handle_t ws_server = nullptr;
 static auto setup_wifi_connect() -> void;
-extern "C" void app_main() {
-  init_nvs();
-  // setup_wifi();
-  setup_wifi_connect();
-  auto& wifi = wifi::WifiManager::instance();
 
-  while (!wifi.wifi_ready) {
-    vTaskDelay(pdMS_TO_TICKS(100));
+// Camera bring-up (SCCB probe, sensor init, first frame) runs while Wi-Fi associates and the motors come up. XCLK has
+// its own LEDC timer and channel, so neither depends on the other's init.
+static auto boot_camera_task(void* /*arg*/) -> void {
+#ifndef NDEBUG
+  // release builds only record after "trace on"
+  tracing::set_enabled(true);
+#endif
+  esp_err_t camera_err = camera::setup();
+  init_governor();
+  if (camera_err == ESP_OK) {
+    boot_mark(BootStage::Camera);
   }
 
-  vTaskDelay(pdMS_TO_TICKS(1000));  // Give WiFi time to stabilize
-
-  camera::setup();
-
-  server::set_ws_binary_handler(handle_binary_message);
-  server::set_ws_text_handler(handle_text_message);
-  ws_server = server::start_webserver();
-
-  write_motor_data_zero();
-
-  // constantly capturing for now, maybe turn this on and off later
+  // idles the sensor until a stream client calls camera::acquire()
   TaskHandle_t captureTaskHandle = xTaskCreateStaticPinnedToCore(
     camera::camera_capture_task,
     "camera_capture_task",
@@ -76,12 +99,23 @@ extern "C" void app_main() {
 
   if (captureTaskHandle == nullptr) {
     ESP_LOGE(TAG, "Failed to create capture task");
-    return;
+  } else {
+    register_task_stack(captureTaskHandle, camStackSize);
   }
 
-  vTaskDelay(pdMS_TO_TICKS(100));
+  vTaskDelete(nullptr);
+}
+
+extern "C" void app_main() {
+  init_boot();
+  init_nvs();
+  boot_mark(BootStage::Nvs);
+  // setup_wifi();
+  setup_wifi_connect();
+  boot_mark(BootStage::WifiStarted);
 
-  // constantly update the state of the motors
+  // constantly update the state of the motors, marks BootStage::Motors once they are initialized
+  write_motor_data_zero();
   TaskHandle_t motorTaskHandle = xTaskCreateStaticPinnedToCore(
     motor_control_task,
     "motor_control_task",
@@ -94,12 +128,58 @@ extern "C" void app_main() {
 
   if (motorTaskHandle == nullptr) {
     ESP_LOGE(TAG, "Failed to create motor task");
+  } else {
+    register_task_stack(motorTaskHandle, motorStackSize);
+  }
+
+  // frames carry how many motor commands had arrived when they were captured
+  camera::set_frame_tag_source(motor_commands_written);
+  BaseType_t created = xTaskCreatePinnedToCore(
+    boot_camera_task, "boot_camera", bootCameraStackSize, nullptr, captureTaskPriority, nullptr, 1);
+  if (created != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create camera boot task");
+    return;
+  }
+
+  // nobody is connected yet, the first WebSocket client moves the radio to the latency profile
+  if (auto profile = wifi::apply_link_profile(wifi::LinkProfile::PowerSaver); !profile) {
+    ESP_LOGW(TAG, "Failed to apply the power saver link profile");
+  }
+  // modem sleep would drop dongle packets between beacons
+  if (use_espnow_control && init_espnow_control(espnow_control_config) == ESP_OK) {
+    set_idle_link_profile(wifi::LinkProfile::Latency);
+  }
+
+  // httpd binds to any address, it doesn't have to wait for DHCP
+  server::set_ws_binary_handler(handle_binary_message);
+  server::set_ws_text_handler(handle_text_message);
+  server::set_ws_open_handler(handle_ws_open);
+  server::set_ws_close_handler(handle_ws_close);
+  init_telemetry();
+  init_clock_sync();
+  init_event_clips(clip_keeps_camera_awake);
+  init_snapshots();
+  ws_server = server::start_webserver();
+  if (ws_server != nullptr) {
+    boot_mark(BootStage::Server);
+  }
+
+#ifndef NDEBUG
+  esp_log_level_set("*", ESP_LOG_DEBUG);
+  ESP_LOGI(TAG, "Starting System Monitor Example...");
+  auto ret = init_system_monitor();
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "System monitor init failed: %s", esp_err_to_name(ret));
     return;
   }
+#endif
+  boot_mark(BootStage::Diagnostics);
 
-  vTaskDelay(pdMS_TO_TICKS(100));
+  if (use_sd_recorder && recorder::init() != ESP_OK) {
+    ESP_LOGW(TAG, "Recorder unavailable");
+  }
 
-  // constatly look out for a ws client to stream to
+  // constatly look out for a ws client to stream to, waits for the camera itself
   TaskHandle_t streamTaskHandle = xTaskCreateStaticPinnedToCore(
     camera_stream_task,
     "cam_stream_task",
@@ -114,26 +194,42 @@ extern "C" void app_main() {
     ESP_LOGE(TAG, "Failed to create stream task");
     return;
   }
-  // });
+  register_task_stack(streamTaskHandle, streamStackSize);
 
-#ifndef NDEBUG
-  esp_log_level_set("*", ESP_LOG_DEBUG);
-  ESP_LOGI(TAG, "Starting System Monitor Example...");
-  auto ret = init_system_monitor();
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "System monitor init failed: %s", esp_err_to_name(ret));
-    return;
+  auto& wifi = wifi::WifiManager::instance();
+  while (true) {
+    auto result = wifi.wait_for_ip(std::chrono::seconds(5));
+    if (result) {
+      break;
+    }
+    ESP_LOGW(TAG, "Still waiting for an IP address");
+    if (result.error() == wifi::WifiError::NotInitialized) {
+      vTaskDelay(pdMS_TO_TICKS(1000));
+    }
   }
-#endif
+  boot_mark(BootStage::Ip);
+  // the camera may finish after the address, the motor task may still be coming up
+  boot_wait(
+    {BootStage::Camera, BootStage::Server, BootStage::Ip, BootStage::Motors}, pdMS_TO_TICKS(boot_timeline_timeout_ms));
+  log_boot_timeline();
 
+  [[maybe_unused]] uint32_t since_status_ms = 0;
   while (true) {
+    update_governor();
+    publish_telemetry();
+    clock_sync_tick();
 #ifndef NDEBUG
-    system_status_t current_status = {};
-    if (get_system_status(&current_status) == ESP_OK) {
-      print_system_status(&current_status);
+    since_status_ms += telemetry_interval_ms;
+    if (since_status_ms >= status_interval_ms) {
+      since_status_ms = 0;
+      system_status_t current_status = {};
+      if (get_system_status(&current_status) == ESP_OK) {
+        print_system_status(&current_status);
+      }
+      print_task_profiles();
     }
 #endif
-    vTaskDelay(pdMS_TO_TICKS(15000));
+    vTaskDelay(pdMS_TO_TICKS(telemetry_interval_ms));
   }
 }
 
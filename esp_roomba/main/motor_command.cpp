@@ -6,17 +6,34 @@
 
 #include <cstring>
 
+#include "boot.hpp"
+#include "clip_buffer.hpp"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "metrics.hpp"
 #include "motor.hpp"
+#include "tracing.hpp"
 
 static const char* TAG = "motor_control";
 static constexpr int delay_ms = 10;
 // 400ms in microseconds, the amount of time without a command before halting the motors
 static constexpr uint64_t timout_micros = 400000;
 
+static metrics::Counter s_commands_received{"roomba_motor_commands_received_total", "Motor commands written"};
+static metrics::Counter s_commands_applied{"roomba_motor_commands_applied_total", "Motor commands applied to the PWM"};
+static metrics::Counter s_deadman_stops{
+  "roomba_motor_deadman_stops_total", "Times the motors were halted because commands stopped arriving"};
+static metrics::Histogram s_command_latency{
+  "roomba_motor_command_latency_us",
+  "Time from receiving a motor command to applying it",
+  {250, 500, 1000, 2000, 5000, 10000, 20000, 50000}};
+
 static MotorCommand command;
 static std::atomic<uint64_t> sequence{0};
+// commands arrive from the httpd task and the Wi-Fi task (ESP-NOW), the motor task reads them on the other core
+static portMUX_TYPE s_command_lock = portMUX_INITIALIZER_UNLOCKED;
+// woken on every new command instead of waiting out its poll delay
+static std::atomic<TaskHandle_t> s_motor_task{nullptr};
 // left
 static gpio::Motor motor1{GPIO_NUM_5, GPIO_NUM_3, GPIO_NUM_4, LEDC_CHANNEL_0};
 // right
@@ -25,18 +42,36 @@ static gpio::Motor motor2{GPIO_NUM_6, GPIO_NUM_8, GPIO_NUM_9, LEDC_CHANNEL_1};
 static gpio::Motor motor3{GPIO_NUM_7, GPIO_NUM_44, GPIO_NUM_43, LEDC_CHANNEL_2};
 
 auto write_motor_data_zero() -> void {
+  taskENTER_CRITICAL(&s_command_lock);
   memset(&command, 0, sizeof(MotorCommand));
+  taskEXIT_CRITICAL(&s_command_lock);
 }
 auto write_motor_data(const uint8_t* data) -> void {
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&s_command_lock);
   memcpy(&command.speeds, data, MotorCommand::data_size);
 
   // Update metadata
   command.sequence = sequence.fetch_add(1);
-  command.timestamp = esp_timer_get_time();
+  command.timestamp = now;
+  taskEXIT_CRITICAL(&s_command_lock);
+  s_commands_received.increment();
+  recorder::clip_record_motor(data, MotorCommand::data_size, now);
+
+  TaskHandle_t motor_task = s_motor_task.load();
+  if (motor_task != nullptr) {
+    xTaskNotifyGive(motor_task);
+  }
+}
+
+auto motor_commands_written() -> uint64_t {
+  return sequence.load();
 }
 
 static auto read_motor_data(MotorCommand& output, uint64_t last_sequence) -> bool {
+  taskENTER_CRITICAL(&s_command_lock);
   memcpy(&output, &command, sizeof(MotorCommand));
+  taskEXIT_CRITICAL(&s_command_lock);
   return output.sequence > last_sequence;
 }
 
@@ -64,6 +99,7 @@ void motor_control_task(void* arg) {
 
   MotorCommand current;
   uint64_t last_sequence = 0;
+  bool halted = true;
   TickType_t lastWakeTime = xTaskGetTickCount();
 
   auto m1Result = motor1.init();
@@ -80,6 +116,8 @@ void motor_control_task(void* arg) {
   }
 
   stop_motors();
+  s_motor_task.store(xTaskGetCurrentTaskHandle());
+  boot_mark(BootStage::Motors);
 
   while (true) {
     bool got_new_command = read_motor_data(current, last_sequence);
@@ -87,16 +125,21 @@ void motor_control_task(void* arg) {
     // If there's no instructions for 400ms, stop motors
     uint64_t now = esp_timer_get_time();
     if (now - current.timestamp > timout_micros) {
+      if (!halted) {
+        s_deadman_stops.increment();
+        halted = true;
+      }
       stop_motors();
-      vTaskDelay(delay_ms);
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(delay_ms));
       continue;
     }
 
     if (!got_new_command) {
-      vTaskDelay(delay_ms);
+      ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(delay_ms));
       continue;
     }
 
+    int64_t apply_start = esp_timer_get_time();
     bool m1IsForward = current.getDirection(0);
     bool m2IsForward = current.getDirection(1);
     bool m3IsForward = current.getDirection(2);
@@ -118,6 +161,9 @@ void motor_control_task(void* arg) {
       ESP_LOGE(TAG, "Motor 3 forward failed with error code: %d", static_cast<int>(m3Result.error()));
     }
 
+    tracing::record(
+      tracing::Span::MotorApply, apply_start, esp_timer_get_time(), static_cast<uint32_t>(current.sequence));
+
     ESP_LOGI(
       TAG,
       "Motors: M1=%d%% %s, M2=%d%% %s, M3=%d%% %s",
@@ -129,6 +175,9 @@ void motor_control_task(void* arg) {
       m3IsForward ? "FWD" : "REV");
 
     last_sequence = current.sequence;
+    halted = false;
+    s_commands_applied.increment();
+    s_command_latency.observe(static_cast<uint32_t>(esp_timer_get_time() - current.timestamp));
 
     if (interval > 0) {
       vTaskDelayUntil(&lastWakeTime, interval);
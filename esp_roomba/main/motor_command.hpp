@@ -34,5 +34,7 @@ struct MotorCommand {
 // Functions remain the same but now expect 4 bytes of signed data
 auto write_motor_data(const uint8_t* data) -> void;
 auto write_motor_data_zero() -> void;
+// Commands written since boot, so MotorCommand::sequence + 1 of the latest one and 0 before the first. Lock free.
+[[nodiscard]] auto motor_commands_written() -> uint64_t;
 
 auto motor_control_task(void* arg) -> void;
\ No newline at end of file
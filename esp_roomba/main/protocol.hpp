@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// First byte of every binary message the server sends that isn't a bare JPEG frame.
+// JPEG frames always start with the SOI marker (0xFF 0xD8), so 0xFF is never used as a type.
+enum class PacketType : uint8_t {
+  Telemetry = 0x01,
+  // one frame of an exported event clip, see event_clip.cpp
+  ClipFrame = 0x02,
+  // the motor commands of an exported event clip, sent before its frames
+  ClipMotor = 0x03,
+  // a streamed frame with its metadata in front of the JPEG, for clients that sent "start header"
+  Frame = 0x04,
+  // the JPEG headers (SOI up to the SOS marker) of the frames that follow, for clients that sent "start tables"
+  JpegTables = 0x05,
+  // part of a full resolution still, see snapshot.cpp
+  Snapshot = 0x06,
+};
+
+constexpr uint8_t telemetry_version = 1;
+constexpr uint8_t clip_version = 1;
+constexpr uint8_t frame_version = 1;
+constexpr uint8_t jpeg_tables_version = 1;
+constexpr uint8_t snapshot_version = 1;
+
+// u8 packet type, u8 version, u32 frame sequence, u64 capture time in us, u16 exposure, u16 gain,
+// u64 motor commands written at capture, all little endian, then the JPEG. In tables mode the JPEG starts at its SOS
+// marker and the client puts the latest JpegTables packet's bytes in front of it.
+constexpr size_t frame_header_size = 2 + sizeof(uint32_t) + sizeof(uint64_t) + 2 * sizeof(uint16_t) + sizeof(uint64_t);
+
+// u8 packet type, u8 version, u32 offset of this part, u32 JPEG size, u16 width, u16 height, u32 stream gap in us,
+// u64 capture time in us, all little endian, then this part of the JPEG
+constexpr size_t snapshot_header_size =
+  2 + 2 * sizeof(uint32_t) + 2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint64_t);
@@ -1,30 +1,202 @@
 #include "server_integration.hpp"
 
+#include <esp_heap_caps.h>
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cinttypes>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <string>
+
+#include "boot.hpp"
 #include "camera.hpp"
+#include "clock_sync.hpp"
 #include "esp_http_server.h"
 #include "esp_log_level.h"
 #include "esp_timer.h"
+#include "jpeg_tables.hpp"
+#include "link_profile.hpp"
+#include "metrics.hpp"
 #include "motor_command.hpp"
+#include "protocol.hpp"
+#include "recorder.hpp"
+#include "sensor_profile.hpp"
+#include "telemetry.hpp"
+#include "tracing.hpp"
+#include "wifi_manager.hpp"
 
 static const char* TAG = "server_integration";
 
+constexpr uint32_t camera_boot_timeout_ms = 10000;
+
 static bool s_streaming = false;
 static int s_ws_fd = -1;
+// the stream holds one camera::acquire() while it's running
+static bool s_holds_camera = false;
+// The "start" flags below are written by the httpd task and read by the stream task through a StreamFlags copy taken
+// once per frame, so a restart never mixes two layouts in one frame.
+// "start header" puts a PacketType::Frame header in front of every JPEG
+static std::atomic<bool> s_frame_header{false};
+// "start credit": the client grants frames with "credit <n>" and the stream only sends while it has some
+static std::atomic<bool> s_credit_mode{false};
+static std::atomic<int32_t> s_credit{0};
+// enough to keep one frame in flight while the client decodes the previous one
+constexpr int32_t initial_stream_credit = 2;
+// a client granting ahead can't queue up more latency than this many frames
+constexpr int32_t max_stream_credit = 8;
+// woken by "credit" instead of polling for it
+static std::atomic<TaskHandle_t> s_stream_task{nullptr};
+// "start chunked" sends frames as WebSocket fragments copied through a small internal RAM buffer
+static std::atomic<bool> s_chunked{false};
+// four full TCP segments
+constexpr size_t stream_chunk_size = 4 * 1460;
+// "start tables" sends the JPEG headers only when they change and leaves them off the frames
+static std::atomic<bool> s_jpeg_tables{false};
+
+struct StreamFlags {
+  bool header;
+  bool credit;
+  bool chunked;
+  bool tables;
+};
+
+static auto load_stream_flags() -> StreamFlags {
+  return StreamFlags{
+    .header = s_frame_header.load(),
+    .credit = s_credit_mode.load(),
+    .chunked = s_chunked.load(),
+    .tables = s_jpeg_tables.load(),
+  };
+}
+
+// open WebSocket connections, http scrapes are not tracked
+constexpr size_t max_ws_clients = 3;
+static std::array<int, max_ws_clients> s_ws_clients{-1, -1, -1};
+// set by the "profile" command, otherwise the profile follows the clients and the stream
+static std::optional<wifi::LinkProfile> s_profile_override;
+static wifi::LinkProfile s_idle_profile = wifi::LinkProfile::PowerSaver;
 
 using namespace server;
 
-// 34048 ov5640
-// 17628 ov2640
+static metrics::Counter s_frames_sent{"roomba_stream_frames_sent_total", "Frames sent to the streaming client"};
+static metrics::Counter s_bytes_sent{"roomba_stream_bytes_sent_total", "JPEG bytes sent to the streaming client"};
+static metrics::Counter s_frames_skipped{
+  "roomba_stream_frames_skipped_total", "Frames not sent because of low memory or invalid data"};
+static metrics::Counter s_duplicate_frames{
+  "roomba_stream_duplicate_frames_total", "Times the stream task saw the same frame twice and had to wait"};
+static metrics::Counter s_send_failures{"roomba_stream_send_failures_total", "Failed WebSocket frame sends"};
+static metrics::Histogram s_first_chunk{
+  "roomba_stream_first_chunk_us",
+  "Time from starting a frame send until its first fragment was accepted by the socket, the whole frame when not "
+  "chunked",
+  {500, 1000, 2000, 5000, 10000, 20000, 50000, 100000}};
+static metrics::Gauge s_send_internal_min_free{
+  "roomba_stream_send_internal_min_free_bytes", "Lowest free internal RAM during the latest frame send"};
+static metrics::Histogram s_credit_wait{
+  "roomba_stream_credit_wait_us",
+  "Time the stream waited for the client to grant a frame in credit mode",
+  {1000, 5000, 10000, 20000, 50000, 100000, 200000, 500000}};
+static metrics::Histogram s_send_time{
+  "roomba_stream_send_time_us",
+  "Time spent in the blocking WebSocket send of one frame",
+  {2000, 5000, 10000, 20000, 40000, 60000, 100000, 200000, 500000}};
+
+// the governor stretches this when the chip runs hot, 0 until then
+static std::atomic<uint32_t> s_frame_interval_us{0};
+
+auto set_stream_frame_interval_us(uint32_t interval_us) -> void {
+  s_frame_interval_us = interval_us;
+}
+
+auto stream_frames_sent() -> uint32_t {
+  return s_frames_sent.value();
+}
+
+static auto put_le(uint8_t*& cursor, uint64_t value, size_t bytes) -> void {
+  for (size_t i = 0; i < bytes; i++) {
+    *cursor++ = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
 
-constexpr auto max_buf_size_to_send = 16384;
-// constexpr auto prefered_loop_duration_us = 120 * 1000;  // ov5640
-constexpr auto prefered_loop_duration_us = 60 * 1000;  // ov2640
-auto camera_stream_task(void* arg) -> void {
-  auto* s_server = static_cast<httpd_handle_t>(arg);
+// written into the camera's headroom in front of the JPEG, so the frame goes out in one send without another copy
+static auto write_frame_header(const camera::JpegBuffer& frame) -> uint8_t* {
+  static_assert(frame_header_size <= camera::jpeg_headroom);
+  uint8_t* header = frame.buffer - frame_header_size;
+  uint8_t* cursor = header;
+  *cursor++ = static_cast<uint8_t>(PacketType::Frame);
+  *cursor++ = frame_version;
+  put_le(cursor, frame.sequence, sizeof(uint32_t));
+  put_le(cursor, frame.timestamp, sizeof(uint64_t));
+  put_le(cursor, frame.exposure, sizeof(uint16_t));
+  put_le(cursor, frame.gain, sizeof(uint16_t));
+  put_le(cursor, frame.tag, sizeof(uint64_t));
+  return header;
+}
+
+// the frame header (may be empty) and the JPEG, which aren't adjacent once the tables are left off
+using FrameParts = std::array<std::span<const uint8_t>, 2>;
+
+struct ChunkSource {
+  FrameParts parts;
+  size_t part;
+  size_t offset;
+  // set when the second chunk is filled, i.e. once the first one has been accepted by the socket
+  int64_t first_chunk_us;
+};
+
+static auto fill_chunk(uint8_t* chunk, size_t capacity, void* ctx) -> size_t {
+  auto& source = *static_cast<ChunkSource*>(ctx);
+  int64_t copy_start = esp_timer_get_time();
+  if ((source.part > 0 || source.offset > 0) && source.first_chunk_us == 0) {
+    source.first_chunk_us = copy_start;
+  }
+  size_t filled = 0;
+  while (filled < capacity && source.part < source.parts.size()) {
+    std::span<const uint8_t> part = source.parts[source.part];
+    size_t count = std::min(capacity - filled, part.size() - source.offset);
+    memcpy(chunk + filled, part.data() + source.offset, count);
+    filled += count;
+    source.offset += count;
+    if (source.offset == part.size()) {
+      source.part++;
+      source.offset = 0;
+    }
+  }
+  tracing::record(tracing::Span::StreamCopy, copy_start, esp_timer_get_time(), static_cast<uint32_t>(filled));
+  return filled;
+}
+
+// Credit mode only, blocks until the client has granted a frame. False if the stream stopped meanwhile.
+static auto wait_for_credit() -> bool {
+  if (s_credit.load() > 0) {
+    return true;
+  }
+  int64_t wait_start = esp_timer_get_time();
+  while (s_streaming && s_credit_mode && s_credit.load() <= 0) {
+    // the timeout only notices a stop or a switch back to push mode
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+  }
+  int64_t waited = esp_timer_get_time() - wait_start;
+  tracing::record(tracing::Span::CreditWait, wait_start, wait_start + waited);
+  s_credit_wait.observe(static_cast<uint32_t>(waited));
+  return s_streaming;
+}
+
+auto camera_stream_task(void* /*arg*/) -> void {
   ESP_LOGW(TAG, "Start Stream");
+  s_stream_task = xTaskGetCurrentTaskHandle();
+  // a failed setup is retried by the capture task, empty leases are skipped until it has a frame
+  if (!boot_wait({BootStage::Camera}, pdMS_TO_TICKS(camera_boot_timeout_ms))) {
+    ESP_LOGW(
+      TAG, "Camera not ready after %" PRIu32 " ms, streaming whatever it captures later", camera_boot_timeout_ms);
+  }
 
   // Pre-allocate the frame structure outside the loop
   static httpd_ws_frame_t ws_pkt = {
@@ -34,7 +206,15 @@ auto camera_stream_task(void* arg) -> void {
     .payload = nullptr,            // Will update this per frame
     .len = 0,                      // Will update this per frame
   };
-  uint32_t prev_timestamp = 0;
+  uint32_t prev_sequence = 0;
+  // internal RAM, so lwIP copies out of fast memory instead of PSRAM
+  std::span<uint8_t> chunk_staging{
+    static_cast<uint8_t*>(heap_caps_malloc(stream_chunk_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)),
+    stream_chunk_size};
+  if (chunk_staging.data() == nullptr) {
+    ESP_LOGW(TAG, "No internal RAM for chunked sends, frames go out whole");
+    chunk_staging = {};
+  }
   uint64_t end_of_loop_time = esp_timer_get_time();
   uint64_t last_loop_time = esp_timer_get_time();
   while (true) {
@@ -47,45 +227,101 @@ auto camera_stream_task(void* arg) -> void {
       continue;
     }
 
-    if (heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < max_buf_size_to_send) {
+    StreamFlags flags = load_stream_flags();
+    // copied after the credit arrives, so the client always gets the newest frame
+    if (flags.credit && !wait_for_credit()) {
+      continue;
+    }
+
+    const camera::SensorProfile& profile = camera::active_sensor_profile();
+    if (heap_caps_get_free_size(MALLOC_CAP_INTERNAL) < profile.send_reserve_bytes) {
       ESP_LOGW(TAG, "Low memory, skipping frame");
+      s_frames_skipped.increment();
       vTaskDelay(pdMS_TO_TICKS(10));
       continue;
     }
 
-    auto jpeg_buffer = camera::copy_jpeg_buffer();
+    camera::FrameLease lease = camera::lease_latest_frame();
+    const camera::JpegBuffer& jpeg_buffer = lease.frame;
+    if (lease.slot < 0) {
+      // camera is still waking up, nothing captured yet
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
     if (
       jpeg_buffer.buffer == nullptr || jpeg_buffer.len < 2 || jpeg_buffer.buffer[0] != camera::JPEG_SOI_MARKER_FIRST ||
       jpeg_buffer.buffer[1] != camera::JPEG_SOI_MARKER_SECOND) {
       ESP_LOGW(TAG, "Invalid JPEG data");
+      camera::release_frame(lease);
+      s_frames_skipped.increment();
       vTaskDelay(pdMS_TO_TICKS(1000));
       continue;
     }
-    if (jpeg_buffer.timestamp == prev_timestamp) {
+    if (jpeg_buffer.sequence == prev_sequence) {
       // Make sure we don't delay for 0
       ESP_LOGW(TAG, "Duplicate JPEG data");
+      camera::release_frame(lease);
+      s_duplicate_frames.increment();
+      tracing::ScopedSpan span{tracing::Span::DuplicateWait};
       vTaskDelay(pdMS_TO_TICKS(1));
       continue;
     }
-    prev_timestamp = jpeg_buffer.timestamp;
+    prev_sequence = jpeg_buffer.sequence;
 
-    // Prepare a WS frame
-    ws_pkt.payload = jpeg_buffer.buffer;
-    ws_pkt.len = jpeg_buffer.len;
+    // Prepare a WS frame, straight out of the leased slot
+    size_t tables_len = flags.tables ? strip_jpeg_tables(s_ws_fd, jpeg_buffer) : 0;
+    FrameParts parts{};
+    if (flags.header) {
+      parts[0] = {write_frame_header(jpeg_buffer), frame_header_size};
+    }
+    parts[1] = {jpeg_buffer.buffer + tables_len, jpeg_buffer.len - tables_len};
+    // the header sits in the headroom right in front of a whole JPEG
+    bool contiguous = tables_len == 0 || parts[0].empty();
+    ws_pkt.payload = const_cast<uint8_t*>(parts[0].empty() ? parts[1].data() : parts[0].data());
+    ws_pkt.len = parts[0].size() + parts[1].size();
     // ESP_LOGI(TAG, "JPEG length: %zu bytes", ws_pkt.len);
 
     // Send asynchronously
     // esp_err_t err = httpd_ws_send_frame_async(s_server, s_ws_fd, &ws_pkt);
     // send sync and block, seems to work better with no need to worry about backign up the queue
     uint64_t send_start = esp_timer_get_time();
-    esp_err_t err = httpd_ws_send_data(s_server, s_ws_fd, &ws_pkt);
+    heap_caps_monitor_local_minimum_free_size_start();
+    esp_err_t err = ESP_OK;
+    int64_t first_chunk_us = 0;
+    if (flags.chunked && !chunk_staging.empty()) {
+      ChunkSource source{.parts = parts, .part = 0, .offset = 0, .first_chunk_us = 0};
+      err = ws_send_binary_chunked(s_ws_fd, ws_pkt.len, chunk_staging, fill_chunk, &source);
+      first_chunk_us = source.first_chunk_us;
+    } else if (contiguous) {
+      err = ws_send(s_ws_fd, ws_pkt);
+    } else {
+      err = ws_send_binary_parts(s_ws_fd, parts);
+    }
     uint64_t send_time = esp_timer_get_time() - send_start;
+    s_send_internal_min_free.set(static_cast<int32_t>(heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL)));
+    heap_caps_monitor_local_minimum_free_size_stop();
+    camera::release_frame(lease);
+    // a single fragment or a monolithic send is only accepted as a whole
+    s_first_chunk.observe(static_cast<uint32_t>(first_chunk_us > 0 ? first_chunk_us - send_start : send_time));
+    tracing::record(tracing::Span::Send, send_start, send_start + send_time, ws_pkt.len);
+    s_send_time.observe(static_cast<uint32_t>(send_time));
+    wifi::WifiManager::instance().record_send_result(err == ESP_OK, ws_pkt.len);
+    if (err == ESP_OK) {
+      if (flags.credit) {
+        s_credit.fetch_sub(1);
+      }
+      s_frames_sent.increment();
+      s_bytes_sent.increment(ws_pkt.len);
+    } else {
+      s_send_failures.increment();
+    }
     if (send_time > 100000) {  // Log if send takes >100ms
       ESP_LOGW(TAG, "Long send time: %llu us", send_time);
     }
     // try to level out how often the frame is sent
     uint64_t new_time = esp_timer_get_time();
     auto elapsed_us = new_time - end_of_loop_time;
+    uint32_t prefered_loop_duration_us = std::max(s_frame_interval_us.load(), profile.frame_interval_us);
     // Use microsecond precision by working in micros until the last moment
     if (elapsed_us < prefered_loop_duration_us) {
       int delay_us = prefered_loop_duration_us - elapsed_us;
@@ -99,6 +335,7 @@ auto camera_stream_task(void* arg) -> void {
     }
 
     end_of_loop_time = esp_timer_get_time();
+    tracing::record(tracing::Span::Pace, new_time, end_of_loop_time);
 
     if (err != ESP_OK) {
       // Typically means the client disconnected or send error
@@ -112,23 +349,271 @@ auto camera_stream_task(void* arg) -> void {
 }
 
 
-auto handle_text_message(httpd_ws_frame_t& ws_pkt, uint8_t* buf, int fd) -> void {
-  if (strcmp((char*)buf, "start") == 0) {
-    ESP_LOGI(TAG, "Received 'start' => begin streaming");
-    s_streaming = true;
-    s_ws_fd = fd;  // store the single client's socket
+struct TextCommand {
+  std::string_view name;
+  TextCommandHandler handler;
+};
+
+// only called from the httpd task
+static auto update_link_profile() -> void {
+  wifi::LinkProfile profile = s_idle_profile;
+  if (s_profile_override) {
+    profile = *s_profile_override;
+  } else if (s_streaming) {
+    profile = wifi::LinkProfile::Throughput;
+  } else if (std::ranges::any_of(s_ws_clients, [](int fd) { return fd >= 0; })) {
+    profile = wifi::LinkProfile::Latency;
+  }
+  if (profile != wifi::active_link_profile()) {
+    [[maybe_unused]] auto result = wifi::apply_link_profile(profile);
+  }
+}
+
+static auto stop_streaming() -> void {
+  s_streaming = false;
+  s_ws_fd = -1;
+  if (s_holds_camera) {
+    s_holds_camera = false;
+    camera::release();
+  }
+}
+
+// "start [header] [credit] [chunked] [tables]"
+static auto start_command(int fd, std::string_view args) -> void {
+  ESP_LOGI(TAG, "Received 'start' => begin streaming");
+  bool header = false;
+  bool credit = false;
+  bool chunked = false;
+  bool tables = false;
+  while (!args.empty()) {
+    auto split = args.find(' ');
+    std::string_view flag = args.substr(0, split);
+    header = header || flag == "header";
+    credit = credit || flag == "credit";
+    chunked = chunked || flag == "chunked";
+    tables = tables || flag == "tables";
+    args = split == std::string_view::npos ? std::string_view{} : args.substr(split + 1);
+  }
+  s_frame_header = header;
+  s_chunked = chunked;
+  reset_jpeg_tables();
+  s_jpeg_tables = tables;
+  s_credit = initial_stream_credit;
+  s_credit_mode = credit;
+  if (!s_holds_camera) {
+    s_holds_camera = true;
+    camera::acquire();
+  }
+  if (s_ws_fd >= 0 && s_ws_fd != fd) {
+    set_traffic_class(s_ws_fd, TrafficClass::Voice);
+  }
+  set_traffic_class(fd, TrafficClass::Video);
+  s_streaming = true;
+  s_ws_fd = fd;  // store the single client's socket
+  update_link_profile();
+}
+
+static auto stop_command(int /*fd*/, std::string_view /*args*/) -> void {
+  ESP_LOGI(TAG, "Received 'stop' => stop streaming");
+  int stream_fd = s_ws_fd;
+  stop_streaming();
+  if (stream_fd >= 0) {
+    set_traffic_class(stream_fd, TrafficClass::Voice);
+  }
+  update_link_profile();
+}
+
+// "qos on" | "qos off" | "qos", toggles WMM tagging on the open sockets and replies with the current state
+static auto qos_command(int fd, std::string_view args) -> void {
+  if (args == "on" || args == "off") {
+    set_traffic_tagging(args == "on");
+    for (int client : s_ws_clients) {
+      if (client >= 0) {
+        set_traffic_class(client, s_streaming && client == s_ws_fd ? TrafficClass::Video : TrafficClass::Voice);
+      }
+    }
+  }
+  const char* reply = traffic_tagging() ? "qos on" : "qos off";
+  ws_send_text(fd, reply, strlen(reply));
+}
+
+// "credit <n>": grants the stream n more frames, usually one per frame the client has finished decoding
+static auto credit_command(int /*fd*/, std::string_view args) -> void {
+  int32_t grant = 0;
+  auto [end, error] = std::from_chars(args.data(), args.data() + args.size(), grant);
+  if (error != std::errc{} || grant <= 0) {
+    ESP_LOGW(TAG, "Bad credit grant: %.*s", static_cast<int>(args.size()), args.data());
+    return;
+  }
+  int32_t credit = s_credit.load();
+  while (!s_credit.compare_exchange_weak(credit, std::min(credit + grant, max_stream_credit))) {
+  }
+  TaskHandle_t stream_task = s_stream_task.load();
+  if (stream_task != nullptr) {
+    xTaskNotifyGive(stream_task);
+  }
+}
+
+// keepalive from the client, the round trip also measures command latency under the current link profile
+static auto ping_command(int fd, std::string_view /*args*/) -> void {
+  ws_send_text(fd, "pong", 4);
+}
+
+// "profile latency" | "profile throughput" | "profile power" | "profile auto"
+static auto profile_command(int /*fd*/, std::string_view args) -> void {
+  if (args == "latency") {
+    s_profile_override = wifi::LinkProfile::Latency;
+  } else if (args == "throughput") {
+    s_profile_override = wifi::LinkProfile::Throughput;
+  } else if (args == "power") {
+    s_profile_override = wifi::LinkProfile::PowerSaver;
+  } else if (args == "auto") {
+    s_profile_override.reset();
+  } else {
+    ESP_LOGW(TAG, "Unknown profile: %.*s", static_cast<int>(args.size()), args.data());
+    return;
+  }
+  update_link_profile();
+}
+
+// "full" | "lower" | "<x> <y> <width> <height>" in output pixels
+static auto parse_roi(std::string_view args) -> std::optional<std::optional<camera::Roi>> {
+  camera::Roi full = camera::full_view();
+  if (args == "full") {
+    return std::optional<camera::Roi>{};
+  }
+  if (args == "lower") {
+    // the floor in front of the robot
+    auto half = static_cast<uint16_t>(full.height / 2);
+    return camera::Roi{0, half, full.width, half};
+  }
+  std::array<uint16_t, 4> values{};
+  const char* cursor = args.data();
+  const char* end = args.data() + args.size();
+  for (uint16_t& value : values) {
+    while (cursor < end && *cursor == ' ') {
+      cursor++;
+    }
+    auto [next, error] = std::from_chars(cursor, end, value);
+    if (error != std::errc{}) {
+      return std::nullopt;
+    }
+    cursor = next;
+  }
+  return camera::Roi{values[0], values[1], values[2], values[3]};
+}
+
+// "camera idle standby" | "camera idle off", what the sensor does while nobody is streaming
+// "camera roi full" | "camera roi lower" | "camera roi <x> <y> <width> <height>", the part of the view that is sent
+static auto camera_command(int /*fd*/, std::string_view args) -> void {
+  if (args.starts_with("roi ")) {
+    auto roi = parse_roi(args.substr(4));
+    esp_err_t err = roi ? camera::set_roi(*roi) : ESP_ERR_INVALID_ARG;
+    if (err != ESP_OK) {
+      ESP_LOGW(
+        TAG,
+        "Failed to set the region of interest %.*s: %s",
+        static_cast<int>(args.size() - 4),
+        args.data() + 4,
+        esp_err_to_name(err));
+    }
     return;
   }
-  if (strcmp((char*)buf, "stop") == 0) {
-    ESP_LOGI(TAG, "Received 'stop' => stop streaming");
-    s_streaming = false;
-    s_ws_fd = -1;
+  if (args == "idle standby") {
+    camera::set_idle_mode(camera::IdleMode::Standby);
     return;
   }
+  if (args == "idle off") {
+    camera::set_idle_mode(camera::IdleMode::Off);
+    return;
+  }
+  ESP_LOGW(TAG, "Unknown camera command: %.*s", static_cast<int>(args.size()), args.data());
+}
+
+// "record start" | "record stop" | "record status", replies with the recorder status as json
+static auto record_command(int fd, std::string_view args) -> void {
+  if (args == "start") {
+    if (recorder::start() != ESP_OK) {
+      ESP_LOGW(TAG, "Recorder not ready");
+    }
+  } else if (args == "stop") {
+    recorder::stop();
+  } else if (args != "status") {
+    ESP_LOGW(TAG, "Unknown record command: %.*s", static_cast<int>(args.size()), args.data());
+    return;
+  }
+  std::string status;
+  recorder::render_status_json(status);
+  ws_send_text(fd, status.data(), status.size());
+}
+
+constexpr size_t max_text_commands = 24;
+static std::array<TextCommand, max_text_commands> s_text_commands{{
+  {"start", start_command},
+  {"stop", stop_command},
+  {"camera", camera_command},
+  {"ping", ping_command},
+  {"profile", profile_command},
+  {"qos", qos_command},
+  {"record", record_command},
+  {"credit", credit_command},
+}};
+static size_t s_text_command_count = 8;
+
+auto register_text_command(std::string_view name, TextCommandHandler handler) -> void {
+  if (s_text_command_count >= max_text_commands) {
+    ESP_LOGE(TAG, "Too many text commands, dropping %.*s", static_cast<int>(name.size()), name.data());
+    return;
+  }
+  s_text_commands[s_text_command_count++] = TextCommand{name, handler};
+}
+
+auto handle_text_message(httpd_ws_frame_t& ws_pkt, uint8_t* buf, int fd) -> void {
+  // buf is null terminated by the ws handler
+  std::string_view message{reinterpret_cast<const char*>(buf), strnlen(reinterpret_cast<const char*>(buf), ws_pkt.len)};
+  auto split = message.find(' ');
+  std::string_view name = message.substr(0, split);
+  std::string_view args = split == std::string_view::npos ? std::string_view{} : message.substr(split + 1);
+
+  for (size_t i = 0; i < s_text_command_count; i++) {
+    if (s_text_commands[i].name == name) {
+      s_text_commands[i].handler(fd, args);
+      return;
+    }
+  }
 
   ESP_LOGI(TAG, "Received unknown msg: %s", buf);
 }
 
+auto set_idle_link_profile(wifi::LinkProfile profile) -> void {
+  s_idle_profile = profile;
+  update_link_profile();
+}
+
+auto handle_ws_open(int fd) -> void {
+  for (int& client : s_ws_clients) {
+    if (client < 0) {
+      client = fd;
+      break;
+    }
+  }
+  update_link_profile();
+}
+
+auto handle_ws_close(int fd) -> void {
+  if (s_ws_fd == fd) {
+    ESP_LOGI(TAG, "Streaming client went away => stop streaming");
+    stop_streaming();
+  }
+  telemetry_unsubscribe(fd);
+  clock_sync_unsubscribe(fd);
+  auto client = std::ranges::find(s_ws_clients, fd);
+  if (client != s_ws_clients.end()) {
+    *client = -1;
+    update_link_profile();
+  }
+}
+
 auto handle_binary_message(httpd_ws_frame_t& ws_pkt, uint8_t* buf, int fd) -> void {
   if (ws_pkt.len != MotorCommand::data_size) {
     ESP_LOGW(TAG, "Invalid binary packet size: %d", ws_pkt.len);
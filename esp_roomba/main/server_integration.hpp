@@ -1,7 +1,23 @@
 #pragma once
 
+#include <cstdint>
+#include <string_view>
+
+#include "link_profile.hpp"
 #include "new_socket_server.hpp"
 
 auto camera_stream_task(void* arg) -> void;
+// Minimum time between two streamed frames, never shorter than the sensor profile's.
+auto set_stream_frame_interval_us(uint32_t interval_us) -> void;
+// Frames successfully sent since boot.
+[[nodiscard]] auto stream_frames_sent() -> uint32_t;
 auto handle_binary_message(httpd_ws_frame_t& ws_pkt, uint8_t* buf, int fd) -> void;
 auto handle_text_message(httpd_ws_frame_t& ws_pkt, uint8_t* buf, int fd) -> void;
+auto handle_ws_open(int fd) -> void;
+auto handle_ws_close(int fd) -> void;
+// Link profile used while no WebSocket client is connected, defaults to the power saver.
+auto set_idle_link_profile(wifi::LinkProfile profile) -> void;
+
+// Text messages are dispatched on their first word, the rest of the message is passed as args.
+using TextCommandHandler = void (*)(int fd, std::string_view args);
+auto register_text_command(std::string_view name, TextCommandHandler handler) -> void;
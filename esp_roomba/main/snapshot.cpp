@@ -0,0 +1,144 @@
+#include "snapshot.hpp"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cinttypes>
+#include <cstdio>
+#include <span>
+
+#include "camera.hpp"
+#include "new_socket_server.hpp"
+#include "protocol.hpp"
+#include "server_integration.hpp"
+
+static const char* TAG = "snapshot";
+
+constexpr uint32_t send_stack_size = 4096;
+constexpr UBaseType_t send_priority = 2;
+// small enough that a stream frame never waits long behind a part for the send lock
+constexpr size_t snapshot_part_size = 16 * 1024;
+// a little better than streaming quality, UXGA at this still fits the driver's frame buffers
+constexpr int default_snapshot_quality = 6;
+
+// the client the pending snapshot goes to, -1 when idle
+static std::atomic<int> s_snapshot_fd{-1};
+// handed from the capture task to the send task
+static camera::Snapshot s_snapshot{};
+static std::array<uint8_t, snapshot_header_size> s_part_header{};
+
+static auto put_le(uint8_t*& cursor, uint64_t value, size_t bytes) -> void {
+  for (size_t i = 0; i < bytes; i++) {
+    *cursor++ = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+static auto send_parts(int fd, const camera::Snapshot& snapshot) -> bool {
+  for (size_t offset = 0; offset < snapshot.len; offset += snapshot_part_size) {
+    size_t len = std::min(snapshot_part_size, snapshot.len - offset);
+    uint8_t* cursor = s_part_header.data();
+    *cursor++ = static_cast<uint8_t>(PacketType::Snapshot);
+    *cursor++ = snapshot_version;
+    put_le(cursor, offset, sizeof(uint32_t));
+    put_le(cursor, snapshot.len, sizeof(uint32_t));
+    put_le(cursor, snapshot.width, sizeof(uint16_t));
+    put_le(cursor, snapshot.height, sizeof(uint16_t));
+    put_le(cursor, snapshot.stream_gap_us, sizeof(uint32_t));
+    put_le(cursor, static_cast<uint64_t>(snapshot.timestamp), sizeof(int64_t));
+    std::array<std::span<const uint8_t>, 2> parts{
+      std::span<const uint8_t>{s_part_header}, std::span<const uint8_t>{snapshot.buffer + offset, len}};
+    if (server::ws_send_binary_parts(fd, parts) != ESP_OK) {
+      return false;
+    }
+    // lets the stream task take the send lock between parts
+    vTaskDelay(1);
+  }
+  return true;
+}
+
+static auto reply(int fd, const camera::Snapshot& snapshot, bool sent) -> void {
+  if (!sent) {
+    server::ws_send_text(fd, "snapshot failed", 15);
+    return;
+  }
+  std::array<char, 128> line{};
+  int len = snprintf(
+    line.data(),
+    line.size(),
+    "snapshot {\"width\":%u,\"height\":%u,\"bytes\":%u,\"timestamp_us\":%" PRId64 ",\"gap_us\":%" PRIu32 "}",
+    snapshot.width,
+    snapshot.height,
+    static_cast<unsigned>(snapshot.len),
+    snapshot.timestamp,
+    snapshot.stream_gap_us);
+  if (len > 0) {
+    server::ws_send_text(fd, line.data(), std::min(static_cast<size_t>(len), line.size() - 1));
+  }
+}
+
+// a few hundred KB would hold up the capture task, so the still gets its own short lived task
+static auto send_task(void* /*arg*/) -> void {
+  int fd = s_snapshot_fd.load();
+  bool sent = send_parts(fd, s_snapshot);
+  if (!sent) {
+    ESP_LOGW(TAG, "Snapshot send to fd=%d failed", fd);
+  }
+  reply(fd, s_snapshot, sent);
+  heap_caps_free(s_snapshot.buffer);
+  s_snapshot = camera::Snapshot{};
+  s_snapshot_fd = -1;
+  vTaskDelete(nullptr);
+}
+
+// capture task
+static auto on_snapshot(const camera::Snapshot& snapshot) -> void {
+  ESP_LOGI(TAG, "Snapshot taken, stream gap %" PRIu32 " us", snapshot.stream_gap_us);
+  s_snapshot = snapshot;
+  if (snapshot.buffer == nullptr) {
+    reply(s_snapshot_fd.load(), snapshot, false);
+    s_snapshot_fd = -1;
+    return;
+  }
+  BaseType_t created =
+    xTaskCreatePinnedToCore(send_task, "snapshot_send", send_stack_size, nullptr, send_priority, nullptr, 0);
+  if (created != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create snapshot send task");
+    reply(s_snapshot_fd.load(), snapshot, false);
+    heap_caps_free(s_snapshot.buffer);
+    s_snapshot = camera::Snapshot{};
+    s_snapshot_fd = -1;
+  }
+}
+
+// "snapshot [quality]"
+static auto snapshot_command(int fd, std::string_view args) -> void {
+  int quality = default_snapshot_quality;
+  if (!args.empty()) {
+    auto [end, error] = std::from_chars(args.data(), args.data() + args.size(), quality);
+    if (error != std::errc{}) {
+      ESP_LOGW(TAG, "Bad snapshot quality: %.*s", static_cast<int>(args.size()), args.data());
+      return;
+    }
+  }
+  int idle = -1;
+  if (!s_snapshot_fd.compare_exchange_strong(idle, fd)) {
+    server::ws_send_text(fd, "snapshot busy", 13);
+    return;
+  }
+  esp_err_t err = camera::request_snapshot(quality, on_snapshot);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Snapshot request failed: %s", esp_err_to_name(err));
+    server::ws_send_text(fd, "snapshot busy", 13);
+    s_snapshot_fd = -1;
+  }
+}
+
+auto init_snapshots() -> void {
+  register_text_command("snapshot", snapshot_command);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Registers the "snapshot" ws command, call before starting the webserver.
+//
+// The still is taken by the capture task between two stream frames and sent back as PacketType::Snapshot parts from a
+// short lived task, so stream frames go out between the parts.
+auto init_snapshots() -> void;
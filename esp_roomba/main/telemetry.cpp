@@ -0,0 +1,234 @@
+#include "telemetry.hpp"
+
+#include <esp_heap_caps.h>
+#include <esp_http_server.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+
+#include <array>
+#include <atomic>
+#include <string>
+
+#include "espnow_control.hpp"
+#include "frame_copy.hpp"
+#include "metrics.hpp"
+#include "new_socket_server.hpp"
+#include "protocol.hpp"
+#include "server_integration.hpp"
+#include "task_profiler.hpp"
+#include "tracing.hpp"
+
+static const char* TAG = "telemetry";
+
+static metrics::Gauge s_free_heap{"roomba_heap_free_bytes", "Free heap across all capabilities"};
+static metrics::Gauge s_free_internal{"roomba_heap_internal_free_bytes", "Free internal RAM"};
+static metrics::Gauge s_min_free_internal{
+  "roomba_heap_internal_min_free_bytes", "Lowest free internal RAM since boot"};
+static metrics::Gauge s_free_psram{"roomba_heap_psram_free_bytes", "Free PSRAM"};
+static metrics::Gauge s_wifi_rssi{"roomba_wifi_rssi_dbm", "RSSI of the associated access point, 0 when not a station"};
+static metrics::Gauge s_uptime{"roomba_uptime_seconds", "Seconds since boot"};
+static metrics::Gauge s_espnow_active{
+  "roomba_espnow_active", "1 while the ESP-NOW dongle is sending motor commands within the deadman timeout"};
+
+constexpr size_t max_subscribers = 2;
+static std::array<std::atomic<int>, max_subscribers> s_subscribers{{-1, -1}};
+
+// u8 packet type, u8 version, u64 device time in us, then the metrics::encode_binary body
+constexpr size_t telemetry_header_size = 2 + sizeof(uint64_t);
+// fits metrics::max_metrics, mostly 6 byte counters and gauges plus the histograms
+static std::array<uint8_t, 2048> s_telemetry_buffer{};
+
+static auto sample_gauges() -> void {
+  s_free_heap.set(static_cast<int32_t>(esp_get_free_heap_size()));
+  s_free_internal.set(static_cast<int32_t>(heap_caps_get_free_size(MALLOC_CAP_INTERNAL)));
+  s_min_free_internal.set(static_cast<int32_t>(heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL)));
+  s_free_psram.set(static_cast<int32_t>(heap_caps_get_free_size(MALLOC_CAP_SPIRAM)));
+  s_uptime.set(static_cast<int32_t>(esp_timer_get_time() / 1000000));
+  s_espnow_active.set(espnow_control_active() ? 1 : 0);
+
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+    s_wifi_rssi.set(ap_info.rssi);
+  } else {
+    s_wifi_rssi.set(0);
+  }
+}
+
+static auto metrics_get_handler(httpd_req_t* req) -> esp_err_t {
+  sample_gauges();
+  std::string body;
+  body.reserve(4096);
+  metrics::render_prometheus(body);
+  httpd_resp_set_type(req, "text/plain; version=0.0.4");
+  return httpd_resp_send(req, body.data(), static_cast<ssize_t>(body.size()));
+}
+
+static auto schema_get_handler(httpd_req_t* req) -> esp_err_t {
+  std::string body;
+  body.reserve(2048);
+  metrics::render_schema_json(body);
+  httpd_resp_set_type(req, "application/json");
+  return httpd_resp_send(req, body.data(), static_cast<ssize_t>(body.size()));
+}
+
+static auto tasks_get_handler(httpd_req_t* req) -> esp_err_t {
+  std::string body;
+  body.reserve(4096);
+  render_task_profiles_json(body);
+  httpd_resp_set_type(req, "application/json");
+  return httpd_resp_send(req, body.data(), static_cast<ssize_t>(body.size()));
+}
+
+static auto trace_get_handler(httpd_req_t* req) -> esp_err_t {
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"roomba_trace.json\"");
+  tracing::dump_chrome_json(
+    [](const char* data, size_t len, void* ctx) {
+      httpd_resp_send_chunk(static_cast<httpd_req_t*>(ctx), data, static_cast<ssize_t>(len));
+    },
+    req);
+  return httpd_resp_send_chunk(req, nullptr, 0);
+}
+
+static auto subscribe(int fd) -> bool {
+  for (auto& subscriber : s_subscribers) {
+    if (subscriber.load() == fd) {
+      return true;
+    }
+  }
+  for (auto& subscriber : s_subscribers) {
+    int expected = -1;
+    if (subscriber.compare_exchange_strong(expected, fd)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+auto telemetry_unsubscribe(int fd) -> void {
+  for (auto& subscriber : s_subscribers) {
+    int expected = fd;
+    subscriber.compare_exchange_strong(expected, -1);
+  }
+}
+
+// "telemetry start" | "telemetry stop" | "telemetry schema"
+static auto telemetry_command(int fd, std::string_view args) -> void {
+  if (args == "start") {
+    if (!subscribe(fd)) {
+      ESP_LOGW(TAG, "No free telemetry slot for fd=%d", fd);
+      server::ws_send_text(fd, "telemetry busy", 14);
+    }
+    return;
+  }
+  if (args == "stop") {
+    telemetry_unsubscribe(fd);
+    return;
+  }
+  if (args == "schema") {
+    std::string schema;
+    schema.reserve(2048);
+    metrics::render_schema_json(schema);
+    server::ws_send_text(fd, schema.data(), schema.size());
+    return;
+  }
+  ESP_LOGW(TAG, "Unknown telemetry command: %.*s", static_cast<int>(args.size()), args.data());
+}
+
+// "tasks", replies with the latest per task cpu and stack sample as json
+static auto tasks_command(int fd, std::string_view /*args*/) -> void {
+  std::string body;
+  body.reserve(4096);
+  render_task_profiles_json(body);
+  server::ws_send_text(fd, body.data(), body.size());
+}
+
+// "trace on" | "trace off" | "trace dump", the dump is Chrome trace-event json for ui.perfetto.dev
+static auto trace_command(int fd, std::string_view args) -> void {
+  if (args == "on" || args == "off") {
+    tracing::set_enabled(args == "on");
+    return;
+  }
+  if (args == "dump") {
+    // large enough to land in PSRAM
+    std::string body;
+    body.reserve(64 * 1024);
+    tracing::dump_chrome_json(
+      [](const char* data, size_t len, void* ctx) { static_cast<std::string*>(ctx)->append(data, len); }, &body);
+    server::ws_send_text(fd, body.data(), body.size());
+    return;
+  }
+  ESP_LOGW(TAG, "Unknown trace command: %.*s", static_cast<int>(args.size()), args.data());
+}
+
+// "bench metrics" | "bench copy"
+static auto bench_command(int /*fd*/, std::string_view args) -> void {
+  if (args == "metrics") {
+    metrics::run_benchmark();
+  } else if (args == "copy") {
+    camera::run_frame_copy_benchmark();
+  }
+}
+
+static auto add_get_handler(const char* uri, esp_err_t (*handler)(httpd_req_t*)) -> void {
+  server::add_uri_handler(httpd_uri_t{
+    .uri = uri,
+    .method = HTTP_GET,
+    .handler = handler,
+    .user_ctx = nullptr,
+    .is_websocket = false,
+    .handle_ws_control_frames = false,
+    .supported_subprotocol = nullptr});
+}
+
+auto init_telemetry() -> void {
+  add_get_handler("/metrics", metrics_get_handler);
+  add_get_handler("/metrics/schema", schema_get_handler);
+  add_get_handler("/tasks", tasks_get_handler);
+  add_get_handler("/trace", trace_get_handler);
+
+  register_text_command("telemetry", telemetry_command);
+  register_text_command("tasks", tasks_command);
+  register_text_command("trace", trace_command);
+  register_text_command("bench", bench_command);
+}
+
+auto publish_telemetry() -> void {
+  sample_gauges();
+  sample_task_profiles();
+
+  bool any_subscriber = false;
+  for (const auto& subscriber : s_subscribers) {
+    any_subscriber = any_subscriber || subscriber.load() >= 0;
+  }
+  if (!any_subscriber) {
+    return;
+  }
+
+  uint8_t* cursor = s_telemetry_buffer.data();
+  *cursor++ = static_cast<uint8_t>(PacketType::Telemetry);
+  *cursor++ = telemetry_version;
+  auto now = static_cast<uint64_t>(esp_timer_get_time());
+  for (size_t i = 0; i < sizeof(now); i++) {
+    *cursor++ = static_cast<uint8_t>(now >> (8 * i));
+  }
+
+  size_t body_len = metrics::encode_binary(cursor, s_telemetry_buffer.size() - telemetry_header_size);
+  if (body_len == 0) {
+    ESP_LOGE(TAG, "Telemetry buffer too small");
+    return;
+  }
+
+  for (auto& subscriber : s_subscribers) {
+    int fd = subscriber.load();
+    if (fd < 0) {
+      continue;
+    }
+    if (server::ws_send_binary(fd, s_telemetry_buffer.data(), telemetry_header_size + body_len) != ESP_OK) {
+      ESP_LOGW(TAG, "Telemetry send failed, unsubscribing fd=%d", fd);
+      telemetry_unsubscribe(fd);
+    }
+  }
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Registers the /metrics endpoint and the telemetry ws commands, call before starting the webserver.
+auto init_telemetry() -> void;
+// Samples the system gauges and pushes a binary snapshot to every subscribed client.
+auto publish_telemetry() -> void;
+auto telemetry_unsubscribe(int fd) -> void;
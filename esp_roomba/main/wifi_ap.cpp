@@ -2,15 +2,202 @@
 
 #include <esp_log.h>
 #include <esp_mac.h>
+#include <esp_timer.h>
 #include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <string>
+#include <vector>
+
+#include "metrics.hpp"
+#include "new_socket_server.hpp"
+#include "server_integration.hpp"
 
 #define WIFI_AP_SSID "ESP-AP"
 #define WIFI_AP_PASS "myapp1234"
 #define MAX_CONNECTIONS 1
 constexpr uint16_t beacon_interval = 100;
 
+static const char* TAG = "wifi_ap";
+
+// channels allowed by the "CA" country code
+constexpr uint8_t max_channel = 11;
+constexpr uint8_t default_channel = 1;
+// only while no station is connected, scanning takes the radio off channel
+constexpr uint32_t channel_review_interval_ms = 10 * 60 * 1000;
+// a new channel has to beat the current score by this much, moving kicks off power saving clients
+constexpr float channel_switch_margin = 1.0F;
+
+struct ChannelStats {
+  float score;          // lower is quieter
+  uint32_t frames;      // streamed while the AP was on this channel
+  int64_t time_us;      // time the AP spent on this channel
+};
+
+// index is the channel number, 0 is unused
+static std::array<ChannelStats, max_channel + 1> s_channels{};
+static uint8_t s_channel = default_channel;
+static int64_t s_channel_since_us = 0;
+static uint32_t s_frames_at_switch = 0;
+
+static metrics::Gauge s_channel_gauge{"roomba_ap_channel", "Channel the soft-AP runs on"};
+static metrics::Counter s_channel_switches{"roomba_ap_channel_switches_total", "Channel moves after a review scan"};
+
+// share of a 20 MHz channel's energy that lands n channels away
+static constexpr std::array<float, 5> channel_overlap = {1.0F, 0.7F, 0.4F, 0.2F, 0.05F};
+
+static auto overlap(int a, int b) -> float {
+  auto distance = static_cast<size_t>(std::abs(a - b));
+  return distance < channel_overlap.size() ? channel_overlap[distance] : 0.0F;
+}
+
+// every AP counts, louder ones count more, -95 dBm adds next to nothing and -50 dBm counts fully
+static auto rssi_weight(int8_t rssi) -> float {
+  float weight = (static_cast<float>(rssi) + 95.0F) / 45.0F;
+  return 0.25F + std::clamp(weight, 0.0F, 1.0F);
+}
+
+// Needs STA or APSTA mode. Blocks for roughly a second while every channel is scanned.
+static auto score_channels() -> bool {
+  wifi_scan_config_t scan_config = {};
+  scan_config.show_hidden = true;
+  if (esp_wifi_scan_start(&scan_config, true) != ESP_OK) {
+    ESP_LOGE(TAG, "Channel scan failed");
+    return false;
+  }
+
+  uint16_t count = 0;
+  esp_wifi_scan_get_ap_num(&count);
+  std::vector<wifi_ap_record_t> records(count);
+  if (count > 0 && esp_wifi_scan_get_ap_records(&count, records.data()) != ESP_OK) {
+    esp_wifi_clear_ap_list();
+    return false;
+  }
+
+  for (uint8_t channel = 1; channel <= max_channel; channel++) {
+    float score = 0.0F;
+    for (const auto& record : records) {
+      float weight = rssi_weight(record.rssi);
+      score += overlap(channel, record.primary) * weight;
+      // HT40 neighbours also occupy their secondary channel
+      if (record.second == WIFI_SECOND_CHAN_ABOVE) {
+        score += overlap(channel, record.primary + 4) * weight;
+      } else if (record.second == WIFI_SECOND_CHAN_BELOW) {
+        score += overlap(channel, record.primary - 4) * weight;
+      }
+    }
+    s_channels[channel].score = score;
+  }
+  ESP_LOGI(TAG, "Scored channels from %u APs", static_cast<unsigned>(count));
+  return true;
+}
+
+static auto quietest_channel() -> uint8_t {
+  uint8_t best = default_channel;
+  for (uint8_t channel = 1; channel <= max_channel; channel++) {
+    if (s_channels[channel].score < s_channels[best].score) {
+      best = channel;
+    }
+  }
+  return best;
+}
+
+// charges the frames streamed since the last switch to the channel we are leaving
+static auto account_channel_time() -> void {
+  int64_t now = esp_timer_get_time();
+  uint32_t frames = stream_frames_sent();
+  s_channels[s_channel].frames += frames - s_frames_at_switch;
+  s_channels[s_channel].time_us += now - s_channel_since_us;
+  s_frames_at_switch = frames;
+  s_channel_since_us = now;
+}
+
+static auto channel_fps(const ChannelStats& stats) -> float {
+  return stats.time_us == 0 ? 0.0F : static_cast<float>(stats.frames) * 1e6F / static_cast<float>(stats.time_us);
+}
+
+static auto connected_stations() -> int {
+  wifi_sta_list_t sta_list;
+  return esp_wifi_ap_get_sta_list(&sta_list) == ESP_OK ? sta_list.num : 0;
+}
+
+// the AP announces the move for csa_count beacons before switching
+static auto move_to_channel(uint8_t channel) -> void {
+  wifi_config_t wifi_config;
+  if (esp_wifi_get_config(WIFI_IF_AP, &wifi_config) != ESP_OK) {
+    return;
+  }
+  account_channel_time();
+  ESP_LOGW(
+    TAG,
+    "Moving AP from channel %u (score %.2f, %.1f fps) to %u (score %.2f)",
+    s_channel,
+    s_channels[s_channel].score,
+    channel_fps(s_channels[s_channel]),
+    channel,
+    s_channels[channel].score);
+  wifi_config.ap.channel = channel;
+  if (esp_wifi_set_config(WIFI_IF_AP, &wifi_config) != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to move AP to channel %u", channel);
+    return;
+  }
+  s_channel = channel;
+  s_channel_gauge.set(channel);
+  s_channel_switches.increment();
+}
+
+static auto channel_review_task(void* /*arg*/) -> void {
+  while (true) {
+    vTaskDelay(pdMS_TO_TICKS(channel_review_interval_ms));
+    if (connected_stations() > 0) {
+      continue;
+    }
+    // scanning needs the station interface, the AP keeps beaconing in between channels
+    if (esp_wifi_set_mode(WIFI_MODE_APSTA) != ESP_OK) {
+      continue;
+    }
+    bool scored = score_channels();
+    esp_wifi_set_mode(WIFI_MODE_AP);
+    if (!scored) {
+      continue;
+    }
+    uint8_t best = quietest_channel();
+    if (best != s_channel && s_channels[best].score + channel_switch_margin < s_channels[s_channel].score) {
+      move_to_channel(best);
+    }
+  }
+}
+
+// "ap channels", replies with the score and achieved stream fps of every channel as json
+static auto ap_command(int fd, std::string_view args) -> void {
+  if (args != "channels") {
+    ESP_LOGW(TAG, "Unknown ap command: %.*s", static_cast<int>(args.size()), args.data());
+    return;
+  }
+  account_channel_time();
+  std::string body = "{\"channel\":" + std::to_string(s_channel) + ",\"channels\":[";
+  std::array<char, 96> line{};
+  for (uint8_t channel = 1; channel <= max_channel; channel++) {
+    snprintf(
+      line.data(),
+      line.size(),
+      "%s{\"channel\":%u,\"score\":%.2f,\"fps\":%.1f}",
+      channel == 1 ? "" : ",",
+      channel,
+      s_channels[channel].score,
+      channel_fps(s_channels[channel]));
+    body += line.data();
+  }
+  body += "]}";
+  server::ws_send_text(fd, body.data(), body.size());
+}
+
 // hotspot
 void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 auto setup_wifi() -> void {
@@ -28,7 +215,7 @@ auto setup_wifi() -> void {
         .ssid = WIFI_AP_SSID,
         .password = WIFI_AP_PASS,
         .ssid_len = static_cast<uint8_t>(strlen(WIFI_AP_SSID)),
-        .channel = 1,
+        .channel = default_channel,
         .authmode = WIFI_AUTH_WPA2_PSK,
         .ssid_hidden = 0,
         .max_connection = MAX_CONNECTIONS,
@@ -49,6 +236,18 @@ auto setup_wifi() -> void {
   // Set WiFi country to match iOS device (example for US)
   esp_wifi_set_country_code("CA", true);
 
+  // pick the least crowded channel before anyone joins
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  ESP_ERROR_CHECK(esp_wifi_start());
+  if (score_channels()) {
+    s_channel = quietest_channel();
+  }
+  ESP_ERROR_CHECK(esp_wifi_stop());
+  wifi_config.ap.channel = s_channel;
+  s_channel_since_us = esp_timer_get_time();
+  s_channel_gauge.set(s_channel);
+  ESP_LOGI(TAG, "Starting AP on channel %u (score %.2f)", s_channel, s_channels[s_channel].score);
+
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_config));
   ESP_ERROR_CHECK(esp_wifi_start());
@@ -58,6 +257,9 @@ auto setup_wifi() -> void {
   ESP_LOGI("WIFI", "AP Started with IP: " IPSTR, IP2STR(&ip_info.ip));
 
   ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
+
+  register_text_command("ap", ap_command);
+  xTaskCreate(channel_review_task, "channel_review", 3072, nullptr, tskIDLE_PRIORITY + 1, nullptr);
 }
 
 void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
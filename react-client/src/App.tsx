@@ -1,15 +1,19 @@
 import ConnectionIndicator from './connection-indicator';
 import MotorSpeedControl from './motor-speed-control'
 import { useCustomWebSocket } from './lib/useWebSocket';
+import { createJpegReassembler } from './lib/jpegTables';
 import { VideoStream } from './video-stream';
-import { useState } from 'react';
+import { useRef, useState } from 'react';
 export default function App() {
   // eslint-disable-next-line @typescript-eslint/no-explicit-any
   const [imageData, setImageData] = useState<any>(null);
+  // frames from "start tables" arrive without their JPEG headers
+  const reassembler = useRef(createJpegReassembler());
 
   const {
     isConnected,
     error,
+    sendMessage,
     sendBinaryData,
     reconnectAttempt,
   } = useCustomWebSocket('ws://10.0.0.212/motor_control', {
@@ -19,9 +23,17 @@ export default function App() {
     pingIntervalMs: 5000,
     pongTimeoutMs: 5000,
     shouldReconnect: () => true,
+    onOpen: () => reassembler.current.reset(),
     onMessage: (event) => {
       console.log(event)
-      setImageData(event.data)
+      if (!(event.data instanceof Blob)) {
+        return;
+      }
+      reassembler.current.push(event.data).then((frame) => {
+        if (frame) {
+          setImageData(frame)
+        }
+      })
     }
   });
 
@@ -33,7 +45,8 @@ export default function App() {
 
   return (
     <main className="flex min-h-screen flex-col items-center justify-center p-24">
-      <VideoStream imageData={imageData} />
+      {/* in credit mode ("start credit") the server only sends a frame for every one we've shown */}
+      <VideoStream imageData={imageData} onFrameShown={() => sendMessage("credit 1")} />
       <div className="mb-4">
         <ConnectionIndicator isConnected={isConnected} error={error} reconnectAttempt={reconnectAttempt} />
       </div>
@@ -0,0 +1,55 @@
+/**
+ * Puts streamed frames back together in tables mode ("start tables").
+ *
+ * The device sends the JPEG headers (SOI up to the SOS marker) as a JpegTables packet whenever they change and leaves
+ * them off the frames after it. Frame headers ("start header") are stripped, so only a decodable JPEG comes out.
+ */
+const PACKET_FRAME = 0x04;
+const PACKET_JPEG_TABLES = 0x05;
+// u8 type, u8 version, u32 sequence, u64 capture us, u16 exposure, u16 gain, u64 motor commands
+const FRAME_HEADER_SIZE = 26;
+
+export interface JpegReassembler {
+  // resolves to the message's JPEG, completed and without a frame header, null for anything that isn't a frame
+  push: (data: Blob) => Promise<Blob | null>;
+  reset: () => void;
+}
+
+export function createJpegReassembler(): JpegReassembler {
+  let tables: Blob | null = null;
+  // messages are handled one at a time, so a tables packet lands before the frames that follow it
+  let tail: Promise<unknown> = Promise.resolve();
+
+  const handle = async (data: Blob): Promise<Blob | null> => {
+    const head = new Uint8Array(await data.slice(0, FRAME_HEADER_SIZE + 2).arrayBuffer());
+    if (head[0] === PACKET_JPEG_TABLES) {
+      tables = data.slice(2, data.size, "image/jpeg");
+      return null;
+    }
+    const jpegStart = head[0] === PACKET_FRAME ? FRAME_HEADER_SIZE : 0;
+    const jpeg = data.slice(jpegStart, data.size, "image/jpeg");
+    if (head[jpegStart] === 0xff && head[jpegStart + 1] === 0xd8) {
+      return jpeg;
+    }
+    if (head[jpegStart] !== 0xff || head[jpegStart + 1] !== 0xda) {
+      // telemetry and other packets
+      return null;
+    }
+    if (tables === null) {
+      // joined mid stream without the tables, nothing to show until they come again
+      return null;
+    }
+    return new Blob([tables, jpeg], { type: "image/jpeg" });
+  };
+
+  return {
+    push: (data) => {
+      const result = tail.then(() => handle(data));
+      tail = result.catch(() => undefined);
+      return result;
+    },
+    reset: () => {
+      tables = null;
+    },
+  };
+}
@@ -21,8 +21,25 @@ export interface UseCustomWebSocketConfig extends Options {
   enablePingPong?: boolean;
   pingIntervalMs?: number;  // default: 5000
   pongTimeoutMs?: number;   // default: 5000
+  enableClockSync?: boolean; // answer the device's clock probes, see deviceToClientMs
 }
 
+/**
+ * The device's estimate of our clock relative to its esp_timer clock, from its "clock" messages.
+ */
+export interface ClockEstimate {
+  reference_us: number;
+  offset_us: number;
+  drift_ppm: number;
+  rtt_us: number;
+  samples: number;
+}
+
+/**
+ * Microseconds on the clock the device syncs against.
+ */
+const clientNowUs = () => Math.round((performance.timeOrigin + performance.now()) * 1000);
+
 /**
  * Return type for our custom hook.
  */
@@ -37,6 +54,10 @@ export interface UseCustomWebSocketReturn {
   manualDisconnect: () => void;
   manualReconnect: () => void;
   reconnectAttempt: number;
+  lastRttMs: number | null;  // round trip of the latest ping/pong
+  clockEstimate: ClockEstimate | null;
+  // device timestamp (frame header, telemetry) to epoch ms on this client, null until synced
+  deviceToClientMs: (deviceUs: number) => number | null;
 }
 
 export function useCustomWebSocket(
@@ -47,6 +68,7 @@ export function useCustomWebSocket(
     enablePingPong = false,
     pingIntervalMs = 5000,
     pongTimeoutMs = 5000,
+    enableClockSync = false,
     // ...any other react-use-websocket options
     ...reactUseWsOptions
   } = config;
@@ -67,6 +89,10 @@ export function useCustomWebSocket(
   const pingIntervalRef = useRef<ReturnType<typeof setInterval> | null>(null);
   const pongTimeoutRef = useRef<ReturnType<typeof setTimeout> | null>(null);
   const didPongRef = useRef<boolean>(false);
+  const pingSentAtRef = useRef<number>(0);
+  const [lastRttMs, setLastRttMs] = useState<number | null>(null);
+  const [clockEstimate, setClockEstimate] = useState<ClockEstimate | null>(null);
+  const clockEstimateRef = useRef<ClockEstimate | null>(null);
 
   /**
    * Clears all ping/pong timers.
@@ -94,10 +120,15 @@ export function useCustomWebSocket(
     // If the user provided a custom onOpen, call it
     reactUseWsOptions.onOpen?.(event);
 
+    if (enableClockSync) {
+      sendMessage("sync start");
+    }
+
     // Start ping/pong if enabled
     if (enablePingPong) {
       pingIntervalRef.current = setInterval(() => {
         didPongRef.current = false;
+        pingSentAtRef.current = performance.now();
         sendMessage("ping");
 
         // Set a timeout to wait for "pong"
@@ -133,9 +164,24 @@ export function useCustomWebSocket(
   };
 
   const onMessage: Options["onMessage"] = (event) => {
+    // Stamp clock probes before anything else, our own work would count as network delay
+    const receivedUs = clientNowUs();
+    if (typeof event.data === "string" && event.data.startsWith("sync ")) {
+      const deviceUs = event.data.slice(5);
+      sendMessage(`sync echo ${deviceUs} ${receivedUs} ${clientNowUs()}`);
+      return;
+    }
+    if (typeof event.data === "string" && event.data.startsWith("clock ")) {
+      const estimate = JSON.parse(event.data.slice(6)) as ClockEstimate;
+      clockEstimateRef.current = estimate;
+      setClockEstimate(estimate);
+      return;
+    }
+
     // Handle pong response
     if (event.data === "pong") {
       didPongRef.current = true;
+      setLastRttMs(performance.now() - pingSentAtRef.current);
       return;
     }
     
@@ -227,6 +273,18 @@ export function useCustomWebSocket(
     [sendMessage]
   );
 
+  const deviceToClientMs = useCallback((deviceUs: number) => {
+    const estimate = clockEstimateRef.current;
+    if (!estimate || estimate.samples === 0) {
+      return null;
+    }
+    const clientUs =
+      deviceUs +
+      estimate.offset_us +
+      ((deviceUs - estimate.reference_us) * estimate.drift_ppm) / 1e6;
+    return clientUs / 1000;
+  }, []);
+
   const isConnected = connectionState === CustomConnectionState.CONNECTED;
 
   return {
@@ -239,5 +297,8 @@ export function useCustomWebSocket(
     manualDisconnect,
     manualReconnect,
     reconnectAttempt,
+    lastRttMs,
+    clockEstimate,
+    deviceToClientMs,
   };
 }
@@ -1,7 +1,14 @@
 import { useState, useEffect, useRef } from "react";
 
-// eslint-disable-next-line @typescript-eslint/no-explicit-any
-export function VideoStream({ imageData }: { imageData: any }) {
+export function VideoStream({
+  imageData,
+  onFrameShown,
+}: {
+  // eslint-disable-next-line @typescript-eslint/no-explicit-any
+  imageData: any;
+  // called once a frame has been decoded, e.g. to grant the server credit for the next one
+  onFrameShown?: () => void;
+}) {
   const [imageUrl, setImageUrl] = useState<string | undefined>(undefined);
   const [fps, setFps] = useState(0);
   const frameTimestamps = useRef<number[]>([]);
@@ -75,7 +82,7 @@ export function VideoStream({ imageData }: { imageData: any }) {
   return (
     <div>
       <div>FPS: {fps.toFixed(1)}</div>
-      <img src={imageUrl} alt="Video Stream" />
+      <img src={imageUrl} alt="Video Stream" onLoad={onFrameShown} />
     </div>
   );
 }
\ No newline at end of file